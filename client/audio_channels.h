@@ -46,8 +46,10 @@ private:
     void handle_stop(RedPeer::InMessage* message);
     void handle_raw_data(RedPeer::InMessage* message);
     void handle_celt_data(RedPeer::InMessage* message);
+    void handle_latency(RedPeer::InMessage* message);
     void null_handler(RedPeer::InMessage* message);
     void disable();
+    void sync_mm_time(uint32_t time);
 
     void set_data_handler();
 
@@ -61,6 +63,9 @@ private:
     CELTDecoder *_celt_decoder;
     bool _playing;
     uint32_t _frame_count;
+    uint32_t _min_latency;
+    uint32_t _synced_delay;
+    uint32_t _synced_frame;
 };
 
 class RecordChannel: public RedChannel, private Platform::RecordClient {
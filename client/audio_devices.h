@@ -27,6 +27,8 @@ public:
     virtual bool abort() = 0;
     virtual void stop() = 0;
     virtual uint32_t get_delay_ms() = 0;
+    /* the server asks for a minimal latency for syncing the audio with video */
+    virtual void set_min_latency(uint32_t latency_ms) {}
 
     enum {
         FRAME_SIZE = 256,
@@ -53,6 +53,11 @@ public:
         pixman_image_unref(surf);
     }
 
+    static inline size_t size(pixman_image_t *surf)
+    {
+        return abs(pixman_image_get_stride(surf)) * pixman_image_get_height(surf);
+    }
+
     static const char* name() { return "pixmap";}
 };
 
@@ -0,0 +1,159 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2013 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "common.h"
+#include "decode_pool.h"
+#include "debug.h"
+
+static Mutex pool_lock;
+static DecodePool* pool = NULL;
+static bool pool_initialized = false;
+
+static int get_num_cpus()
+{
+#ifdef WIN32
+    SYSTEM_INFO info;
+
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
+
+DecodeBatch::DecodeBatch(DecodePool& pool)
+    : _pool (pool)
+    , _pending (0)
+{
+}
+
+DecodeBatch::~DecodeBatch()
+{
+    wait();
+}
+
+void DecodeBatch::add(DecodeJob& job)
+{
+    Lock lock(_pool._lock);
+    job._batch = this;
+    _pending++;
+    _pool._jobs.push_back(&job);
+    _pool._work.notify_one();
+}
+
+void DecodeBatch::wait()
+{
+    for (;;) {
+        DecodeJob* job;
+        {
+            Lock lock(_pool._lock);
+            if (!(job = _pool.get_job(this))) {
+                while (_pending) {
+                    _done.wait(lock);
+                }
+                return;
+            }
+        }
+        job->run();
+        _pool.job_done(job);
+    }
+}
+
+DecodePool::DecodePool(int num_threads)
+{
+    for (int i = 0; i < num_threads; i++) {
+        try {
+            _threads.push_back(new Thread(DecodePool::thread_main, this));
+        } catch (...) {
+            LOG_WARN("failed to create decode thread");
+            break;
+        }
+    }
+}
+
+DecodePool* DecodePool::get()
+{
+    Lock lock(pool_lock);
+
+    if (!pool_initialized) {
+        int num_threads = MIN(get_num_cpus() - 1, DECODE_POOL_MAX_THREADS);
+
+        pool_initialized = true;
+        if (num_threads > 0) {
+            /* the pool lives as long as the process */
+            pool = new DecodePool(num_threads);
+            if (!pool->get_num_threads()) {
+                delete pool;
+                pool = NULL;
+            } else {
+                LOG_INFO("%d decode threads", pool->get_num_threads());
+            }
+        }
+    }
+    return pool;
+}
+
+DecodeJob* DecodePool::get_job(DecodeBatch* batch)
+{
+    std::list<DecodeJob*>::iterator iter = _jobs.begin();
+
+    for (; iter != _jobs.end(); ++iter) {
+        if (!batch || (*iter)->_batch == batch) {
+            DecodeJob* job = *iter;
+            _jobs.erase(iter);
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void DecodePool::job_done(DecodeJob* job)
+{
+    Lock lock(_lock);
+    DecodeBatch* batch = job->_batch;
+
+    job->_batch = NULL;
+    if (!--batch->_pending) {
+        batch->_done.notify_all();
+    }
+}
+
+void DecodePool::run()
+{
+    for (;;) {
+        DecodeJob* job;
+        {
+            Lock lock(_lock);
+            while (!(job = get_job(NULL))) {
+                _work.wait(lock);
+            }
+        }
+        job->run();
+        job_done(job);
+    }
+}
+
+void* DecodePool::thread_main(void* opaque)
+{
+    static_cast<DecodePool*>(opaque)->run();
+    return NULL;
+}
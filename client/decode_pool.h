@@ -0,0 +1,85 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2013 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_DECODE_POOL
+#define _H_DECODE_POOL
+
+#include "common.h"
+#include "threads.h"
+
+#define DECODE_POOL_MAX_THREADS 4
+
+class DecodeBatch;
+class DecodePool;
+
+/* A pool of threads, shared by all the channels, that decodes parts of an image in
+ * parallel. The jobs are added to a batch, and all of them are done when
+ * DecodeBatch::wait returns. The thread that waits runs the jobs that no pool thread
+ * took yet. */
+class DecodeJob {
+public:
+    DecodeJob() : _batch (NULL) {}
+    virtual ~DecodeJob() {}
+    virtual void run() = 0;
+
+private:
+    friend class DecodePool;
+    friend class DecodeBatch;
+    DecodeBatch* _batch;
+};
+
+class DecodeBatch {
+public:
+    DecodeBatch(DecodePool& pool);
+    ~DecodeBatch();
+
+    void add(DecodeJob& job);
+    void wait();
+
+private:
+    friend class DecodePool;
+    DecodePool& _pool;
+    int _pending;
+    Condition _done;
+};
+
+class DecodePool {
+public:
+    /* returns NULL if there is a single cpu */
+    static DecodePool* get();
+
+    int get_num_threads() { return _threads.size();}
+
+private:
+    DecodePool(int num_threads);
+
+    static void* thread_main(void* opaque);
+    void run();
+    /* called with the lock held */
+    DecodeJob* get_job(DecodeBatch* batch);
+    void job_done(DecodeJob* job);
+
+private:
+    friend class DecodeBatch;
+    Mutex _lock;
+    Condition _work;
+    std::list<DecodeJob*> _jobs;
+    std::vector<Thread*> _threads;
+};
+
+#endif
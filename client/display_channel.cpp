@@ -19,6 +19,8 @@
 #include <config.h>
 #endif
 
+#include "common/rect.h"
+
 #include "common.h"
 #include "red_pixmap.h"
 #ifdef USE_OPENGL
@@ -170,23 +172,33 @@ private:
 
 
 #define MAX_VIDEO_FRAMES 30
+#define MIN_VIDEO_FRAMES 4
 #define MAX_OVER 15
 #define MAX_UNDER -15
+/* frames are decoded this long (ms) before they are due, plus the average decode time */
+#define DECODE_LEAD 15
+/* the weight of a new sample in the frame timing averages */
+#define FRAME_STATS_WEIGHT 16
+/* a report is sent right away after this many frames were dropped in a row */
+#define STREAM_REPORT_DROP_SEQ_LEN_LIMIT 3
 
 
 class VideoStream {
 public:
-    VideoStream(RedClient& client, Canvas& canvas, DisplayChannel& channel,
+    VideoStream(RedClient& client, Canvas& canvas, DisplayChannel& channel, uint32_t id,
                 uint32_t codec_type, bool top_down, uint32_t stream_width,
                 uint32_t stream_height, uint32_t src_width, uint32_t src_height,
                 SpiceRect* dest, int clip_type, uint32_t num_clip_rects, SpiceRect* clip_rects);
     ~VideoStream();
 
     void push_data(uint32_t mm_time, uint32_t length, uint8_t* data);
+    void push_sized_data(uint32_t mm_time, uint32_t length, uint8_t* data,
+                         uint32_t width, uint32_t height, const SpiceRect& dest);
     void set_clip(int type, uint32_t num_clip_rects, SpiceRect* clip_rects);
     const SpiceRect& get_dest() {return _dest;}
     void handle_update_mark(uint64_t update_mark);
     uint32_t handle_timer_update(uint32_t now);
+    void activate_report(uint32_t report_id, uint32_t max_window_size, uint32_t timeout);
 
 private:
     void free_frame(uint32_t frame_index);
@@ -195,13 +207,29 @@ private:
     uint32_t alloc_frame_slot();
     void maintenance();
     void drop_one_frame();
+    void drop_frame(uint32_t frame_index);
+    bool drop_needs_decode(uint32_t frame_index);
     uint32_t frame_slot(uint32_t frame_index) { return frame_index % MAX_VIDEO_FRAMES;}
     static bool is_time_to_display(uint32_t now, uint32_t frame_time);
 
+    struct VideoFrame;
+    void update_frame_stats(const VideoFrame& frame);
+    int get_decode_lead() { return DECODE_LEAD + _decode_duration / 1000;}
+    void skip_superseded_frames(uint32_t mm_time);
+    void report_frame(const VideoFrame& frame, bool dropped);
+    void push_frame(const VideoFrame& frame, uint8_t* data);
+    bool is_full_frame(const VideoFrame& frame);
+    bool is_partial_frame(const VideoFrame& frame);
+    bool is_buffer_frame(const VideoFrame& frame);
+    bool put_frame(VideoFrame& frame);
+    bool put_partial_frame(VideoFrame& frame);
+    bool put_sized_frame(VideoFrame& frame);
+
 private:
     RedClient& _client;
     Canvas& _canvas;
     DisplayChannel& _channel;
+    uint32_t _id;
     MJpegDecoder *_mjpeg_decoder;
     int _stream_width;
     int _stream_height;
@@ -210,11 +238,18 @@ private:
     SpiceRect _dest;
     QRegion _clip_region;
     QRegion* _clip;
+    /* the parts of the frame buffer that dropped frames were decoded to, and that are
+       displayed with the next frame (see drop_frame) */
+    QRegion _undisplayed_area;
 
     struct VideoFrame {
         uint32_t mm_time;
+        int32_t delay; // mm_time - the client mm_time when the frame arrived
         uint32_t compressed_data_size;
         uint8_t* compressed_data;
+        uint32_t width;
+        uint32_t height;
+        SpiceRect dest;
     };
 
     uint32_t _frames_head;
@@ -222,6 +257,33 @@ private:
     uint32_t _kill_mark;
     VideoFrame _frames[MAX_VIDEO_FRAMES];
 
+    /* The number of queued frames is bounded by the time frames wait until they are due,
+       with a margin for the variance of their arrival. */
+    uint32_t _max_frames;
+    int _arrival_delay;
+    int _arrival_jitter;
+    int _frame_interval;
+    uint32_t _last_frame_time;
+    int _decode_duration; // usec
+    /* the mm_time at which the tail frame should be decoded, 0 if there is none */
+    uint32_t _decode_time;
+    /* decoded frames that were too late to be displayed. Incremented by the streams timer,
+       only the difference to _reported_late_frames is used by the channel thread. */
+    uint32_t _late_frames;
+    uint32_t _reported_late_frames;
+
+    struct StreamReport {
+        bool active;
+        uint32_t id;
+        uint32_t max_window_size;
+        uint32_t timeout;
+        uint32_t start_time;
+        uint32_t start_frame_time;
+        uint32_t num_frames;
+        uint32_t num_drops;
+        uint32_t drops_seq_len;
+    } _report;
+
 #ifdef WIN32
     HBITMAP _prev_bitmap;
     HDC _dc;
@@ -230,6 +292,7 @@ private:
     PixmapHeader _pixmap;
     uint64_t _update_mark;
     uint32_t _update_time;
+    SpiceRect _update_area;
 
 public:
     VideoStream* next;
@@ -274,13 +337,14 @@ static int create_bitmap(HDC *dc, HBITMAP *prev_bitmap,
 #endif
 
 VideoStream::VideoStream(RedClient& client, Canvas& canvas, DisplayChannel& channel,
-                         uint32_t codec_type, bool top_down, uint32_t stream_width,
+                         uint32_t id, uint32_t codec_type, bool top_down, uint32_t stream_width,
                          uint32_t stream_height, uint32_t src_width, uint32_t src_height,
                          SpiceRect* dest, int clip_type, uint32_t num_clip_rects,
                          SpiceRect* clip_rects)
     : _client (client)
     , _canvas (canvas)
     , _channel (channel)
+    , _id (id)
     , _mjpeg_decoder (NULL)
     , _stream_width (stream_width)
     , _stream_height (stream_height)
@@ -291,13 +355,25 @@ VideoStream::VideoStream(RedClient& client, Canvas& canvas, DisplayChannel& chan
     , _frames_head (0)
     , _frames_tail (0)
     , _kill_mark (0)
+    , _max_frames (MAX_VIDEO_FRAMES)
+    , _arrival_delay (0)
+    , _arrival_jitter (0)
+    , _frame_interval (0)
+    , _last_frame_time (0)
+    , _decode_duration (0)
+    , _decode_time (0)
+    , _late_frames (0)
+    , _reported_late_frames (0)
     , _uncompressed_data (NULL)
     , _update_mark (0)
     , _update_time (0)
+    , _update_area (*dest)
     , next (NULL)
 {
     memset(_frames, 0, sizeof(_frames));
+    memset(&_report, 0, sizeof(_report));
     region_init(&_clip_region);
+    region_init(&_undisplayed_area);
     if (codec_type != SPICE_VIDEO_CODEC_TYPE_MJPEG) {
       THROW("invalid video codec type %u", codec_type);
     }
@@ -350,6 +426,7 @@ VideoStream::~VideoStream()
     }
     release_all_bufs();
     region_destroy(&_clip_region);
+    region_destroy(&_undisplayed_area);
 }
 
 void VideoStream::release_all_bufs()
@@ -381,17 +458,22 @@ void VideoStream::remove_dead_frames(uint32_t mm_time)
         if (int(_frames[frame_slot(_frames_tail)].mm_time - mm_time) >= MAX_UNDER) {
             return;
         }
-        free_frame(_frames_tail);
-        _frames_tail++;
+        drop_frame(_frames_tail++);
     }
 }
 
 void VideoStream::drop_one_frame()
 {
-    ASSERT(MAX_VIDEO_FRAMES > 2 && (_frames_head - _frames_tail) == MAX_VIDEO_FRAMES);
-    unsigned frame_index = _frames_head - _kill_mark++ % (MAX_VIDEO_FRAMES - 2) - 2;
+    uint32_t num_frames = _frames_head - _frames_tail;
 
-    free_frame(frame_index);
+    ASSERT(num_frames > 2 && num_frames <= MAX_VIDEO_FRAMES);
+    unsigned frame_index = _frames_head - _kill_mark++ % (num_frames - 2) - 2;
+
+    // the older frames would overwrite it in the frame buffer, it is decoded in order
+    if (drop_needs_decode(frame_index)) {
+        frame_index = _frames_tail;
+    }
+    drop_frame(frame_index);
 
     while (frame_index != _frames_tail) {
         --frame_index;
@@ -406,28 +488,259 @@ bool VideoStream::is_time_to_display(uint32_t now, uint32_t frame_time)
     return delta <= MAX_OVER && delta >= MAX_UNDER;
 }
 
+/* a frame can replace another on screen only if it covers all of its area */
+static bool rect_covers(const SpiceRect& r, const SpiceRect& area)
+{
+    return r.left <= area.left && r.top <= area.top &&
+           r.right >= area.right && r.bottom >= area.bottom;
+}
+
+/* The server sends partial frames relative to the frames it sent before, so a dropped
+   frame of the frame buffer is still decoded to it, unless the next frame replaces it.
+   It is not displayed, its area is displayed together with the next frame. */
+bool VideoStream::drop_needs_decode(uint32_t frame_index)
+{
+    VideoFrame* frame = &_frames[frame_slot(frame_index)];
+    VideoFrame* next = &_frames[frame_slot(frame_index + 1)];
+
+    if (!is_buffer_frame(*frame)) {
+        return false;
+    }
+    return frame_index + 1 == _frames_head || !is_buffer_frame(*next) ||
+           !rect_covers(next->dest, frame->dest);
+}
+
+void VideoStream::drop_frame(uint32_t frame_index)
+{
+    VideoFrame* frame = &_frames[frame_slot(frame_index)];
+
+    report_frame(*frame, true);
+    if (drop_needs_decode(frame_index)) {
+        int x = frame->dest.left - _dest.left;
+        int y = _top_down ? frame->dest.top - _dest.top : _dest.bottom - frame->dest.bottom;
+
+        _mjpeg_decoder->set_frame_area(x, y, frame->width, frame->height);
+        if (_mjpeg_decoder->decode_data(frame->compressed_data, frame->compressed_data_size)) {
+            region_add(&_undisplayed_area, &frame->dest);
+        }
+        _mjpeg_decoder->set_frame_area(0, 0, _stream_width, _stream_height);
+    }
+    free_frame(frame_index);
+}
+
+bool VideoStream::put_frame(VideoFrame& frame)
+{
+    if (!_mjpeg_decoder->decode_data(frame.compressed_data, frame.compressed_data_size)) {
+        return false;
+    }
+    region_clear(&_undisplayed_area);
+#ifdef WIN32
+    _canvas.put_image(_dc, _pixmap, _dest, _clip);
+#else
+    _canvas.put_image(_pixmap, _dest, _clip);
+#endif
+    return true;
+}
+
+bool VideoStream::is_full_frame(const VideoFrame& frame)
+{
+    return (int)frame.width == _stream_width && (int)frame.height == _stream_height &&
+           rect_is_equal(&frame.dest, &_dest);
+}
+
+/* a partial frame updates a part of an unscaled stream */
+bool VideoStream::is_partial_frame(const VideoFrame& frame)
+{
+    return _stream_width == _dest.right - _dest.left &&
+           _stream_height == _dest.bottom - _dest.top &&
+           (int)frame.width == frame.dest.right - frame.dest.left &&
+           (int)frame.height == frame.dest.bottom - frame.dest.top &&
+           frame.width && frame.height &&
+           frame.dest.left >= _dest.left && frame.dest.right <= _dest.right &&
+           frame.dest.top >= _dest.top && frame.dest.bottom <= _dest.bottom;
+}
+
+/* the frames that are decoded to the stream frame buffer */
+bool VideoStream::is_buffer_frame(const VideoFrame& frame)
+{
+    return is_full_frame(frame) || is_partial_frame(frame);
+}
+
+bool VideoStream::put_partial_frame(VideoFrame& frame)
+{
+    int x = frame.dest.left - _dest.left;
+    // the lines of bottom-up streams are stored from the bottom
+    int y = _top_down ? frame.dest.top - _dest.top : _dest.bottom - frame.dest.bottom;
+    bool got_picture;
+
+    _mjpeg_decoder->set_frame_area(x, y, frame.width, frame.height);
+    got_picture = _mjpeg_decoder->decode_data(frame.compressed_data, frame.compressed_data_size);
+    _mjpeg_decoder->set_frame_area(0, 0, _stream_width, _stream_height);
+    if (!got_picture) {
+        return false;
+    }
+
+    // the rest of the stream area may have been drawn over since the last frame
+    QRegion clip;
+
+    region_init(&clip);
+    region_add(&clip, &frame.dest);
+    region_or(&clip, &_undisplayed_area);
+    region_clear(&_undisplayed_area);
+    if (_clip) {
+        region_and(&clip, _clip);
+    }
+#ifdef WIN32
+    _canvas.put_image(_dc, _pixmap, _dest, &clip);
+#else
+    _canvas.put_image(_pixmap, _dest, &clip);
+#endif
+    region_destroy(&clip);
+    return true;
+}
+
+/* a frame with a different size than the stream, e.g., after the video was resized */
+bool VideoStream::put_sized_frame(VideoFrame& frame)
+{
+    PixmapHeader pixmap;
+    uint8_t* data;
+    int stride = frame.width * sizeof(uint32_t);
+    bool got_picture;
+
+    if (!frame.width || !frame.height) {
+        return false;
+    }
+#ifdef WIN32
+    HDC dc;
+    HBITMAP prev_bitmap;
+
+    if (!create_bitmap(&dc, &prev_bitmap, &data, &stride, frame.width, frame.height, _top_down)) {
+        THROW("create_bitmap failed");
+    }
+#else
+    data = new uint8_t[stride * frame.height];
+#endif
+    MJpegDecoder decoder(frame.width, frame.height, stride, data,
+                         _channel.get_peer_major() == 1);
+
+    got_picture = decoder.decode_data(frame.compressed_data, frame.compressed_data_size);
+    if (got_picture) {
+        pixmap.width = frame.width;
+        pixmap.height = frame.height;
+        if (_top_down) {
+            pixmap.data = data;
+            pixmap.stride = stride;
+        } else {
+            pixmap.data = data + stride * (frame.height - 1);
+            pixmap.stride = -stride;
+        }
+#ifdef WIN32
+        _canvas.put_image(dc, pixmap, frame.dest, _clip);
+#else
+        _canvas.put_image(pixmap, frame.dest, _clip);
+#endif
+    }
+#ifdef WIN32
+    DeleteObject(SelectObject(dc, prev_bitmap));
+    DeleteObject(dc);
+#else
+    delete[] data;
+#endif
+    return got_picture;
+}
+
+void VideoStream::update_frame_stats(const VideoFrame& frame)
+{
+    int interval = frame.mm_time - _last_frame_time;
+    int buffer_time;
+
+    if (!_last_frame_time) {
+        _arrival_delay = frame.delay;
+    } else {
+        _arrival_jitter += (abs(frame.delay - _arrival_delay) - _arrival_jitter) /
+                           FRAME_STATS_WEIGHT;
+        _arrival_delay += (frame.delay - _arrival_delay) / FRAME_STATS_WEIGHT;
+        if (interval > 0 && interval < 1000) {
+            _frame_interval = _frame_interval ? _frame_interval +
+                                                (interval - _frame_interval) / FRAME_STATS_WEIGHT :
+                                                interval;
+        }
+    }
+    _last_frame_time = frame.mm_time;
+
+    if (!_frame_interval) {
+        return;
+    }
+    // frames wait in the queue until they are due, early bursts need some more room
+    buffer_time = MAX(_arrival_delay + 4 * _arrival_jitter, 0);
+    _max_frames = MIN(MAX(buffer_time / _frame_interval + 2, MIN_VIDEO_FRAMES),
+                      MAX_VIDEO_FRAMES);
+}
+
+/* drops the frames that would be replaced on screen right after they are displayed.
+   They are decoded only if the frame buffer needs them, see drop_frame. */
+void VideoStream::skip_superseded_frames(uint32_t mm_time)
+{
+    while (_frames_head - _frames_tail > 1) {
+        VideoFrame* tail = &_frames[frame_slot(_frames_tail)];
+        VideoFrame* next = &_frames[frame_slot(_frames_tail + 1)];
+
+        if (int(next->mm_time - mm_time) > get_decode_lead() ||
+            !rect_covers(next->dest, tail->dest)) {
+            return;
+        }
+        drop_frame(_frames_tail++);
+    }
+}
+
 void VideoStream::maintenance()
 {
     uint32_t mm_time = _client.get_mm_time();
 
     remove_dead_frames(mm_time);
     if (!_update_mark && !_update_time && _frames_head != _frames_tail) {
+        skip_superseded_frames(mm_time);
+
         VideoFrame* tail = &_frames[frame_slot(_frames_tail)];
+        uint32_t decode_time = tail->mm_time - get_decode_lead();
+        uint64_t decode_start;
+        SpiceRect update_area = tail->dest;
+        bool got_picture;
+
+        // a newer frame that arrives until then may supersede this one
+        if (int(decode_time - mm_time) > 0) {
+            _decode_time = decode_time;
+            _channel.stream_update_request(decode_time);
+            return;
+        }
+        _decode_time = 0;
 
         ASSERT(tail->compressed_data);
-        uint8_t* data = tail->compressed_data;
-        uint32_t length = tail->compressed_data_size;
-        int got_picture = 0;
-
-        got_picture =_mjpeg_decoder->decode_data(data, length);
+        decode_start = Platform::get_monolithic_time();
+        if (is_full_frame(*tail)) {
+            got_picture = put_frame(*tail);
+        } else if (is_partial_frame(*tail)) {
+            // the area of the dropped frames is displayed too
+            if (!region_is_empty(&_undisplayed_area)) {
+                pixman_box32_t* extents = pixman_region32_extents(&_undisplayed_area);
+
+                update_area.left = MIN(update_area.left, extents->x1);
+                update_area.top = MIN(update_area.top, extents->y1);
+                update_area.right = MAX(update_area.right, extents->x2);
+                update_area.bottom = MAX(update_area.bottom, extents->y2);
+            }
+            got_picture = put_partial_frame(*tail);
+        } else {
+            got_picture = put_sized_frame(*tail);
+        }
+        _decode_duration += (int((Platform::get_monolithic_time() - decode_start) / 1000) -
+                             _decode_duration) / FRAME_STATS_WEIGHT;
+        report_frame(*tail, !got_picture);
         if (got_picture) {
-#ifdef WIN32
-            _canvas.put_image(_dc, _pixmap, _dest, _clip);
-#else
-            _canvas.put_image(_pixmap, _dest, _clip);
-#endif
+            mm_time = _client.get_mm_time();
+            _update_area = update_area;
             if (is_time_to_display(mm_time, tail->mm_time)) {
-                _update_mark = _channel.invalidate(_dest, true);
+                _update_mark = _channel.invalidate(_update_area, true);
                 Platform::yield();
             } else {
                 _update_time = tail->mm_time;
@@ -440,15 +753,23 @@ void VideoStream::maintenance()
 
 uint32_t VideoStream::handle_timer_update(uint32_t now)
 {
+    uint32_t decode_time = _decode_time;
+
+    // decoding is done by the channel thread
+    if (decode_time && int(decode_time - now) <= 0) {
+        _channel._streams_trigger.trigger();
+    }
+
     if (!_update_time) {
-        return 0;
+        return decode_time;
     }
 
     if (is_time_to_display(now, _update_time)) {
         _update_time = 0;
-        _update_mark = _channel.invalidate(_dest, true);
+        _update_mark = _channel.invalidate(_update_area, true);
     } else if ((int)(_update_time - now) < 0) {
         DBG(0, "to late");
+        _late_frames++;
         _update_time = 0;
     }
     return _update_time;
@@ -456,32 +777,128 @@ uint32_t VideoStream::handle_timer_update(uint32_t now)
 
 void VideoStream::handle_update_mark(uint64_t update_mark)
 {
-    if (!_update_mark || update_mark < _update_mark) {
+    if (_update_mark) {
+        if (update_mark < _update_mark) {
+            return;
+        }
+        _update_mark = 0;
+    } else if (!_decode_time) {
         return;
     }
-    _update_mark = 0;
     maintenance();
 }
 
 uint32_t VideoStream::alloc_frame_slot()
 {
-    if ((_frames_head - _frames_tail) == MAX_VIDEO_FRAMES) {
+    if ((_frames_head - _frames_tail) >= _max_frames) {
         drop_one_frame();
     }
     return frame_slot(_frames_head++);
 }
 
-void VideoStream::push_data(uint32_t mm_time, uint32_t length, uint8_t* data)
+void VideoStream::push_frame(const VideoFrame& frame, uint8_t* data)
 {
     maintenance();
     uint32_t frame_slot = alloc_frame_slot();
-    _frames[frame_slot].compressed_data = new uint8_t[length];
-    memcpy(_frames[frame_slot].compressed_data, data, length);
-    _frames[frame_slot].compressed_data_size = length;
-    _frames[frame_slot].mm_time = mm_time ? mm_time : 1;
+    _frames[frame_slot] = frame;
+    _frames[frame_slot].compressed_data = new uint8_t[frame.compressed_data_size];
+    memcpy(_frames[frame_slot].compressed_data, data, frame.compressed_data_size);
+    _frames[frame_slot].mm_time = frame.mm_time ? frame.mm_time : 1;
+    _frames[frame_slot].delay = frame.mm_time - _client.get_mm_time();
+    update_frame_stats(_frames[frame_slot]);
     maintenance();
 }
 
+void VideoStream::activate_report(uint32_t report_id, uint32_t max_window_size,
+                                  uint32_t timeout)
+{
+    memset(&_report, 0, sizeof(_report));
+    _report.active = true;
+    _report.id = report_id;
+    _report.max_window_size = max_window_size;
+    _report.timeout = timeout;
+    _reported_late_frames = _late_frames;
+}
+
+/* Accounts a frame that was either displayed or dropped. The report window ends
+   after max_window_size frames, or the report timeout, like in other clients. */
+void VideoStream::report_frame(const VideoFrame& frame, bool dropped)
+{
+    uint32_t late_frames = _late_frames;
+    uint32_t now;
+
+    if (!_report.active) {
+        return;
+    }
+
+    now = _client.get_mm_time();
+    if (!_report.num_frames) {
+        _report.start_time = now;
+        _report.start_frame_time = frame.mm_time;
+    }
+    _report.num_frames++;
+    // displayed frames that turned out to be late are dropped
+    _report.num_drops += late_frames - _reported_late_frames;
+    _reported_late_frames = late_frames;
+    if (dropped) {
+        _report.num_drops++;
+        _report.drops_seq_len++;
+    } else {
+        _report.drops_seq_len = 0;
+    }
+    _report.num_drops = MIN(_report.num_drops, _report.num_frames);
+
+    if (_report.num_frames < _report.max_window_size &&
+        now - _report.start_time < _report.timeout &&
+        _report.drops_seq_len < STREAM_REPORT_DROP_SEQ_LEN_LIMIT) {
+        return;
+    }
+
+    SpiceMsgcDisplayStreamReport report;
+
+    report.stream_id = _id;
+    report.unique_id = _report.id;
+    report.start_frame_mm_time = _report.start_frame_time;
+    report.end_frame_mm_time = frame.mm_time;
+    report.num_frames = _report.num_frames;
+    report.num_drops = _report.num_drops;
+    report.last_frame_delay = frame.delay;
+    report.audio_delay = _client.get_audio_delay();
+    DBG(0, "stream %u: frames %u drops %u delay %d queued %u/%u jitter %d decode %dus",
+        _id, report.num_frames, report.num_drops, report.last_frame_delay,
+        _frames_head - _frames_tail, _max_frames, _arrival_jitter, _decode_duration);
+    _channel.send_stream_report(report);
+
+    _report.num_frames = 0;
+    _report.num_drops = 0;
+    _report.drops_seq_len = 0;
+}
+
+void VideoStream::push_data(uint32_t mm_time, uint32_t length, uint8_t* data)
+{
+    VideoFrame frame;
+
+    frame.mm_time = mm_time;
+    frame.compressed_data_size = length;
+    frame.width = _stream_width;
+    frame.height = _stream_height;
+    frame.dest = _dest;
+    push_frame(frame, data);
+}
+
+void VideoStream::push_sized_data(uint32_t mm_time, uint32_t length, uint8_t* data,
+                                  uint32_t width, uint32_t height, const SpiceRect& dest)
+{
+    VideoFrame frame;
+
+    frame.mm_time = mm_time;
+    frame.compressed_data_size = length;
+    frame.width = width;
+    frame.height = height;
+    frame.dest = dest;
+    push_frame(frame, data);
+}
+
 void VideoStream::set_clip(int type, uint32_t num_clip_rects, SpiceRect* clip_rects)
 {
     if (type == SPICE_CLIP_TYPE_NONE) {
@@ -640,6 +1057,8 @@ DisplayChannel::DisplayChannel(RedClient& client, uint32_t id,
     handler->set_handler(SPICE_MSG_DISPLAY_STREAM_DESTROY, &DisplayChannel::handle_stream_destroy);
     handler->set_handler(SPICE_MSG_DISPLAY_STREAM_DESTROY_ALL,
                          &DisplayChannel::handle_stream_destroy_all);
+    handler->set_handler(SPICE_MSG_DISPLAY_STREAM_ACTIVATE_REPORT,
+                         &DisplayChannel::handle_stream_activate_report);
 
     handler->set_handler(SPICE_MSG_DISPLAY_SURFACE_CREATE, &DisplayChannel::handle_surface_create);
     handler->set_handler(SPICE_MSG_DISPLAY_SURFACE_DESTROY, &DisplayChannel::handle_surface_destroy);
@@ -654,6 +1073,8 @@ DisplayChannel::DisplayChannel(RedClient& client, uint32_t id,
 
     set_capability(SPICE_DISPLAY_CAP_COMPOSITE);
     set_capability(SPICE_DISPLAY_CAP_A8_SURFACE);
+    set_capability(SPICE_DISPLAY_CAP_SIZED_STREAM);
+    set_capability(SPICE_DISPLAY_CAP_STREAM_REPORT);
 }
 
 DisplayChannel::~DisplayChannel()
@@ -699,6 +1120,8 @@ void DisplayChannel::set_draw_handlers()
     handler->set_handler(SPICE_MSG_DISPLAY_DRAW_COMPOSITE,
                          &DisplayChannel::handle_draw_composite);
     handler->set_handler(SPICE_MSG_DISPLAY_STREAM_DATA, &DisplayChannel::handle_stream_data);
+    handler->set_handler(SPICE_MSG_DISPLAY_STREAM_DATA_SIZED,
+                         &DisplayChannel::handle_stream_data_sized);
 }
 
 void DisplayChannel::clear_draw_handlers()
@@ -720,6 +1143,7 @@ void DisplayChannel::clear_draw_handlers()
     handler->set_handler(SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND, NULL);
     handler->set_handler(SPICE_MSG_DISPLAY_DRAW_COMPOSITE, NULL);
     handler->set_handler(SPICE_MSG_DISPLAY_STREAM_DATA, NULL);
+    handler->set_handler(SPICE_MSG_DISPLAY_STREAM_DATA_SIZED, NULL);
 }
 
 void DisplayChannel::copy_pixels(const QRegion& dest_region,
@@ -1427,7 +1851,8 @@ void DisplayChannel::handle_stream_create(RedPeer::InMessage* message)
     SpiceRect* clip_rects;
     set_clip_rects(stream_create->clip, num_clip_rects, clip_rects);
     _streams[stream_create->id] = new VideoStream(get_client(), *_surfaces_cache[surface_id],
-                                                  *this, stream_create->codec_type,
+                                                  *this, stream_create->id,
+                                                  stream_create->codec_type,
                                                   !!(stream_create->flags & SPICE_STREAM_FLAGS_TOP_DOWN),
                                                   stream_create->stream_width,
                                                   stream_create->stream_height,
@@ -1459,6 +1884,28 @@ void DisplayChannel::handle_stream_data(RedPeer::InMessage* message)
                       stream_data->data);
 }
 
+void DisplayChannel::handle_stream_data_sized(RedPeer::InMessage* message)
+{
+    SpiceMsgDisplayStreamDataSized* stream_data =
+        (SpiceMsgDisplayStreamDataSized*)message->data();
+    VideoStream* stream;
+
+    if (stream_data->base.id >= _streams.size() || !(stream = _streams[stream_data->base.id])) {
+        THROW("invalid stream");
+    }
+
+    if (message->size() < sizeof(SpiceMsgDisplayStreamDataSized) + stream_data->data_size) {
+        THROW("access violation");
+    }
+
+    stream->push_sized_data(stream_data->base.multi_media_time,
+                            stream_data->data_size,
+                            stream_data->data,
+                            stream_data->width,
+                            stream_data->height,
+                            stream_data->dest);
+}
+
 void DisplayChannel::handle_stream_clip(RedPeer::InMessage* message)
 {
     SpiceMsgDisplayStreamClip* clip_data = (SpiceMsgDisplayStreamClip*)message->data();
@@ -1509,6 +1956,27 @@ void DisplayChannel::handle_stream_destroy_all(RedPeer::InMessage* message)
     destroy_streams();
 }
 
+void DisplayChannel::handle_stream_activate_report(RedPeer::InMessage* message)
+{
+    SpiceMsgDisplayStreamActivateReport* activate =
+        (SpiceMsgDisplayStreamActivateReport*)message->data();
+    VideoStream* stream;
+
+    if (activate->stream_id >= _streams.size() || !(stream = _streams[activate->stream_id])) {
+        THROW("invalid stream");
+    }
+    stream->activate_report(activate->unique_id, activate->max_window_size,
+                            activate->timeout_ms);
+}
+
+void DisplayChannel::send_stream_report(SpiceMsgcDisplayStreamReport& report)
+{
+    Message* message = new Message(SPICE_MSGC_DISPLAY_STREAM_REPORT);
+
+    _marshallers->msgc_display_stream_report(message->marshaller(), &report);
+    post_message(message);
+}
+
 void DisplayChannel::create_primary_surface(int width, int height, uint32_t format)
 {
     bool do_create_primary = true;
@@ -154,9 +154,11 @@ private:
     void handle_copy_bits(RedPeer::InMessage* message);
     void handle_stream_create(RedPeer::InMessage* message);
     void handle_stream_data(RedPeer::InMessage* message);
+    void handle_stream_data_sized(RedPeer::InMessage* message);
     void handle_stream_clip(RedPeer::InMessage* message);
     void handle_stream_destroy(RedPeer::InMessage* message);
     void handle_stream_destroy_all(RedPeer::InMessage* message);
+    void handle_stream_activate_report(RedPeer::InMessage* message);
 
     void handle_surface_create(RedPeer::InMessage* message);
     void handle_surface_destroy(RedPeer::InMessage* message);
@@ -180,6 +182,7 @@ private:
     void streams_time();
     void activate_streams_timer();
     void stream_update_request(uint32_t update_time);
+    void send_stream_report(SpiceMsgcDisplayStreamReport& report);
     void reset_screen();
     void clear(bool destroy_primary = true);
 
@@ -45,6 +45,12 @@ public:
 
     /* return true if the events loop should quit */
     bool wait_events(int timeout_ms = INFINITE);
+
+    /* the number of times wait_events returned with ready events */
+    uint64_t get_num_wakeups() const { return _num_wakeups;}
+
+private:
+    uint64_t _num_wakeups;
 };
 
 class EventSource {
@@ -25,6 +25,10 @@
 
 #define INIT_IMAGES_CAPACITY 100
 #define WIN_REALLOC_FACTOR 1.5
+/* reserve assumes that the images are at least that big on average. Windows of smaller
+   images still grow on demand */
+#define WIN_RESERVE_IMAGE_PIXELS 1024
+#define WIN_RESERVE_MAX_IMAGES (64 * 1024)
 
 GlzDecoderWindow::GlzDecoderWindow(GlzDecoderDebug &debug_calls)
     : _aborting (false)
@@ -67,7 +71,7 @@ void GlzDecoderWindow::post_decode(GlzDecodedImage *image)
 void GlzDecoderWindow::wait_for_image(int index)
 {
     Lock lock(_new_image_mutex);
-    GlzDecodedImage *image = _images[index]; // can be performed without locking the _win_mutex,
+    GlzDecodedImage *image = get_image(index); // can be performed without locking the _win_mutex,
                                              // since it is called after pre and the rw mutex is                                                 // locked, hence, physical changes to the window are
                                              // not allowed. In addition the reading of the image ptr
                                              // is atomic, thus, even if the value changes we are
@@ -78,7 +82,7 @@ void GlzDecoderWindow::wait_for_image(int index)
             THROW("aborting");
         }
         _new_image_cond.wait(lock);
-        image = _images[index];
+        image = get_image(index);
     }
 }
 
@@ -92,6 +96,27 @@ void GlzDecoderWindow::abort()
     _win_alloc_cond.notify_all();
 }
 
+void GlzDecoderWindow::reserve(int window_size)
+{
+    Lock lock(_win_modifiers_mutex);
+    int capacity = MIN(window_size / WIN_RESERVE_IMAGE_PIXELS, WIN_RESERVE_MAX_IMAGES);
+
+    // see pre_decode_update_window for why it can't wait for the write lock
+    while (capacity > _images_capacity) {
+        if (_aborting) {
+            THROW("aborting");
+        }
+
+        if (_win_alloc_rw_mutex.try_write_lock()) {
+            realloc(capacity);
+            _win_alloc_rw_mutex.write_unlock();
+            break;
+        } else {
+            _win_alloc_cond.wait(lock);
+        }
+    }
+}
+
 void GlzDecoderWindow::clear()
 {
     Lock lock(_win_modifiers_mutex);
@@ -249,7 +274,7 @@ void GlzDecoderWindow::add_decoded_image(GlzDecodedImage *image)
 {
     Lock lock(_new_image_mutex);
     GLZ_ASSERT(_debug_calls, image->get_id() <= _tail_image_id);
-    _images[calc_image_win_idx(image->get_id())] = image;
+    set_image(calc_image_win_idx(image->get_id()), image);
     _new_image_cond.notify_all();
 }
 
@@ -47,10 +47,16 @@ public:
 
     void abort();
 
+    /* Preallocates the window for the window size (in pixels) that was negotiated with the
+       server, so that the decoders rarely have to stop for growing it */
+    void reserve(int window_size);
+
     /* NOTE - clear mustn't be called if the window is currently used by a decoder*/
     void clear();
 
 private:
+    GlzDecodedImage* get_image(int index);
+    void set_image(int index, GlzDecodedImage* image);
     void wait_for_image(int index);
     void add_image(GlzDecodedImage *image);
     uint8_t* get_pixel_after_image_entered(int image_index, int pixel_offset);
@@ -95,6 +101,27 @@ private:
     GlzDecoderDebug &_debug_calls;
 };
 
+/* A slot is ready once its image pointer is set. The pointer is published after the
+   image was decoded, so a decoder that sees it without locking must also see the
+   pixels of the image. */
+inline GlzDecodedImage* GlzDecoderWindow::get_image(int index)
+{
+#ifdef __GNUC__
+    return __atomic_load_n(&_images[index], __ATOMIC_ACQUIRE);
+#else
+    return *(GlzDecodedImage* volatile*)&_images[index];
+#endif
+}
+
+inline void GlzDecoderWindow::set_image(int index, GlzDecodedImage* image)
+{
+#ifdef __GNUC__
+    __atomic_store_n(&_images[index], image, __ATOMIC_RELEASE);
+#else
+    *(GlzDecodedImage* volatile*)&_images[index] = image;
+#endif
+}
+
 inline uint8_t* GlzDecoderWindow::get_pixel_after_image_entered(int image_index,
                                                                 int pixel_offset)
 {
@@ -111,7 +138,7 @@ inline uint8_t *GlzDecoderWindow::get_ref_pixel(DecodedImageWinId decoded_image_
         (decoded_image_win_id - dist_from_ref_image) :
         _images_capacity + (decoded_image_win_id - dist_from_ref_image);
 
-    if (_images[ref_image_index] == NULL) { // reading image is atomic
+    if (get_image(ref_image_index) == NULL) {
         wait_for_image(ref_image_index);
     }
 
@@ -27,6 +27,16 @@
 #define jpeg_boolean boolean
 #endif
 
+/* images that were encoded with restart markers every few MCU rows are decoded in
+   slices, in parallel, if they are at least that big */
+#define JPEG_SLICES_MIN_AREA (256 * 256)
+
+#define JPEG_MARKER_SOF0 0xc0
+#define JPEG_MARKER_SOF3 0xc3
+#define JPEG_MARKER_RST0 0xd0
+#define JPEG_MARKER_RST7 0xd7
+#define JPEG_MARKER_EOI 0xd9
+
 static void op_begin_decode(SpiceJpegDecoder *decoder,
                             uint8_t* data,
                             int data_size,
@@ -71,19 +81,84 @@ extern "C" {
 }
 
 
+static void jpeg_decoder_init_src(j_decompress_ptr cinfo, struct jpeg_source_mgr* src)
+{
+    cinfo->src = src;
+    cinfo->src->init_source = jpeg_decoder_init_source;
+    cinfo->src->fill_input_buffer = jpeg_decoder_fill_input_buffer;
+    cinfo->src->skip_input_data = jpeg_decoder_skip_input_data;
+    cinfo->src->resync_to_restart = jpeg_resync_to_restart;
+    cinfo->src->term_source = jpeg_decoder_term_source;
+}
+
+JpegSliceDecoder::JpegSliceDecoder()
+    : _height (0)
+    , _dest (NULL)
+    , _stride (0)
+    , _rgb_converter (NULL)
+{
+    _cinfo.err = jpeg_std_error(&_jerr);
+    jpeg_create_decompress(&_cinfo);
+    jpeg_decoder_init_src(&_cinfo, &_jsrc);
+}
+
+JpegSliceDecoder::~JpegSliceDecoder()
+{
+    jpeg_destroy_decompress(&_cinfo);
+}
+
+void JpegSliceDecoder::set(const uint8_t* header, int header_size, int sof_height_pos,
+                           const uint8_t* scan, int scan_size, int height,
+                           uint8_t* dest, int stride, RGBConverter* rgb_converter)
+{
+    /* the slice is a complete image: the header of the whole image, with the height of
+       the slice, the scan data of a single restart interval, and EOI */
+    _data.resize(header_size + scan_size + 2);
+    memcpy(&_data[0], header, header_size);
+    _data[sof_height_pos] = height >> 8;
+    _data[sof_height_pos + 1] = height & 0xff;
+    memcpy(&_data[header_size], scan, scan_size);
+    _data[header_size + scan_size] = 0xff;
+    _data[header_size + scan_size + 1] = JPEG_MARKER_EOI;
+
+    _height = height;
+    _dest = dest;
+    _stride = stride;
+    _rgb_converter = rgb_converter;
+}
+
+void JpegSliceDecoder::run()
+{
+    _cinfo.src->next_input_byte = &_data[0];
+    _cinfo.src->bytes_in_buffer = _data.size();
+
+    jpeg_read_header(&_cinfo, TRUE);
+    _cinfo.out_color_space = JCS_RGB;
+    /* fancy upsampling interpolates the chroma of the edge rows with the chroma of the
+       neighbour slice, which the slice doesn't have, so it would show seams */
+    _cinfo.do_fancy_upsampling = FALSE;
+    _scan_line.resize(_cinfo.image_width * 3);
+
+    jpeg_start_decompress(&_cinfo);
+
+    uint8_t* scan_line = &_scan_line[0];
+    uint8_t* dest = _dest;
+    for (int row = 0; row < _height; row++) {
+        jpeg_read_scanlines(&_cinfo, &scan_line, 1);
+        _rgb_converter->convert(scan_line, dest, _cinfo.image_width);
+        dest += _stride;
+    }
+
+    jpeg_finish_decompress(&_cinfo);
+}
+
 JpegDecoder::JpegDecoder()
     : _data (NULL)
     , _data_size (0)
 {
     _cinfo.err = jpeg_std_error(&_jerr);
     jpeg_create_decompress(&_cinfo);
-
-    _cinfo.src = &_jsrc;
-    _cinfo.src->init_source = jpeg_decoder_init_source;
-    _cinfo.src->fill_input_buffer = jpeg_decoder_fill_input_buffer;
-    _cinfo.src->skip_input_data = jpeg_decoder_skip_input_data;
-    _cinfo.src->resync_to_restart = jpeg_resync_to_restart;
-    _cinfo.src->term_source = jpeg_decoder_term_source;
+    jpeg_decoder_init_src(&_cinfo, &_jsrc);
 
     static SpiceJpegDecoderOps decoder_ops = {
         op_begin_decode,
@@ -95,6 +170,10 @@ JpegDecoder::JpegDecoder()
 
 JpegDecoder::~JpegDecoder()
 {
+    while (!_slices.empty()) {
+        delete _slices.back();
+        _slices.pop_back();
+    }
     jpeg_destroy_decompress(&_cinfo);
 }
 
@@ -123,9 +202,103 @@ void JpegDecoder::begin_decode(uint8_t* data, int data_size, int& out_width, int
     out_height = _height;
 }
 
+/* returns the offset of the image height in the SOF marker, or -1 */
+static int jpeg_find_sof_height(const uint8_t* data, int size)
+{
+    int pos = 2; // SOI
+
+    while (pos + 4 <= size && data[pos] == 0xff) {
+        uint8_t marker = data[pos + 1];
+
+        if (marker == 0xff) {
+            pos++;
+            continue;
+        }
+        if (marker >= JPEG_MARKER_SOF0 && marker <= JPEG_MARKER_SOF3) {
+            return pos + 7 <= size ? pos + 5 : -1;
+        }
+        pos += 2 + ((data[pos + 2] << 8) | data[pos + 3]);
+    }
+    return -1;
+}
+
+/* The rows between two restart markers don't depend on the rows before them, so if
+   the markers are at the start of MCU rows, each interval is decoded as a separate
+   image by the decode pool. Returns false if the image can't be decoded that way, in
+   which case nothing was decoded yet. */
+bool JpegDecoder::decode_slices(uint8_t* dest, int stride, RGBConverter* rgb_converter)
+{
+    DecodePool* pool;
+
+    if (_width * _height < JPEG_SLICES_MIN_AREA || !_cinfo.restart_interval ||
+        _cinfo.progressive_mode || _cinfo.comps_in_scan != _cinfo.num_components ||
+        !(pool = DecodePool::get())) {
+        return false;
+    }
+
+    int mcu_width = _cinfo.max_h_samp_factor * DCTSIZE;
+    int mcu_height = _cinfo.max_v_samp_factor * DCTSIZE;
+    int mcus_per_row = (_width + mcu_width - 1) / mcu_width;
+    if (_cinfo.restart_interval % mcus_per_row) {
+        return false;
+    }
+    int slice_height = _cinfo.restart_interval / mcus_per_row * mcu_height;
+    int num_slices = (_height + slice_height - 1) / slice_height;
+    if (num_slices < 2) {
+        return false;
+    }
+
+    /* jpeg_read_header stops at the start of the scan data */
+    int header_size = _cinfo.src->next_input_byte - _data;
+    int sof_height_pos = jpeg_find_sof_height(_data, header_size);
+    if (sof_height_pos == -1) {
+        return false;
+    }
+
+    while ((int)_slices.size() < num_slices) {
+        _slices.push_back(new JpegSliceDecoder());
+    }
+
+    const uint8_t* end = _data + _data_size;
+    const uint8_t* scan = _data + header_size;
+    const uint8_t* pos = scan;
+    int slice = 0;
+
+    while (slice < num_slices) {
+        pos = (const uint8_t*)memchr(pos, 0xff, end - pos);
+        if (!pos || pos + 1 == end) {
+            return false;
+        }
+        uint8_t marker = pos[1];
+        if (marker >= JPEG_MARKER_RST0 && marker <= JPEG_MARKER_RST7) {
+            if (marker - JPEG_MARKER_RST0 != (slice & 7) || slice == num_slices - 1) {
+                return false;
+            }
+        } else if (marker != JPEG_MARKER_EOI) {
+            pos++;
+            continue;
+        } else if (slice != num_slices - 1) {
+            return false;
+        }
+        int y = slice * slice_height;
+        _slices[slice]->set(_data, header_size, sof_height_pos, scan, pos - scan,
+                            MIN(slice_height, _height - y), dest + y * stride, stride,
+                            rgb_converter);
+        slice++;
+        pos += 2;
+        scan = pos;
+    }
+
+    DecodeBatch batch(*pool);
+    for (slice = 0; slice < num_slices; slice++) {
+        batch.add(*_slices[slice]);
+    }
+    batch.wait();
+    return true;
+}
+
 void JpegDecoder::decode(uint8_t *dest, int stride, int format)
 {
-    uint8_t* scan_line = new uint8_t[_width*3];
     RGBConverter* rgb_converter;
 
     switch (format) {
@@ -139,6 +312,12 @@ void JpegDecoder::decode(uint8_t *dest, int stride, int format)
         THROW("bad bitmap format, %d", format);
     }
 
+    if (decode_slices(dest, stride, rgb_converter)) {
+        return;
+    }
+
+    uint8_t* scan_line = new uint8_t[_width*3];
+
     jpeg_start_decompress(&_cinfo);
 
     for (int row = 0; row < _height; row++) {
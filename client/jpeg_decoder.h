@@ -21,6 +21,7 @@
 
 #include "common.h"
 #include "red_canvas_base.h"
+#include "decode_pool.h"
 
 #if defined(WIN32) && !defined(__MINGW32__)
 /* We need some hacks to avoid warnings from the jpeg headers */
@@ -70,6 +71,32 @@ public:
     }
 };
 
+/* decodes the rows between two restart markers of an image, see JpegDecoder::decode */
+class JpegSliceDecoder : public DecodeJob {
+public:
+    JpegSliceDecoder();
+    ~JpegSliceDecoder();
+
+    /* header is the image header up to the scan data, sof_height_pos is the offset of
+       the image height in it */
+    void set(const uint8_t* header, int header_size, int sof_height_pos,
+             const uint8_t* scan, int scan_size, int height,
+             uint8_t* dest, int stride, RGBConverter* rgb_converter);
+    virtual void run();
+
+private:
+    struct jpeg_decompress_struct _cinfo;
+    struct jpeg_error_mgr _jerr;
+    struct jpeg_source_mgr _jsrc;
+
+    std::vector<uint8_t> _data;
+    std::vector<uint8_t> _scan_line;
+    int _height;
+    uint8_t* _dest;
+    int _stride;
+    RGBConverter* _rgb_converter;
+};
+
 class JpegDecoder : public SpiceJpegDecoder {
 public:
     JpegDecoder();
@@ -80,6 +107,9 @@ public:
        x=32BIT and x=24BIT are supported */
     void decode(uint8_t* dest, int stride, int format);
 
+private:
+    bool decode_slices(uint8_t* dest, int stride, RGBConverter* rgb_converter);
+
 private:
     struct jpeg_decompress_struct _cinfo;
     struct jpeg_error_mgr _jerr;
@@ -92,5 +122,7 @@ private:
 
     RGBToBGRConverter _rgb2bgr;
     RGBToBGRXConverter _rgb2bgrx;
+
+    std::vector<JpegSliceDecoder*> _slices;
 };
 #endif
@@ -28,6 +28,23 @@
 #define jpeg_boolean boolean
 #endif
 
+/* libjpeg-turbo can write the 32 bit pixels of the frame buffer directly, which saves
+   the conversion pass over every decoded line. The frame pixels are native endian
+   xRGB words (xBGR for old servers, see convert_scanline); libjpeg fills the unused
+   byte with 0xff instead of 0. */
+#ifdef JCS_EXTENSIONS
+#ifdef WORDS_BIGENDIAN
+#define MJPEG_COLOR_SPACE JCS_EXT_XRGB
+#define MJPEG_BACK_COMPAT_COLOR_SPACE JCS_EXT_XBGR
+#else
+#define MJPEG_COLOR_SPACE JCS_EXT_BGRX
+#define MJPEG_BACK_COMPAT_COLOR_SPACE JCS_EXT_RGBX
+#endif
+#endif
+
+/* the maximal number of lines that are requested from libjpeg in one call */
+#define MJPEG_MAX_READ_LINES 16
+
 enum {
     STATE_READ_HEADER,
     STATE_START_DECOMPRESS,
@@ -75,6 +92,10 @@ MJpegDecoder::MJpegDecoder(int width, int height,
     , _data_start(0)
     , _data_end(0)
     , _extra_skip(0)
+    , _frame_width(width)
+    , _frame_height(height)
+    , _area_x(0)
+    , _area_y(0)
     , _width(width)
     , _height(height)
     , _stride(stride)
@@ -94,18 +115,59 @@ MJpegDecoder::MJpegDecoder(int width, int height,
     _cinfo.src->resync_to_restart = jpeg_resync_to_restart;
     _cinfo.src->term_source = term_source;
 
+#ifndef JCS_EXTENSIONS
     _scanline = new uint8_t[width * 3];
+#endif
 }
 
 MJpegDecoder::~MJpegDecoder()
 {
     jpeg_destroy_decompress(&_cinfo);
+#ifndef JCS_EXTENSIONS
     delete [] _scanline;
+#endif
     if (_data) {
         delete [] _data;
     }
 }
 
+#ifdef JCS_EXTENSIONS
+
+bool MJpegDecoder::read_scanlines()
+{
+    JSAMPROW rows[MJPEG_MAX_READ_LINES];
+    unsigned num_rows;
+    unsigned i;
+    int res;
+
+    while (_y < _height) {
+        num_rows = MIN(_height - _y, MJPEG_MAX_READ_LINES);
+        for (i = 0; i < num_rows; i++) {
+            rows[i] = _frame + (_area_y + _y + i) * _stride + _area_x * sizeof(uint32_t);
+        }
+        res = jpeg_read_scanlines(&_cinfo, rows, num_rows);
+        if (res == 0) {
+            return false;
+        }
+        _y += res;
+    }
+    return true;
+}
+
+#else
+
+bool MJpegDecoder::read_scanlines()
+{
+    while (_y < _height) {
+        if (jpeg_read_scanlines(&_cinfo, &_scanline, 1) == 0) {
+            return false;
+        }
+        convert_scanline();
+        _y++;
+    }
+    return true;
+}
+
 void MJpegDecoder::convert_scanline(void)
 {
     uint32_t *row;
@@ -116,7 +178,7 @@ void MJpegDecoder::convert_scanline(void)
     ASSERT(_width % 2 == 0);
     ASSERT(_height % 2 == 0);
 
-   row = (uint32_t *)(_frame + _y * _stride);
+    row = (uint32_t *)(_frame + (_area_y + _y) * _stride) + _area_x;
     s = _scanline;
 
 
@@ -139,6 +201,8 @@ void MJpegDecoder::convert_scanline(void)
     }
 }
 
+#endif
+
 void MJpegDecoder::append_data(uint8_t *data, size_t length)
 {
     uint8_t *new_data;
@@ -171,6 +235,26 @@ void MJpegDecoder::append_data(uint8_t *data, size_t length)
     _data_end += length;
 }
 
+void MJpegDecoder::set_frame_area(int x, int y, int width, int height)
+{
+    ASSERT(x >= 0 && y >= 0 && width > 0 && height > 0);
+    ASSERT(x + width <= (int)_frame_width && y + height <= (int)_frame_height);
+
+    if (_state != STATE_READ_HEADER) {
+        /* drop the incomplete frame */
+        jpeg_abort_decompress(&_cinfo);
+        _data_start = _data_end = 0;
+        _extra_skip = 0;
+        _y = 0;
+        _state = STATE_READ_HEADER;
+    }
+
+    _area_x = x;
+    _area_y = y;
+    _width = width;
+    _height = height;
+}
+
 bool MJpegDecoder::decode_data(uint8_t *data, size_t length)
 {
     bool got_picture;
@@ -211,7 +295,12 @@ bool MJpegDecoder::decode_data(uint8_t *data, size_t length)
 
         _cinfo.do_fancy_upsampling = FALSE;
         _cinfo.do_block_smoothing = FALSE;
+#ifdef JCS_EXTENSIONS
+        _cinfo.out_color_space = _back_compat ? MJPEG_BACK_COMPAT_COLOR_SPACE :
+                                                MJPEG_COLOR_SPACE;
+#else
         _cinfo.out_color_space = JCS_RGB;
+#endif
 
         PANIC_ON(_cinfo.image_width != _width);
         PANIC_ON(_cinfo.image_height != _height);
@@ -230,18 +319,7 @@ bool MJpegDecoder::decode_data(uint8_t *data, size_t length)
 
         /* fall through */
     case STATE_READ_SCANLINES:
-        res = 0;
-        while (_y < _height) {
-            res = jpeg_read_scanlines(&_cinfo, &_scanline, 1);
-
-            if (res == 0) {
-                break;
-            }
-
-            convert_scanline();
-            _y++;
-        }
-        if (res == 0) {
+        if (!read_scanlines()) {
             break;
         }
 
@@ -41,12 +41,19 @@ public:
     ~MJpegDecoder();
 
     bool decode_data(uint8_t *data, size_t length);
+    /* the next frames are decoded into this area of the frame buffer. A frame that was
+       not completely decoded yet is dropped. */
+    void set_frame_area(int x, int y, int width, int height);
 
 private:
 
     friend void mjpeg_skip_input_data(j_decompress_ptr cinfo, long num_bytes);
 
+    /* returns false if the decoder is suspended, waiting for more data */
+    bool read_scanlines();
+#ifndef JCS_EXTENSIONS
     void convert_scanline(void);
+#endif
     void append_data(uint8_t *data, size_t length);
 
     struct jpeg_decompress_struct _cinfo;
@@ -59,6 +66,10 @@ private:
     size_t _data_end;
     size_t _extra_skip;
 
+    unsigned _frame_width;
+    unsigned _frame_height;
+    unsigned _area_x;
+    unsigned _area_y;
     unsigned _width;
     unsigned _height;
     int _stride;
@@ -66,7 +77,9 @@ private:
     bool _back_compat;
 
     unsigned _y;
+#ifndef JCS_EXTENSIONS
     uint8_t *_scanline;
+#endif
 
     int _state;
 };
@@ -140,6 +140,12 @@ static void end_wave()
 
 #endif
 
+/* the playback delay is checked every MM_TIME_CHECK_FRAMES frames, and the mm time is
+   synced if MM_TIME_SYNC_FRAMES passed or the delay changed by MM_TIME_MAX_DRIFT */
+#define MM_TIME_CHECK_FRAMES 100
+#define MM_TIME_SYNC_FRAMES 1000
+#define MM_TIME_MAX_DRIFT 20 // ms
+
 class PlaybackHandler: public MessageHandlerImp<PlaybackChannel, SPICE_CHANNEL_PLAYBACK> {
 public:
     PlaybackHandler(PlaybackChannel& channel)
@@ -154,6 +160,10 @@ PlaybackChannel::PlaybackChannel(RedClient& client, uint32_t id)
     , _celt_mode (NULL)
     , _celt_decoder (NULL)
     , _playing (false)
+    , _frame_count (0)
+    , _min_latency (0)
+    , _synced_delay (0)
+    , _synced_frame (0)
 {
 #ifdef WAVE_CAPTURE
     init_wave();
@@ -168,8 +178,10 @@ PlaybackChannel::PlaybackChannel(RedClient& client, uint32_t id)
     handler->set_handler(SPICE_MSG_NOTIFY, &PlaybackChannel::handle_notify);
 
     handler->set_handler(SPICE_MSG_PLAYBACK_MODE, &PlaybackChannel::handle_mode);
+    handler->set_handler(SPICE_MSG_PLAYBACK_LATENCY, &PlaybackChannel::handle_latency);
 
     set_capability(SPICE_PLAYBACK_CAP_CELT_0_5_1);
+    set_capability(SPICE_PLAYBACK_CAP_LATENCY);
 }
 
 void PlaybackChannel::clear()
@@ -179,6 +191,7 @@ void PlaybackChannel::clear()
         _wave_player->stop();
         delete _wave_player;
         _wave_player = NULL;
+        get_client().set_audio_delay(~(uint32_t)0);
     }
     _mode = SPICE_AUDIO_DATA_MODE_INVALID;
 
@@ -251,6 +264,7 @@ void PlaybackChannel::disable()
     handler->set_handler(SPICE_MSG_PLAYBACK_STOP, &PlaybackChannel::null_handler);
     handler->set_handler(SPICE_MSG_PLAYBACK_MODE, &PlaybackChannel::null_handler);
     handler->set_handler(SPICE_MSG_PLAYBACK_DATA, &PlaybackChannel::null_handler);
+    handler->set_handler(SPICE_MSG_PLAYBACK_LATENCY, &PlaybackChannel::null_handler);
 }
 
 void PlaybackChannel::handle_start(RedPeer::InMessage* message)
@@ -283,6 +297,9 @@ void PlaybackChannel::handle_start(RedPeer::InMessage* message)
             disable();
             return;
         }
+        if (_min_latency) {
+            _wave_player->set_min_latency(_min_latency);
+        }
 
         if (!(_celt_mode = celt051_mode_create(start->frequency, start->channels,
                                                frame_size, &celt_mode_err))) {
@@ -311,6 +328,38 @@ void PlaybackChannel::handle_stop(RedPeer::InMessage* message)
 #endif
     _wave_player->stop();
     _playing = false;
+    get_client().set_audio_delay(~(uint32_t)0);
+}
+
+void PlaybackChannel::handle_latency(RedPeer::InMessage* message)
+{
+    SpiceMsgPlaybackLatency* latency = (SpiceMsgPlaybackLatency*)message->data();
+
+    _min_latency = latency->latency_ms;
+    if (_wave_player) {
+        _wave_player->set_min_latency(_min_latency);
+    }
+}
+
+/* The mm time is the time of the audio that is played now. It is resynced quickly
+   when the player changes its latency, e.g., after an underrun. */
+void PlaybackChannel::sync_mm_time(uint32_t time)
+{
+    uint32_t frame = _frame_count++;
+    uint32_t delay;
+
+    if (frame % MM_TIME_CHECK_FRAMES) {
+        return;
+    }
+    delay = _wave_player->get_delay_ms();
+    get_client().set_audio_delay(delay);
+    if (frame && frame - _synced_frame < MM_TIME_SYNC_FRAMES &&
+        abs(int(delay - _synced_delay)) < MM_TIME_MAX_DRIFT) {
+        return;
+    }
+    get_client().set_mm_time(time - delay);
+    _synced_delay = delay;
+    _synced_frame = frame;
 }
 
 void PlaybackChannel::handle_raw_data(RedPeer::InMessage* message)
@@ -327,9 +376,7 @@ void PlaybackChannel::handle_raw_data(RedPeer::InMessage* message)
         // will probably be replaced by supporting flexible data size in the player imp
         THROW("unexpected frame size");
     }
-    if ((_frame_count++ % 1000) == 0) {
-        get_client().set_mm_time(packet->time - _wave_player->get_delay_ms());
-    }
+    sync_mm_time(packet->time);
     _wave_player->write(data);
 }
 
@@ -347,9 +394,7 @@ void PlaybackChannel::handle_celt_data(RedPeer::InMessage* message)
     put_wave_data(pcm, _frame_bytes);
     return;
 #endif
-    if ((_frame_count++ % 1000) == 0) {
-        get_client().set_mm_time(packet->time - _wave_player->get_delay_ms());
-    }
+    sync_mm_time(packet->time);
     _wave_player->write((uint8_t *)pcm);
 }
 
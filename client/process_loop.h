@@ -212,6 +212,8 @@ public:
 
     void* get_owner() { return _owner;}
 
+    uint64_t get_num_wakeups() { return _event_sources.get_num_wakeups();}
+
     bool is_same_thread(pthread_t thread) { return _started && pthread_equal(_thread, thread);}
 
 protected:
@@ -346,6 +346,8 @@ RedChannel::RedChannel(RedClient& client, uint8_t type, uint8_t id,
     , _incomming_message (NULL)
     , _message_ack_count (0)
     , _message_ack_window (0)
+    , _num_received_messages (0)
+    , _start_wakeups (0)
     , _loop (this)
     , _send_trigger (*this)
     , _disconnect_stamp (0)
@@ -572,6 +574,8 @@ void RedChannel::run()
                 }
                 on_connect();
                 set_state(CONNECTED_STATE);
+                _num_received_messages = 0;
+                _start_wakeups = _loop.get_num_wakeups();
                 _loop.add_socket(*this);
                 _socket_in_loop = true;
                 on_event();
@@ -589,6 +593,11 @@ void RedChannel::run()
                 _socket_in_loop = false;
                 _loop.remove_socket(*this);
             }
+            if (_num_received_messages) {
+                DBG(0, "channel type %u id %u: %" PRIu64 " messages, %.2f wakeups per message",
+                    get_type(), get_id(), _num_received_messages,
+                    (double)(_loop.get_num_wakeups() - _start_wakeups) / _num_received_messages);
+            }
             if (_outgoing_message) {
                 _outgoing_message->release();
                 _outgoing_message = NULL;
@@ -675,6 +684,7 @@ void RedChannel::on_send_trigger()
 
 void RedChannel::on_message_received()
 {
+    _num_received_messages++;
     if (_message_ack_count && !--_message_ack_count) {
         post_message(new Message(SPICE_MSGC_ACK));
         _message_ack_count = _message_ack_window;
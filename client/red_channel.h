@@ -215,6 +215,10 @@ private:
     uint32_t _message_ack_count;
     uint32_t _message_ack_window;
 
+    /* for measuring the loop wakeups per received message */
+    uint64_t _num_received_messages;
+    uint64_t _start_wakeups;
+
     ProcessLoop _loop;
     SendTrigger _send_trigger;
     AbortTrigger _abort_trigger;
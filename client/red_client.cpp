@@ -409,6 +409,7 @@ RedClient::RedClient(Application& application)
     , _agent_caps(NULL)
     , _migrate (*this)
     , _glz_window (_glz_debug)
+    , _audio_delay (~(uint32_t)0)
     , _during_migration (false)
 {
     Platform::set_clipboard_listener(this);
@@ -568,6 +569,7 @@ void RedClient::connect(bool wait_main_disconnect)
         Platform::msleep(100);
     }
 
+    log_pixmap_cache_stats();
     _pixmap_cache.clear();
     _glz_window.clear();
     memset(_sync_info, 0, sizeof(_sync_info));
@@ -869,11 +871,24 @@ void RedClient::send_agent_display_config()
 #define MIN_DISPLAY_PIXMAP_CACHE (1024 * 1024 * 20)
 #define MAX_DISPLAY_PIXMAP_CACHE (1024 * 1024 * 80)
 #define MIN_MEM_FOR_OTHERS (1024 * 1024 * 40)
+/* the part of the physical memory that the pixmap cache and the glz window can take */
+#define CACHE_MEM_SHARE 4
 
 // tmp till the pci mem will be shared by the qxls
 #define MIN_GLZ_WINDOW_SIZE (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
 
+void RedClient::log_pixmap_cache_stats()
+{
+    SharedCacheStats stats;
+
+    _pixmap_cache.get_stats(stats);
+    LOG_INFO("pixmap cache: %u items, %" PRIu64 " bytes, max %" PRIu64 " of %" PRIu64
+             " bytes, hits %" PRIu64 ", misses %" PRIu64 ", evictions %" PRIu64,
+             stats.items, stats.bytes, stats.max_bytes, _pixmap_cache_size * 4,
+             stats.hits, stats.misses, stats.evictions);
+}
+
 void RedClient::calc_pixmap_cach_and_glz_window_size(uint32_t display_channels_hint,
                                                      uint32_t pci_mem_hint)
 {
@@ -902,10 +917,22 @@ void RedClient::calc_pixmap_cach_and_glz_window_size(uint32_t display_channels_h
     _pixmap_cache_size = MIN(free_mem, mem_status.ullAvailVirtual);
     _pixmap_cache_size = MIN(free_mem, max_cache_size);
 #else
-    //for now
+    display_channels_hint = MAX(1, display_channels_hint);
+    uint64_t max_cache_size = display_channels_hint * MAX_DISPLAY_PIXMAP_CACHE;
+    uint64_t min_cache_size = display_channels_hint * MIN_DISPLAY_PIXMAP_CACHE;
+    long num_pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+
     _glz_window_size = (int)MIN(MAX_GLZ_WINDOW_SIZE, pci_mem_hint / 2);
     _glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE, _glz_window_size);
-    _pixmap_cache_size = MAX_DISPLAY_PIXMAP_CACHE;
+    _pixmap_cache_size = max_cache_size;
+    if (num_pages > 0 && page_size > 0) {
+        // on small machines, the cache would push the rest of the system to swap
+        uint64_t cache_mem = (uint64_t)num_pages * page_size / CACHE_MEM_SHARE;
+
+        cache_mem -= MIN(cache_mem, _glz_window_size);
+        _pixmap_cache_size = MIN(_pixmap_cache_size, MAX(min_cache_size, cache_mem));
+    }
 #endif
 
     _pixmap_cache_size /= 4;
@@ -1084,6 +1111,7 @@ void RedClient::handle_init(RedPeer::InMessage* message)
     set_mm_time(init->multi_media_time);
     if (!_during_migration) {
         calc_pixmap_cach_and_glz_window_size(init->display_channels_hint, init->ram_hint);
+        _glz_window.reserve(_glz_window_size);
     }
     set_mouse_mode(init->supported_mouse_modes, init->current_mouse_mode);
     _agent_tokens = init->agent_tokens;
@@ -1404,6 +1432,19 @@ uint32_t RedClient::get_mm_time()
                     _mm_time);
 }
 
+/* set by the playback thread, and read by the display channel for its stream reports */
+void RedClient::set_audio_delay(uint32_t delay_ms)
+{
+    Lock lock(_mm_clock_lock);
+    _audio_delay = delay_ms;
+}
+
+uint32_t RedClient::get_audio_delay()
+{
+    Lock lock(_mm_clock_lock);
+    return _audio_delay;
+}
+
 void RedClient::register_channel_factory(ChannelFactory& factory)
 {
     _factorys.push_back(&factory);
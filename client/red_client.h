@@ -274,6 +274,9 @@ public:
 
     void set_mm_time(uint32_t time);
     uint32_t get_mm_time();
+    /* the latency of the audio playback, ~0 if there is no playback */
+    void set_audio_delay(uint32_t delay_ms);
+    uint32_t get_audio_delay();
     void send_main_attach_channels(void);
 
 protected:
@@ -291,6 +294,7 @@ private:
     void send_agent_announce_capabilities(bool request);
     void send_agent_monitors_config();
     void send_agent_display_config();
+    void log_pixmap_cache_stats();
     void calc_pixmap_cach_and_glz_window_size(uint32_t display_channels_hint,
                                               uint32_t pci_mem_hint);
     void set_mouse_mode(uint32_t supported_modes, uint32_t current_mode);
@@ -380,6 +384,7 @@ private:
     Mutex _mm_clock_lock;
     uint64_t _mm_clock_last_update;
     uint32_t _mm_time;
+    uint32_t _audio_delay;
 
     bool _during_migration;
 };
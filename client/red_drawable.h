@@ -110,6 +110,10 @@ public:
     };
 
     virtual RedDrawable::Format get_format() = 0;
+    /* the drawing between begin_batch() and end_batch() is sent to the display server
+       at once. end_batch() returns the number of requests that were sent, if known. */
+    void begin_batch();
+    uint32_t end_batch();
     void copy_pixels(const PixelsSource& src, int src_x, int src_y, const SpiceRect& dest);
     void blend_pixels(const PixelsSource& src, int src_x, int src_y, const SpiceRect& dest);
     void combine_pixels(const PixelsSource& src, int src_x, int src_y, const SpiceRect& dest,
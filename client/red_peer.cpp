@@ -22,6 +22,7 @@
 #ifdef WIN32
 #include <winsock2.h>
 #endif
+#include <algorithm>
 #include <openssl/x509.h>
 #include <openssl/x509v3.h>
 #include <spice/protocol.h>
@@ -41,17 +42,23 @@ static void SPICE_GNUC_NORETURN ssl_error()
     THROW_ERR(SPICEC_ERROR_CODE_SSL_ERROR, "SSL Error: %s", ERR_error_string(last_error, NULL));
 }
 
+#define RECEIVE_BUF_SIZE (64 * 1024)
+
 RedPeer::RedPeer()
     : _peer (INVALID_SOCKET)
     , _shut (false)
     , _ctx (NULL)
     , _ssl (NULL)
+    , _receive_buf (new uint8_t[RECEIVE_BUF_SIZE])
+    , _receive_pos (0)
+    , _receive_end (0)
 {
 }
 
 RedPeer::~RedPeer()
 {
     cleanup();
+    delete[] _receive_buf;
 }
 
 void RedPeer::cleanup()
@@ -70,6 +77,7 @@ void RedPeer::cleanup()
         closesocket(_peer);
         _peer = INVALID_SOCKET;
     }
+    reset_receive_buf();
 }
 
 void RedPeer::connect_to_peer(const char* host, int portnr)
@@ -257,6 +265,7 @@ void RedPeer::close()
         closesocket(_peer);
         _peer = INVALID_SOCKET;
     }
+    reset_receive_buf();
 }
 
 void RedPeer::swap(RedPeer* other)
@@ -269,6 +278,10 @@ void RedPeer::swap(RedPeer* other)
     _peer = other->_peer;
     other->_peer = temp_peer;
 
+    std::swap(_receive_buf, other->_receive_buf);
+    std::swap(_receive_pos, other->_receive_pos);
+    std::swap(_receive_end, other->_receive_end);
+
     if (_ctx) {
         _ctx = other->_ctx;
         _ssl = other->_ssl;
@@ -282,11 +295,14 @@ void RedPeer::swap(RedPeer* other)
     }
 }
 
-uint32_t RedPeer::receive(uint8_t *buf, uint32_t size)
+/* reads at least min_size bytes, unless the socket would block, and at most max_size */
+uint32_t RedPeer::do_receive(uint8_t *buf, uint32_t min_size, uint32_t max_size)
 {
     uint8_t *pos = buf;
-    while (size) {
+    uint8_t *end = buf + max_size;
+    while (pos < buf + min_size) {
         int now;
+        uint32_t size = end - pos;
         if (_ctx == NULL) {
             if ((now = recv(_peer, (char *)pos, size, 0)) <= 0) {
                 int err = sock_error();
@@ -303,7 +319,6 @@ uint32_t RedPeer::receive(uint8_t *buf, uint32_t size)
                 }
                 THROW_ERR(SPICEC_ERROR_CODE_RECV_FAILED, "%s (%d)", sock_err_message(err), err);
             }
-            size -= now;
             pos += now;
         } else {
             if ((now = SSL_read(_ssl, pos, size)) <= 0) {
@@ -332,13 +347,36 @@ uint32_t RedPeer::receive(uint8_t *buf, uint32_t size)
                 }
                 THROW_ERR(SPICEC_ERROR_CODE_RECV_FAILED, "ssl error %d", ssl_error);
             }
-            size -= now;
             pos += now;
         }
     }
     return pos - buf;
 }
 
+uint32_t RedPeer::receive(uint8_t *buf, uint32_t size)
+{
+    uint32_t n = MIN(size, _receive_end - _receive_pos);
+
+    memcpy(buf, _receive_buf + _receive_pos, n);
+    _receive_pos += n;
+    if (n == size) {
+        return n;
+    }
+    buf += n;
+    size -= n;
+    reset_receive_buf();
+
+    if (size >= RECEIVE_BUF_SIZE / 2) {
+        // big message bodies are read in place
+        return n + do_receive(buf, size, size);
+    }
+
+    _receive_end = do_receive(_receive_buf, size, RECEIVE_BUF_SIZE);
+    _receive_pos = MIN(size, _receive_end);
+    memcpy(buf, _receive_buf, _receive_pos);
+    return n + _receive_pos;
+}
+
 RedPeer::CompoundInMessage* RedPeer::receive()
 {
     SpiceDataHeader header;
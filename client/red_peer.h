@@ -126,6 +126,8 @@ protected:
 private:
     void connect_to_peer(const char* host, int port);
     void shutdown();
+    uint32_t do_receive(uint8_t* buf, uint32_t min_size, uint32_t max_size);
+    void reset_receive_buf() { _receive_pos = _receive_end = 0;}
 
 private:
     SOCKET _peer;
@@ -135,6 +137,12 @@ private:
 
     SSL_CTX *_ctx;
     SSL *_ssl;
+
+    /* read ahead buffer, so that small messages (and their headers) don't cost a
+       system call each */
+    uint8_t* _receive_buf;
+    uint32_t _receive_pos;
+    uint32_t _receive_end;
 };
 
 class RedPeer::InMessage {
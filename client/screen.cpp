@@ -29,6 +29,18 @@
 #include "resource.h"
 #include "icon.h"
 
+#define REFRESH_INTERVAL (1000 / 60) // ms
+/* the minimal time between updates that only have changes which are not urgent */
+#define UPDATE_INTERVAL (1000 / 30) // ms
+/* merging rects is always worth it when it adds no more than this number of pixels */
+#define UPDATE_MERGE_MIN_WASTE (64 * 64)
+#define UPDATE_STATS_INTERVAL (10 * 1000) // ms
+
+static inline uint32_t get_time_ms()
+{
+    return uint32_t(Platform::get_monolithic_time() / (1000 * 1000));
+}
+
 class UpdateEvent: public Event {
 public:
     UpdateEvent(int screen) : _screen (screen) {}
@@ -92,6 +104,8 @@ RedScreen::RedScreen(Application& owner, int id, const std::string& name, int wi
     , _update_timer (new UpdateTimer(this))
     , _composit_area (NULL)
     , _update_mark (1)
+    , _urgent_update (false)
+    , _last_update_time (0)
     , _monitor (NULL)
     , _default_cursor (NULL)
     , _inactive_cursor (NULL)
@@ -103,6 +117,7 @@ RedScreen::RedScreen(Application& owner, int id, const std::string& name, int wi
     , _pointer_on_screen (false)
 {
     region_init(&_dirty_region);
+    memset(&_update_stats, 0, sizeof(_update_stats));
     set_name(name);
     _size.x = width;
     _size.y = height;
@@ -312,6 +327,32 @@ void RedScreen::notify_new_size()
     }
 }
 
+/* Copying a few larger rects costs less than copying many small ones, e.g., the rects of
+   a burst of text updates. The region is replaced by its bounding box if that doesn't
+   add more than the region's own area. */
+static void merge_update_region(QRegion& region)
+{
+    pixman_box32_t *rects;
+    pixman_box32_t extents;
+    int num_rects;
+    uint64_t area = 0;
+    uint64_t extents_area;
+
+    rects = pixman_region32_rectangles((pixman_region32_t *)&region, &num_rects);
+    if (num_rects < 2) {
+        return;
+    }
+    for (int i = 0; i < num_rects; i++) {
+        area += (uint64_t)(rects[i].x2 - rects[i].x1) * (rects[i].y2 - rects[i].y1);
+    }
+    extents = *pixman_region32_extents((pixman_region32_t *)&region);
+    extents_area = (uint64_t)(extents.x2 - extents.x1) * (extents.y2 - extents.y1);
+    if (extents_area - area > MAX(area, UPDATE_MERGE_MIN_WASTE)) {
+        return;
+    }
+    pixman_region32_reset((pixman_region32_t *)&region, &extents);
+}
+
 inline void RedScreen::begin_update(QRegion& direct_rgn, QRegion& composit_rgn,
                                     QRegion& frame_rgn)
 {
@@ -320,6 +361,8 @@ inline void RedScreen::begin_update(QRegion& direct_rgn, QRegion& composit_rgn,
     region_clone(&direct_rgn, &_dirty_region);
     region_clear(&_dirty_region);
     _update_mark++;
+    _urgent_update = false;
+    _last_update_time = get_time_ms();
     lock.unlock();
 
     QRegion rect_rgn;
@@ -336,6 +379,7 @@ inline void RedScreen::begin_update(QRegion& direct_rgn, QRegion& composit_rgn,
     }
     region_and(&direct_rgn, &rect_rgn);
     region_destroy(&rect_rgn);
+    merge_update_region(direct_rgn);
 
     for (int i = _layers.size() - 1; i >= 0; i--) {
         ScreenLayer* layer;
@@ -403,7 +447,9 @@ void RedScreen::periodic_update()
     bool need_update;
     RecurciveLock lock(_update_lock);
     if (is_dirty()) {
-        need_update = true;
+        // the timer runs at the display refresh rate, other updates are coalesced longer
+        need_update = _urgent_update ||
+                      int(get_time_ms() - _last_update_time) >= UPDATE_INTERVAL;
     } else {
         if (!_force_update_timer) {
             _owner.deactivate_interval_timer(*_update_timer);
@@ -430,7 +476,7 @@ void RedScreen::activate_timer()
     }
     _periodic_update = true;
     lock.unlock();
-    _owner.activate_interval_timer(*_update_timer, 1000 / 30);
+    _owner.activate_interval_timer(*_update_timer, REFRESH_INTERVAL);
 }
 
 void RedScreen::update()
@@ -445,8 +491,12 @@ void RedScreen::update()
 
     begin_update(direct_rgn, composit_rgn, frame_rgn);
     update_composit(composit_rgn);
+    _window.begin_batch();
     draw_direct(_window, direct_rgn, composit_rgn, frame_rgn);
     composit_to_screen(_window, composit_rgn);
+    update_stats(pixman_region32_n_rects((pixman_region32_t *)&direct_rgn) +
+                 pixman_region32_n_rects((pixman_region32_t *)&composit_rgn),
+                 _window.end_batch());
     update_done();
     region_destroy(&direct_rgn);
     region_destroy(&composit_rgn);
@@ -456,11 +506,37 @@ void RedScreen::update()
     }
 }
 
+void RedScreen::update_stats(uint32_t num_rects, uint32_t num_requests)
+{
+    uint32_t now = get_time_ms();
+    uint32_t elapsed;
+
+    if (!_update_stats.start_time) {
+        _update_stats.start_time = now;
+    }
+    _update_stats.updates++;
+    _update_stats.rects += num_rects;
+    _update_stats.requests += num_requests;
+
+    elapsed = now - _update_stats.start_time;
+    if (elapsed < UPDATE_STATS_INTERVAL) {
+        return;
+    }
+    DBG(0, "screen %d: %.1f updates/sec, %.1f rects and %.1f display requests per update",
+        _id, _update_stats.updates * 1000.0 / elapsed,
+        (double)_update_stats.rects / _update_stats.updates,
+        (double)_update_stats.requests / _update_stats.updates);
+    memset(&_update_stats, 0, sizeof(_update_stats));
+    _update_stats.start_time = now;
+}
+
 bool RedScreen::_invalidate(const SpiceRect& rect, bool urgent, uint64_t& update_mark)
 {
     RecurciveLock lock(_update_lock);
-    bool update_triger = !is_dirty() && (urgent || !_periodic_update);
+    // while the update timer runs, urgent updates wait for its next tick too
+    bool update_triger = !is_dirty() && !_periodic_update;
     region_add(&_dirty_region, &rect);
+    _urgent_update |= urgent;
     update_mark = _update_mark;
     return update_triger;
 }
@@ -134,6 +134,7 @@ private:
     void periodic_update();
     bool is_dirty() {return !region_is_empty(&_dirty_region);}
     void composit_to_screen(RedDrawable& win_dc, const QRegion& region);
+    void update_stats(uint32_t num_rects, uint32_t num_requests);
 
     void reset_mouse_pos();
     ScreenLayer* find_pointer_layer();
@@ -184,6 +185,15 @@ private:
     AutoRef<UpdateTimer> _update_timer;
     RedDrawable* _composit_area;
     uint64_t _update_mark;
+    bool _urgent_update;
+    uint32_t _last_update_time;
+
+    struct UpdateStats {
+        uint32_t start_time;
+        uint32_t updates;
+        uint32_t rects;
+        uint32_t requests;
+    } _update_stats;
 
     SpicePoint _size;
     SpicePoint _origin;
@@ -24,16 +24,32 @@
 /*class SharedCache::Treat {
     T* get(T*);
     void release(T*);
+    size_t size(T*);
     const char* name();
 };*/
 
+struct SharedCacheStats {
+    uint64_t hits;
+    uint64_t misses; // the item wasn't there yet, and the getter waited for it
+    uint64_t evictions;
+    uint32_t items;
+    uint64_t bytes;
+    uint64_t max_bytes;
+};
+
+/* HASH_SIZE is the initial number of buckets, and must be a power of 2. The hash grows
+   with the number of items. */
 template <class T, class Treat, int HASH_SIZE, class Base = EmptyBase>
 class SharedCache : public Base {
+    class Item;
+
 public:
     SharedCache()
-        : _aborting (false)
+        : _hash (HASH_SIZE, (Item*)NULL)
+        , _waiters (0)
+        , _aborting (false)
     {
-        memset(_hash, 0, sizeof(_hash));
+        memset(&_stats, 0, sizeof(_stats));
     }
 
     ~SharedCache()
@@ -54,54 +70,28 @@ public:
             item = &(*item)->next;
         }
         *item = new Item(id, data, is_lossy);
-        _new_item_cond.notify_all();
+        _stats.items++;
+        account((*item)->size, 0);
+        if (_stats.items > _hash.size() * 2) {
+            rehash(_hash.size() * 2);
+        }
+        if (_waiters) {
+            _new_item_cond.notify_all();
+        }
     }
 
     T* get(uint64_t id)
     {
         Lock lock(_lock);
-        Item* item = _hash[key(id)];
-
-        for (;;) {
-            if (!item) {
-                if (_aborting) {
-                    THROW("%s aborting", Treat::name());
-                }
-                _new_item_cond.wait(lock);
-                item = _hash[key(id)];
-                continue;
-            }
-
-            if (item->id != id) {
-                item = item->next;
-                continue;
-            }
+        Item* item = find(lock, id);
 
-            return Treat::get(item->data);
-        }
+        return Treat::get(item->data);
     }
 
     T* get_lossless(uint64_t id)
     {
         Lock lock(_lock);
-        Item* item = _hash[key(id)];
-
-        for (;;) {
-            if (!item) {
-                if (_aborting) {
-                    THROW("%s aborting", Treat::name());
-                }
-                _new_item_cond.wait(lock);
-                item = _hash[key(id)];
-                continue;
-            }
-
-            if (item->id != id) {
-                item = item->next;
-                continue;
-            }
-            break;
-        }
+        Item* item = find(lock, id);
 
         // item has been retreived. Now checking if lossless
         for (;;) {
@@ -109,7 +99,9 @@ public:
                 if (_aborting) {
                     THROW("%s aborting", Treat::name());
                 }
+                _waiters++;
                 _replace_data_cond.wait(lock);
+                _waiters--;
                 continue;
             }
 
@@ -120,27 +112,14 @@ public:
     void replace(uint64_t id, T* data, bool is_lossy = FALSE)
     {
         Lock lock(_lock);
-        Item* item = _hash[key(id)];
+        Item* item = find(lock, id);
+        size_t size = item->size;
 
-        for (;;) {
-            if (!item) {
-                if (_aborting) {
-                    THROW("%s aborting", Treat::name());
-                }
-                _new_item_cond.wait(lock);
-                item = _hash[key(id)];
-                continue;
-            }
-
-            if (item->id != id) {
-                item = item->next;
-                continue;
-            }
-
-            item->replace(data, is_lossy);
-            break;
+        item->replace(data, is_lossy);
+        account(item->size, size);
+        if (_waiters) {
+            _replace_data_cond.notify_all();
         }
-        _replace_data_cond.notify_all();
     }
 
     void remove(uint64_t id)
@@ -153,6 +132,9 @@ public:
                 if (!--(*item)->refs) {
                     Item *rm_item = *item;
                     *item = rm_item->next;
+                    _stats.items--;
+                    _stats.evictions++;
+                    account(0, rm_item->size);
                     delete rm_item;
                 }
                 return;
@@ -165,13 +147,15 @@ public:
     void clear()
     {
         Lock lock(_lock);
-        for (int i = 0; i < HASH_SIZE; i++) {
+        for (size_t i = 0; i < _hash.size(); i++) {
             while (_hash[i]) {
                 Item *item = _hash[i];
                 _hash[i] = item->next;
                 delete item;
             }
         }
+        _stats.items = 0;
+        _stats.bytes = 0;
     }
 
     void abort()
@@ -179,10 +163,75 @@ public:
         Lock lock(_lock);
         _aborting = true;
         _new_item_cond.notify_all();
+        _replace_data_cond.notify_all();
+    }
+
+    void get_stats(SharedCacheStats& stats)
+    {
+        Lock lock(_lock);
+        stats = _stats;
     }
 
 private:
-    inline uint32_t key(uint64_t id) {return uint32_t(id) % HASH_SIZE;}
+    inline uint32_t key(uint64_t id)
+    {
+        return uint32_t((id * 0x9e3779b97f4a7c15ULL) >> 32) & (_hash.size() - 1);
+    }
+
+    /* waits for the item if it wasn't added yet */
+    Item* find(Lock& lock, uint64_t id)
+    {
+        Item* item = _hash[key(id)];
+        bool waited = false;
+
+        for (;;) {
+            if (!item) {
+                if (_aborting) {
+                    THROW("%s aborting", Treat::name());
+                }
+                waited = true;
+                _waiters++;
+                _new_item_cond.wait(lock);
+                _waiters--;
+                item = _hash[key(id)];
+                continue;
+            }
+
+            if (item->id != id) {
+                item = item->next;
+                continue;
+            }
+
+            if (waited) {
+                _stats.misses++;
+            } else {
+                _stats.hits++;
+            }
+            return item;
+        }
+    }
+
+    void rehash(size_t hash_size)
+    {
+        std::vector<Item*> old_hash(hash_size, (Item*)NULL);
+
+        old_hash.swap(_hash);
+        for (size_t i = 0; i < old_hash.size(); i++) {
+            while (old_hash[i]) {
+                Item* item = old_hash[i];
+                old_hash[i] = item->next;
+                item->next = _hash[key(item->id)];
+                _hash[key(item->id)] = item;
+            }
+        }
+    }
+
+    void account(size_t added, size_t removed)
+    {
+        _stats.bytes += added;
+        _stats.bytes -= removed;
+        _stats.max_bytes = MAX(_stats.max_bytes, _stats.bytes);
+    }
 
 private:
     class Item {
@@ -192,6 +241,7 @@ private:
             , refs (1)
             , next (NULL)
             , data (Treat::get(data))
+            , size (Treat::size(data))
             , lossy (is_lossy) {}
 
         ~Item()
@@ -203,6 +253,7 @@ private:
         {
             Treat::release(data);
             data = Treat::get(new_data);
+            size = Treat::size(new_data);
             lossy = is_lossy;
         }
 
@@ -210,14 +261,17 @@ private:
         int refs;
         Item* next;
         T* data;
+        size_t size;
         bool lossy;
     };
 
-    Item* _hash[HASH_SIZE];
+    std::vector<Item*> _hash;
     Mutex _lock;
     Condition _new_item_cond;
     Condition _replace_data_cond;
+    int _waiters;
     bool _aborting;
+    SharedCacheStats _stats;
 };
 
 #endif
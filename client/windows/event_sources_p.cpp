@@ -64,6 +64,7 @@ void EventSources_p::remove_event(EventSource* source)
 }
 
 EventSources::EventSources()
+    : _num_wakeups (0)
 {
 }
 
@@ -75,6 +76,7 @@ bool EventSources::wait_events(int timeout_ms)
 {
     if (_handles.empty()) {
         if (WaitMessage()) {
+            _num_wakeups++;
             return process_system_events();
         } else {
             THROW("wait failed %d", GetLastError());
@@ -91,6 +93,7 @@ bool EventSources::wait_events(int timeout_ms)
         THROW("wait failed %d", GetLastError());
     }
 
+    _num_wakeups++;
     size_t event_index = wait_res - WAIT_OBJECT_0;
     if (event_index == _handles.size()) {
         return process_system_events();
@@ -45,6 +45,16 @@ void RedDrawable::copy_pixels(const PixelsSource& src, int src_x, int src_y, con
     }
 }
 
+void RedDrawable::begin_batch()
+{
+}
+
+uint32_t RedDrawable::end_batch()
+{
+    // GDI batches the calls of each thread by itself
+    return 0;
+}
+
 void RedDrawable::blend_pixels(const PixelsSource& src, int src_x, int src_y, const SpiceRect& dest)
 {
     static BLENDFUNCTION blend_func = { AC_SRC_OVER, 0, 0xff, AC_SRC_ALPHA};
@@ -18,7 +18,7 @@
 #include <config.h>
 #endif
 
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/fcntl.h>
 
 #include "event_sources.h"
@@ -49,16 +49,32 @@ static void set_blocking(int fd)
     }
 }
 
+#define MAX_READY_EVENTS 32
+
 EventSources::EventSources()
+    : _num_wakeups (0)
 {
+    if ((_epoll_fd = ::epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        THROW("create epoll failed: %s", strerror(errno));
+    }
 }
 
 EventSources::~EventSources()
 {
+    close(_epoll_fd);
 }
 
 void EventSources_p::add_event(int fd, EventSource* source)
 {
+    struct epoll_event event;
+
+    /* Right now we only use read polling in spice */
+    event.events = EPOLLIN;
+    event.data.ptr = source;
+    if (::epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        THROW("add event failed: %s", strerror(errno));
+    }
+
     int size = _events.size();
     _events.resize(size + 1);
     _fds.resize(size + 1);
@@ -68,9 +84,17 @@ void EventSources_p::add_event(int fd, EventSource* source)
 
 void EventSources_p::remove_event(EventSource* source)
 {
+    for (unsigned int i = 0; i < _ready.size(); i++) {
+        if (_ready[i] == source) {
+            _ready[i] = NULL;
+        }
+    }
+
     int size = _events.size();
     for (int i = 0; i < size; i++) {
         if (_events[i] == source) {
+            /* fails if the fd was already closed, which also removes it */
+            ::epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, _fds[i], NULL);
             for (i++; i < size; i++) {
                 _events[i - 1] = _events[i];
                 _fds[i - 1] = _fds[i];
@@ -85,49 +109,34 @@ void EventSources_p::remove_event(EventSource* source)
 
 bool EventSources::wait_events(int timeout_msec)
 {
-    int maxfd = 0;
-    fd_set rfds;
-    struct timeval tv;
-    struct timeval *tvp;
+    struct epoll_event events[MAX_READY_EVENTS];
     int ready;
 
-    FD_ZERO(&rfds);
-
-    int size = _events.size();
-    for (int i = 0; i < size; i++) {
-        maxfd = MAX(maxfd, _fds[i]);
-        FD_SET(_fds[i], &rfds);
-    }
-
-    if (timeout_msec == INFINITE) {
-        tvp = NULL;
-    } else {
-        tv.tv_sec = timeout_msec / 1000;
-        tv.tv_usec = (timeout_msec % 1000) * 1000;
-        tvp = &tv;
-    }
-
-    /* Right now we only use read polling in spice */
-    ready = ::select(maxfd+1, &rfds, NULL, NULL, tvp);
+    ready = ::epoll_wait(_epoll_fd, events, MAX_READY_EVENTS, timeout_msec);
 
     if (ready == -1) {
         if (errno == EINTR) {
             return false;
         }
-        THROW("wait error select failed");
+        THROW("wait error epoll_wait failed");
     } else if (ready == 0) {
         return false;
     }
 
-    for (unsigned int i = 0; i < _events.size(); i++) {
-        if (FD_ISSET(_fds[i], &rfds)) {
-            _events[i]->action();
-            /* The action may have removed / added event sources changing
-               our array, so leave the loop and handle other events the next
-               time we are called */
-            return false;
+    _num_wakeups++;
+    _ready.resize(ready);
+    for (int i = 0; i < ready; i++) {
+        _ready[i] = (EventSource*)events[i].data.ptr;
+    }
+
+    /* The actions may remove event sources (and destroy them), remove_event clears
+       them from _ready. Sources that are added are handled in the next call. */
+    for (unsigned int i = 0; i < _ready.size(); i++) {
+        if (_ready[i]) {
+            _ready[i]->action();
         }
     }
+    _ready.clear();
     return false;
 }
 
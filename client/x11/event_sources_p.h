@@ -31,8 +31,12 @@ protected:
     void remove_event(EventSource* source);
 
 public:
+    int _epoll_fd;
     std::vector<EventSource*> _events;
     std::vector<int> _fds;
+    /* the sources that are ready in the current wakeup, the sources that are removed
+       during their dispatch are cleared */
+    std::vector<EventSource*> _ready;
 };
 
 class Trigger_p {
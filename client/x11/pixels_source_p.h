@@ -57,6 +57,9 @@ struct PixelsSource_p {
             int screen;
             GC gc;
             int width, height;
+            /* copies to the drawable are flushed by end_batch() while batch_depth > 0 */
+            int batch_depth;
+            unsigned long batch_start_request;
 #ifdef USE_OPENGL
             RenderType rendertype;
             union {
@@ -19,15 +19,40 @@
 #endif
 
 #include "playback.h"
+#include "platform.h"
 #include "utils.h"
 #include "debug.h"
 
-#define REING_SIZE_MS 300
+/* The latency is the amount of audio that is queued before the playback starts. It
+   starts low, grows on underruns, and shrinks back when there were none for a while.
+   The hw buffer has room for twice the latency, the rest absorbs bursts. */
+#define PLAYBACK_INIT_LATENCY 100 // ms
+#define PLAYBACK_MIN_LATENCY 40 // ms
+#define PLAYBACK_MAX_LATENCY 400 // ms
+#define PLAYBACK_LATENCY_STEP 40 // ms
+#define PLAYBACK_STABLE_TIME (30ULL * 1000 * 1000 * 1000) // nano
+#define PLAYBACK_BUFFER_FACTOR 2
+/* frames are written to the device once a period is batched, but at least
+   PLAYBACK_PERIODS times during the latency */
+#define PLAYBACK_PERIODS 4
 
 WavePlayer::WavePlayer(uint32_t sampels_per_sec, uint32_t bits_per_sample, uint32_t channels)
     : _pcm (NULL)
     , _hw_params (NULL)
     , _sw_params (NULL)
+    , _sampels_per_ms (sampels_per_sec / 1000)
+    , _frame_bytes (0)
+    , _buffer_size (0)
+    , _period_size (0)
+    , _min_latency (PLAYBACK_MIN_LATENCY)
+    , _latency (PLAYBACK_INIT_LATENCY)
+    , _configured_latency (0)
+    , _stable_since (0)
+    , _underruns (0)
+    , _batch (NULL)
+    , _batch_size (0)
+    , _batch_pos (0)
+    , _batch_max_frames (0)
 {
     if (!init(sampels_per_sec, bits_per_sample, channels)) {
         cleanup();
@@ -48,6 +73,8 @@ void WavePlayer::cleanup()
     if (_sw_params) {
         snd_pcm_sw_params_free(_sw_params);
     }
+
+    delete[] _batch;
 }
 
 WavePlayer::~WavePlayer()
@@ -59,22 +86,21 @@ bool WavePlayer::init(uint32_t sampels_per_sec,
                       uint32_t bits_per_sample,
                       uint32_t channels)
 {
-    const int frame_size = WavePlaybackAbstract::FRAME_SIZE;
     const char* pcm_device = "default";
-    snd_pcm_format_t format;
     int err;
 
     switch (bits_per_sample) {
     case 8:
-        format = SND_PCM_FORMAT_S8;
+        _format = SND_PCM_FORMAT_S8;
         break;
     case 16:
-        format = SND_PCM_FORMAT_S16_LE;
+        _format = SND_PCM_FORMAT_S16_LE;
         break;
     default:
         return false;
     }
-    _sampels_per_ms = sampels_per_sec / 1000;
+    _sampels_per_sec = sampels_per_sec;
+    _channels = channels;
 
     if ((err = snd_pcm_open(&_pcm, pcm_device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0) {
         LOG_ERROR("cannot open audio playback device %s %s", pcm_device, snd_strerror(err));
@@ -91,6 +117,20 @@ bool WavePlayer::init(uint32_t sampels_per_sec,
         return false;
     }
 
+    _frame_bytes = WavePlaybackAbstract::FRAME_SIZE * channels * bits_per_sample / 8;
+    _batch_max_frames = MAX(_sampels_per_ms * PLAYBACK_MAX_LATENCY / PLAYBACK_PERIODS /
+                            WavePlaybackAbstract::FRAME_SIZE, 1);
+    _batch = new uint8_t[_batch_max_frames * _frame_bytes];
+
+    return configure();
+}
+
+/* (re)sets the hw and sw params of the pcm to _latency. The pcm must not be running. */
+bool WavePlayer::configure()
+{
+    const int frame_size = WavePlaybackAbstract::FRAME_SIZE;
+    int err;
+
     if ((err = snd_pcm_hw_params_any(_pcm, _hw_params)) < 0) {
         LOG_ERROR("cannot initialize hardware parameter structure %s", snd_strerror(err));
         return false;
@@ -107,23 +147,23 @@ bool WavePlayer::init(uint32_t sampels_per_sec,
         return false;
     }
 
-    if ((err = snd_pcm_hw_params_set_rate(_pcm, _hw_params, sampels_per_sec, 0)) < 0) {
+    if ((err = snd_pcm_hw_params_set_rate(_pcm, _hw_params, _sampels_per_sec, 0)) < 0) {
         LOG_ERROR("cannot set sample rate %s", snd_strerror(err));
         return false;
     }
 
-    if ((err = snd_pcm_hw_params_set_channels(_pcm, _hw_params, channels)) < 0) {
+    if ((err = snd_pcm_hw_params_set_channels(_pcm, _hw_params, _channels)) < 0) {
         LOG_ERROR("cannot set channel count %s", snd_strerror(err));
         return false;
     }
 
-    if ((err = snd_pcm_hw_params_set_format(_pcm, _hw_params, format)) < 0) {
+    if ((err = snd_pcm_hw_params_set_format(_pcm, _hw_params, _format)) < 0) {
         LOG_ERROR("cannot set sample format %s", snd_strerror(err));
         return false;
     }
 
     snd_pcm_uframes_t buffer_size;
-    buffer_size = (sampels_per_sec * REING_SIZE_MS / 1000) / frame_size * frame_size;
+    buffer_size = (_sampels_per_ms * _latency * PLAYBACK_BUFFER_FACTOR) / frame_size * frame_size;
 
     if ((err = snd_pcm_hw_params_set_buffer_size_near(_pcm, _hw_params, &buffer_size)) < 0) {
         LOG_ERROR("cannot set buffer size %s", snd_strerror(err));
@@ -131,7 +171,8 @@ bool WavePlayer::init(uint32_t sampels_per_sec,
     }
 
     int direction = 1;
-    snd_pcm_uframes_t period_size = (sampels_per_sec * 20 / 1000) / frame_size * frame_size;
+    snd_pcm_uframes_t period_size = MAX((_sampels_per_ms * _latency / PLAYBACK_PERIODS) /
+                                        frame_size * frame_size, frame_size);
     if ((err = snd_pcm_hw_params_set_period_size_near(_pcm, _hw_params, &period_size,
                                                       &direction)) < 0) {
         LOG_ERROR("cannot set period size %s", snd_strerror(err));
@@ -148,21 +189,21 @@ bool WavePlayer::init(uint32_t sampels_per_sec,
         return false;
     }
 
-    err = snd_pcm_hw_params_get_buffer_size(_hw_params, &buffer_size);
+    err = snd_pcm_hw_params_get_buffer_size(_hw_params, &_buffer_size);
     if (err < 0) {
         LOG_ERROR("unable to get buffer size for playback: %s", snd_strerror(err));
         return false;
     }
 
     direction = 0;
-    err = snd_pcm_hw_params_get_period_size(_hw_params, &period_size, &direction);
+    err = snd_pcm_hw_params_get_period_size(_hw_params, &_period_size, &direction);
     if (err < 0) {
         LOG_ERROR("unable to get period size for playback: %s", snd_strerror(err));
         return false;
     }
 
-    err = snd_pcm_sw_params_set_start_threshold(_pcm, _sw_params,
-                                                (buffer_size / period_size) * period_size);
+    snd_pcm_uframes_t start_threshold = MIN(_sampels_per_ms * _latency, _buffer_size);
+    err = snd_pcm_sw_params_set_start_threshold(_pcm, _sw_params, start_threshold);
     if (err < 0) {
         LOG_ERROR("unable to set start threshold mode for playback: %s", snd_strerror(err));
         return false;
@@ -178,28 +219,107 @@ bool WavePlayer::init(uint32_t sampels_per_sec,
         return false;
     }
 
+    _batch_size = MIN(MAX(MIN(_period_size, start_threshold / PLAYBACK_PERIODS) / frame_size,
+                          1), _batch_max_frames);
+    _configured_latency = _latency;
+    DBG(0, "latency %u ms, buffer %lu period %lu batch %u frames", _latency,
+        _buffer_size, _period_size, _batch_size);
     return true;
 }
 
-bool WavePlayer::write(uint8_t* frame)
+/* applies a latency change while the playback is stopped */
+void WavePlayer::reconfigure()
+{
+    if (_latency == _configured_latency) {
+        return;
+    }
+    snd_pcm_drop(_pcm);
+    if (!configure()) {
+        LOG_WARN("playback reconfiguration to %u ms failed", _latency);
+        _latency = _configured_latency;
+        configure();
+    }
+}
+
+void WavePlayer::on_underrun()
+{
+    _underruns++;
+    _stable_since = Platform::get_monolithic_time();
+    _latency = MIN(_latency + PLAYBACK_LATENCY_STEP, PLAYBACK_MAX_LATENCY);
+    DBG(0, "underrun %u, latency %u ms", _underruns, _latency);
+    if (_latency != _configured_latency) {
+        reconfigure();
+    } else {
+        snd_pcm_prepare(_pcm);
+    }
+}
+
+void WavePlayer::check_stable()
 {
-    snd_pcm_sframes_t ret = snd_pcm_writei(_pcm, frame, WavePlaybackAbstract::FRAME_SIZE);
-    if (ret < 0) {
+    uint64_t now = Platform::get_monolithic_time();
+
+    if (!_stable_since) {
+        _stable_since = now;
+        return;
+    }
+    if (now - _stable_since < PLAYBACK_STABLE_TIME || _latency <= _min_latency) {
+        return;
+    }
+    // takes effect when the playback restarts
+    _latency = MAX(_latency - PLAYBACK_LATENCY_STEP / 2, _min_latency);
+    _stable_since = now;
+}
+
+bool WavePlayer::flush()
+{
+    uint8_t* data = _batch;
+    snd_pcm_sframes_t frames = _batch_pos * WavePlaybackAbstract::FRAME_SIZE;
+    snd_pcm_sframes_t ret;
+
+    _batch_pos = 0;
+    while (frames > 0) {
+        ret = snd_pcm_writei(_pcm, data, frames);
         if (ret == -EAGAIN) {
+            // the device buffer is full, drop the rest like before
             return false;
         }
-        DBG(0, "err %s", snd_strerror(-ret));
-        if (snd_pcm_recover(_pcm, ret, 1) == 0) {
-            snd_pcm_writei(_pcm, frame, WavePlaybackAbstract::FRAME_SIZE);
+        if (ret == -EPIPE) {
+            on_underrun();
+            continue;
         }
+        if (ret < 0) {
+            DBG(0, "err %s", snd_strerror(-ret));
+            if (snd_pcm_recover(_pcm, ret, 1) < 0) {
+                return false;
+            }
+            continue;
+        }
+        data += snd_pcm_frames_to_bytes(_pcm, ret);
+        frames -= ret;
     }
+    check_stable();
     return true;
 }
 
+bool WavePlayer::write(uint8_t* frame)
+{
+    memcpy(_batch + _batch_pos * _frame_bytes, frame, _frame_bytes);
+    if (++_batch_pos < _batch_size) {
+        return true;
+    }
+    return flush();
+}
+
 void WavePlayer::stop()
 {
+    flush();
     snd_pcm_drain(_pcm);
-    snd_pcm_prepare(_pcm);
+    _stable_since = 0;
+    if (_latency != _configured_latency) {
+        reconfigure();
+    } else {
+        snd_pcm_prepare(_pcm);
+    }
 }
 
 bool WavePlayer::abort()
@@ -207,14 +327,27 @@ bool WavePlayer::abort()
     return true;
 }
 
+/* The server asks for a higher latency for syncing the audio with video streams. Like
+   the other latency changes, it takes effect when the playback restarts or underruns,
+   so that the queued frames aren't dropped. */
+void WavePlayer::set_min_latency(uint32_t latency_ms)
+{
+    _min_latency = MIN(MAX(latency_ms, PLAYBACK_MIN_LATENCY), PLAYBACK_MAX_LATENCY);
+    _latency = MAX(_latency, _min_latency);
+}
+
 uint32_t WavePlayer::get_delay_ms()
 {
     ASSERT(_pcm);
 
     snd_pcm_sframes_t delay;
 
+    // until the start threshold is reached, new frames are played after the latency
+    if (snd_pcm_state(_pcm) != SND_PCM_STATE_RUNNING) {
+        return _configured_latency;
+    }
     if (snd_pcm_delay(_pcm, &delay) < 0) {
         return 0;
     }
-    return delay / _sampels_per_ms;
+    return (delay + _batch_pos * WavePlaybackAbstract::FRAME_SIZE) / _sampels_per_ms;
 }
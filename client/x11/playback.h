@@ -32,16 +32,40 @@ public:
     virtual bool abort();
     virtual void stop();
     virtual uint32_t get_delay_ms();
+    virtual void set_min_latency(uint32_t latency_ms);
 
 private:
     bool init(uint32_t sampels_per_sec, uint32_t bits_per_sample, uint32_t channel);
+    bool configure();
+    void reconfigure();
+    void on_underrun();
+    void check_stable();
+    bool flush();
     void cleanup();
 
 private:
     snd_pcm_t* _pcm;
     snd_pcm_hw_params_t* _hw_params;
     snd_pcm_sw_params_t* _sw_params;
+    snd_pcm_format_t _format;
+    uint32_t _sampels_per_sec;
+    uint32_t _channels;
     uint32_t _sampels_per_ms;
+    uint32_t _frame_bytes;
+    snd_pcm_uframes_t _buffer_size;
+    snd_pcm_uframes_t _period_size;
+
+    uint32_t _min_latency;        // ms
+    uint32_t _latency;            // ms, the target
+    uint32_t _configured_latency; // ms, the one the pcm is set to
+    uint64_t _stable_since;
+    uint32_t _underruns;
+
+    /* frames are written to the pcm in batches of _batch_size */
+    uint8_t* _batch;
+    uint32_t _batch_size;
+    uint32_t _batch_pos;
+    uint32_t _batch_max_frames;
 };
 
 #endif
@@ -254,7 +254,9 @@ static inline void copy_to_drawable_from_pixmap(const RedDrawable_p* dest,
 
         free_temp_image(image, shminfo, pixman_image);
     }
-    XFlush(XPlatform::get_display());
+    if (!dest->source.x_drawable.batch_depth) {
+        XFlush(XPlatform::get_display());
+    }
 }
 
 static inline void copy_to_x_drawable(const RedDrawable_p* dest,
@@ -416,6 +418,46 @@ void RedDrawable::copy_pixels(const PixelsSource& src, int src_x, int src_y, con
     }
 }
 
+static inline bool is_x_drawable(const RedDrawable_p* dest)
+{
+#ifdef USE_OPENGL
+    if (dest->source.type == PIXELS_SOURCE_TYPE_GL_DRAWABLE) {
+        return true;
+    }
+#endif // USE_OPENGL
+    return dest->source.type == PIXELS_SOURCE_TYPE_X_DRAWABLE;
+}
+
+void RedDrawable::begin_batch()
+{
+    RedDrawable_p* dest = (RedDrawable_p*)get_opaque();
+
+    if (!is_x_drawable(dest)) {
+        return;
+    }
+    if (!dest->source.x_drawable.batch_depth++) {
+        dest->source.x_drawable.batch_start_request = XNextRequest(XPlatform::get_display());
+    }
+}
+
+uint32_t RedDrawable::end_batch()
+{
+    RedDrawable_p* dest = (RedDrawable_p*)get_opaque();
+    uint32_t num_requests;
+
+    if (!is_x_drawable(dest)) {
+        return 0;
+    }
+    ASSERT(dest->source.x_drawable.batch_depth > 0);
+    if (--dest->source.x_drawable.batch_depth) {
+        return 0;
+    }
+    num_requests = XNextRequest(XPlatform::get_display()) -
+                   dest->source.x_drawable.batch_start_request;
+    XFlush(XPlatform::get_display());
+    return num_requests;
+}
+
 static inline void blend_to_drawable(const RedDrawable_p* dest,
                                      const SpiceRect& area,
                                      const SpicePoint& offset,
@@ -1251,6 +1251,7 @@ void RedWindow_p::create(RedWindow& red_window, PixelsSource_p& pix_source,
     pix_source.x_drawable.drawable = window;
     pix_source.x_drawable.screen = _screen;
     pix_source.x_drawable.gc = gc;
+    pix_source.x_drawable.batch_depth = 0;
     set_minmax(pix_source);
     sync();
 }
@@ -24,10 +24,18 @@
 #include "char_device.h"
 #include "red_channel.h"
 #include "reds.h"
+#include "red_time.h"
+#include "stat.h"
 
 #define CHAR_DEVICE_WRITE_TO_TIMEOUT 100
 #define SPICE_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT 30000
 
+/* byte-credit flow control: the window is sized so that the data queued for the
+ * device is drained within CHAR_DEVICE_BYTE_WINDOW_DRAIN_MS. The drain rate is sampled
+ * only while the device is the bottleneck (i.e., it refuses writes) */
+#define CHAR_DEVICE_BYTE_WINDOW_DRAIN_MS 200
+#define CHAR_DEVICE_DRAIN_SAMPLE_NS (100 * 1000 * 1000)
+
 typedef struct SpiceCharDeviceClientState SpiceCharDeviceClientState;
 struct SpiceCharDeviceClientState {
     RingItem link;
@@ -42,8 +50,19 @@ struct SpiceCharDeviceClientState {
     Ring send_queue;
     uint32_t send_queue_size;
     uint32_t max_send_queue_size;
+    uint64_t write_queue_bytes; /* bytes from this client that wait to be written to the device */
 };
 
+typedef struct SpiceCharDeviceStat {
+    StatNodeRef node;
+    uint64_t *write_bytes;
+    uint64_t *write_stalls; /* the device didn't accept all the pending data */
+    uint64_t *send_stalls; /* a msg from the device was queued since a client lacked tokens */
+    uint64_t *client_stalls; /* a client exceeded its share of the byte window */
+    uint64_t *early_tokens; /* client tokens returned before the device consumed the data */
+    uint64_t *window_size;
+} SpiceCharDeviceStat;
+
 struct SpiceCharDeviceState {
     int running;
     int active; /* has read/write been performed since the device was started */
@@ -63,6 +82,16 @@ struct SpiceCharDeviceState {
     uint64_t client_tokens_interval; /* frequency of returning tokens to the client */
     SpiceCharDeviceInstance *sin;
 
+    /* byte-credit flow control, see spice_char_device_set_byte_window */
+    int byte_credits;
+    uint64_t min_window_size;
+    uint64_t max_window_size;
+    uint64_t window_size;
+    uint64_t drain_start_time;
+    uint64_t drain_bytes;
+
+    SpiceCharDeviceStat stat;
+
     int during_read_from_device;
 
     SpiceCharDeviceCallbacks cbs;
@@ -250,6 +279,7 @@ static void spice_char_device_add_msg_to_client_queue(SpiceCharDeviceClientState
     msg_item->msg = dev->cbs.ref_msg_to_client(msg, dev->opaque);
     ring_add(&dev_client->send_queue, &msg_item->link);
     dev_client->send_queue_size++;
+    stat_inc_counter(dev->stat.send_stalls, 1);
     if (!dev_client->wait_for_tokens_started) {
         core->timer_start(dev_client->wait_for_tokens_timer,
                           SPICE_CHAR_DEVICE_WAIT_TOKENS_TIMEOUT);
@@ -427,6 +457,63 @@ static void spice_char_device_client_tokens_add(SpiceCharDeviceState *dev,
     }
 }
 
+static uint64_t spice_char_device_client_byte_share(SpiceCharDeviceState *dev)
+{
+    spice_assert(dev->num_clients);
+    return MAX(dev->window_size / dev->num_clients, 1);
+}
+
+static void spice_char_device_window_size_set(SpiceCharDeviceState *dev, uint64_t window_size)
+{
+    dev->window_size = MIN(MAX(window_size, dev->min_window_size), dev->max_window_size);
+    if (dev->stat.window_size) {
+        *dev->stat.window_size = dev->window_size;
+    }
+}
+
+/*
+ * The drain rate is measured only while the device is the bottleneck, i.e., while it
+ * doesn't accept all the pending data. As long as the device keeps up with the
+ * clients, the window grows towards max_window_size.
+ */
+static void spice_char_device_update_drain_rate(SpiceCharDeviceState *dev,
+                                                uint32_t bytes_written,
+                                                int stalled)
+{
+    uint64_t now;
+
+    if (!dev->byte_credits) {
+        return;
+    }
+
+    if (!stalled) {
+        dev->drain_start_time = 0;
+        dev->drain_bytes = 0;
+        spice_char_device_window_size_set(dev, dev->window_size + bytes_written);
+        return;
+    }
+
+    now = red_now();
+    if (!dev->drain_start_time) {
+        dev->drain_start_time = now;
+        dev->drain_bytes = 0;
+        return;
+    }
+    dev->drain_bytes += bytes_written;
+    if (now - dev->drain_start_time >= CHAR_DEVICE_DRAIN_SAMPLE_NS) {
+        uint64_t bytes_per_sec;
+
+        bytes_per_sec = (dev->drain_bytes * 1000 * 1000 * 1000) / (now - dev->drain_start_time);
+        /* smooth the window, the device might be bursty */
+        spice_char_device_window_size_set(dev,
+            (dev->window_size + bytes_per_sec * CHAR_DEVICE_BYTE_WINDOW_DRAIN_MS / 1000) / 2);
+        spice_debug("dev %p drain rate %" PRIu64 " bytes/sec window %" PRIu64,
+                    dev, bytes_per_sec, dev->window_size);
+        dev->drain_start_time = now;
+        dev->drain_bytes = 0;
+    }
+}
+
 static int spice_char_device_write_to_device(SpiceCharDeviceState *dev)
 {
     SpiceCharDeviceInterface *sif;
@@ -470,14 +557,17 @@ static int spice_char_device_write_to_device(SpiceCharDeviceState *dev)
         }
         dev->cur_write_buf_pos += n;
     }
+    stat_inc_counter(dev->stat.write_bytes, total);
     /* retry writing as long as the write queue is not empty */
     if (dev->running) {
         if (dev->cur_write_buf) {
             core->timer_start(dev->write_to_dev_timer,
                               CHAR_DEVICE_WRITE_TO_TIMEOUT);
+            stat_inc_counter(dev->stat.write_stalls, 1);
         } else {
             spice_assert(ring_is_empty(&dev->write_queue));
         }
+        spice_char_device_update_drain_rate(dev, total, dev->cur_write_buf != NULL);
         dev->active = dev->active || total;
     }
     spice_char_device_state_unref(dev);
@@ -574,16 +664,46 @@ static SpiceCharDeviceWriteBuffer *spice_char_device_write_buffer_ref(SpiceCharD
     return write_buf;
 }
 
+/*
+ * In byte-credit mode, the token of a client message is returned as soon as the message
+ * is queued, as long as the bytes the client has pending for the device fit in its share
+ * of the window. Small messages thus don't wait for the device, while clients that
+ * send big messages are throttled by the device drain rate.
+ */
+static void spice_char_device_client_write_queue_add(SpiceCharDeviceState *dev,
+                                                     SpiceCharDeviceClientState *dev_client,
+                                                     SpiceCharDeviceWriteBuffer *write_buf)
+{
+    dev_client->write_queue_bytes += write_buf->buf_used;
+    if (!dev->byte_credits || !dev_client->do_flow_control || !write_buf->token_price) {
+        return;
+    }
+    if (dev_client->write_queue_bytes <= spice_char_device_client_byte_share(dev)) {
+        uint32_t tokens = write_buf->token_price;
+
+        write_buf->token_price = 0;
+        stat_inc_counter(dev->stat.early_tokens, tokens);
+        spice_char_device_client_tokens_add(dev, dev_client, tokens);
+    } else {
+        stat_inc_counter(dev->stat.client_stalls, 1);
+    }
+}
+
 void spice_char_device_write_buffer_add(SpiceCharDeviceState *dev,
                                         SpiceCharDeviceWriteBuffer *write_buf)
 {
     spice_assert(dev);
-    /* caller shouldn't add buffers for client that was removed */
-    if (write_buf->origin == WRITE_BUFFER_ORIGIN_CLIENT &&
-        !spice_char_device_client_find(dev, write_buf->client)) {
-        spice_printerr("client not found: dev %p client %p", dev, write_buf->client);
-        spice_char_device_write_buffer_pool_add(dev, write_buf);
-        return;
+    if (write_buf->origin == WRITE_BUFFER_ORIGIN_CLIENT) {
+        SpiceCharDeviceClientState *dev_client;
+
+        dev_client = spice_char_device_client_find(dev, write_buf->client);
+        /* caller shouldn't add buffers for client that was removed */
+        if (!dev_client) {
+            spice_printerr("client not found: dev %p client %p", dev, write_buf->client);
+            spice_char_device_write_buffer_pool_add(dev, write_buf);
+            return;
+        }
+        spice_char_device_client_write_queue_add(dev, dev_client, write_buf);
     }
 
     ring_add(&dev->write_queue, &write_buf->link);
@@ -595,6 +715,7 @@ void spice_char_device_write_buffer_release(SpiceCharDeviceState *dev,
 {
     int buf_origin = write_buf->origin;
     uint32_t buf_token_price = write_buf->token_price;
+    uint32_t buf_used = write_buf->buf_used;
     RedClient *client = write_buf->client;
 
     spice_assert(!ring_item_is_linked(&write_buf->link));
@@ -615,7 +736,11 @@ void spice_char_device_write_buffer_release(SpiceCharDeviceState *dev,
         dev_client = spice_char_device_client_find(dev, client);
         /* when a client is removed, we remove all the buffers that are associated with it */
         spice_assert(dev_client);
-        spice_char_device_client_tokens_add(dev, dev_client, buf_token_price);
+        spice_assert(dev_client->write_queue_bytes >= buf_used);
+        dev_client->write_queue_bytes -= buf_used;
+        if (buf_token_price) {
+            spice_char_device_client_tokens_add(dev, dev_client, buf_token_price);
+        }
     } else if (buf_origin == WRITE_BUFFER_ORIGIN_SERVER) {
         dev->num_self_tokens++;
         if (dev->cbs.on_free_self_token) {
@@ -647,6 +772,7 @@ SpiceCharDeviceState *spice_char_device_state_create(SpiceCharDeviceInstance *si
     char_dev->opaque = opaque;
     char_dev->client_tokens_interval = client_tokens_interval;
     char_dev->num_self_tokens = self_tokens;
+    char_dev->stat.node = INVALID_STAT_REF;
 
     ring_init(&char_dev->write_queue);
     ring_init(&char_dev->write_bufs_pool);
@@ -662,6 +788,59 @@ SpiceCharDeviceState *spice_char_device_state_create(SpiceCharDeviceInstance *si
     return char_dev;
 }
 
+void spice_char_device_set_byte_window(SpiceCharDeviceState *dev,
+                                       uint32_t min_window_size,
+                                       uint32_t max_window_size)
+{
+    spice_assert(min_window_size && min_window_size <= max_window_size);
+    dev->byte_credits = TRUE;
+    dev->min_window_size = min_window_size;
+    dev->max_window_size = max_window_size;
+    dev->drain_start_time = 0;
+    dev->drain_bytes = 0;
+    spice_char_device_window_size_set(dev, max_window_size);
+}
+
+void spice_char_device_state_stat_register(SpiceCharDeviceState *dev, const char *name)
+{
+    SpiceCharDeviceStat *stat = &dev->stat;
+
+    spice_assert(stat->node == INVALID_STAT_REF);
+    stat->node = stat_add_node(INVALID_STAT_REF, name, TRUE);
+    if (stat->node == INVALID_STAT_REF) {
+        return;
+    }
+    stat->write_bytes = stat_add_counter(stat->node, "write_bytes", TRUE);
+    stat->write_stalls = stat_add_counter(stat->node, "write_stalls", TRUE);
+    stat->send_stalls = stat_add_counter(stat->node, "send_stalls", TRUE);
+    stat->client_stalls = stat_add_counter(stat->node, "client_stalls", TRUE);
+    stat->early_tokens = stat_add_counter(stat->node, "early_tokens", TRUE);
+    stat->window_size = stat_add_counter(stat->node, "window_size", TRUE);
+    if (stat->window_size) {
+        *stat->window_size = dev->window_size;
+    }
+}
+
+static void spice_char_device_state_stat_unregister(SpiceCharDeviceState *dev)
+{
+    SpiceCharDeviceStat *stat = &dev->stat;
+    uint64_t **counters[] = {&stat->write_bytes, &stat->write_stalls, &stat->send_stalls,
+                             &stat->client_stalls, &stat->early_tokens, &stat->window_size};
+    int i;
+
+    if (stat->node == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < SPICE_N_ELEMENTS(counters); i++) {
+        if (*counters[i]) {
+            stat_remove_counter(*counters[i]);
+            *counters[i] = NULL;
+        }
+    }
+    stat_remove_node(stat->node);
+    stat->node = INVALID_STAT_REF;
+}
+
 void spice_char_device_state_reset_dev_instance(SpiceCharDeviceState *state,
                                                 SpiceCharDeviceInstance *sin)
 {
@@ -697,6 +876,7 @@ static void spice_char_device_state_unref(SpiceCharDeviceState *char_dev)
 void spice_char_device_state_destroy(SpiceCharDeviceState *char_dev)
 {
     reds_on_char_device_state_destroy(char_dev);
+    spice_char_device_state_stat_unregister(char_dev);
     core->timer_remove(char_dev->write_to_dev_timer);
     write_buffers_queue_free(&char_dev->write_queue);
     write_buffers_queue_free(&char_dev->write_bufs_pool);
@@ -972,6 +1152,9 @@ int spice_char_device_state_restore(SpiceCharDeviceState *dev,
                mig_data->write_size);
         dev->cur_write_buf->buf_used = mig_data->write_size;
         dev->cur_write_buf_pos = dev->cur_write_buf->buf;
+        if (dev->cur_write_buf->origin == WRITE_BUFFER_ORIGIN_CLIENT) {
+            client_state->write_queue_bytes += mig_data->write_size;
+        }
     }
     dev->wait_for_migrate_data = FALSE;
     spice_char_device_write_to_device(dev);
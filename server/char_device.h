@@ -116,6 +116,22 @@ SpiceCharDeviceState *spice_char_device_state_create(SpiceCharDeviceInstance *si
                                                      SpiceCharDeviceCallbacks *cbs,
                                                      void *opaque);
 
+/*
+ * Byte-credit flow control for the write direction (client -> device).
+ * Tokens are still the unit that is exchanged with the client. However, a client
+ * message token is returned as soon as the message is queued, as long as the bytes
+ * the client has pending for the device fit in its share of the window
+ * (window_size / number of clients). Otherwise, the token is returned only when the
+ * device consumes the message. The window is tuned between min_window_size and
+ * max_window_size according to the rate in which the device drains the data.
+ */
+void spice_char_device_set_byte_window(SpiceCharDeviceState *dev,
+                                       uint32_t min_window_size,
+                                       uint32_t max_window_size);
+
+/* publish the flow control counters under a root statistics node named 'name' */
+void spice_char_device_state_stat_register(SpiceCharDeviceState *dev, const char *name);
+
 void spice_char_device_state_reset_dev_instance(SpiceCharDeviceState *dev,
                                                 SpiceCharDeviceInstance *sin);
 void spice_char_device_state_destroy(SpiceCharDeviceState *dev);
@@ -25,7 +25,8 @@
 #include <string.h>
 #include <pthread.h>
 #include <fcntl.h>
-#include <poll.h>
+#include <sys/eventfd.h>
+#include <spice/macros.h>
 
 #define SPICE_LOG_DOMAIN "SpiceDispatcher"
 
@@ -39,126 +40,150 @@
 #include <signal.h>
 #endif
 
-#define ACK 0xffffffff
+/* must be a power of 2, and hold at least one message of each type */
+#define DISPATCHER_RING_SIZE (64 * 1024)
+/* number of polls of the ack before the sender goes to sleep on send_fd. Most of the
+ * synchronous messages are handled within a few microseconds, and spinning for them
+ * is cheaper than two context switches */
+#define DISPATCHER_ACK_SPIN 4000
+/* largest reply the receiver can pass back with dispatcher_send_reply */
+#define DISPATCHER_REPLY_MAX 16
 
-/*
- * read_safe
- * helper. reads until size bytes accumulated in buf, if an error other then
- * EINTR is encountered returns -1, otherwise returns 0.
- * @block if 1 the read will block (the fd is always blocking).
- *        if 0 poll first, return immediately if no bytes available, otherwise
- *         read size in blocking mode.
- */
-static int read_safe(int fd, uint8_t *buf, size_t size, int block)
-{
-    int read_size = 0;
-    int ret;
-    struct pollfd pollfd = {.fd = fd, .events = POLLIN, .revents = 0};
+typedef struct DispatcherMessageHeader {
+    uint32_t type;
+    uint32_t serial;
+} DispatcherMessageHeader;
 
-    if (size == 0) {
-        return 0;
-    }
+/* head, tail and acked_serial are only advanced by one side each. waiting flags
+ * and the positions are accessed with a full barrier in between, so that either the
+ * sleeping side sees the update, or the updating side sees the flag and wakes it up.
+ * reply_ready is set by the receiver and cleared by the sender once it copied the
+ * reply out */
+struct DispatcherRing {
+    volatile uint32_t head; /* consumer position, bytes */
+    volatile uint32_t tail; /* producer position, bytes */
+    volatile uint32_t acked_serial;
+    volatile int sender_waiting;
+    volatile int reply_ready;
+    uint8_t reply[DISPATCHER_REPLY_MAX];
+    uint8_t data[DISPATCHER_RING_SIZE];
+};
 
-    if (!block) {
-        while ((ret = poll(&pollfd, 1, 0)) == -1) {
-            if (errno == EINTR) {
-                spice_debug("EINTR in poll");
-                continue;
-            }
-            spice_error("poll failed");
-            return -1;
-        }
-        if (!(pollfd.revents & POLLIN)) {
-            return 0;
-        }
-    }
-    while (read_size < size) {
-        ret = read(fd, buf + read_size, size - read_size);
-        if (ret == -1) {
-            if (errno == EINTR) {
-                spice_debug("EINTR in read");
-                continue;
-            }
-            return -1;
+#define RING_SPACE(ring) (DISPATCHER_RING_SIZE - ((ring)->tail - (ring)->head))
+
+static void eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) == -1) {
+        if (errno == EINTR) {
+            continue;
         }
-        if (ret == 0) {
-            spice_error("broken pipe on read");
-            return -1;
+        if (errno != EAGAIN) { /* EAGAIN: the counter is full, a wakeup is pending anyway */
+            spice_printerr("error signaling dispatcher eventfd: %s", strerror(errno));
         }
-        read_size += ret;
+        break;
     }
-    return read_size;
 }
 
-/*
- * write_safe
- * @return -1 for error, otherwise number of written bytes. may be zero.
- */
-static int write_safe(int fd, uint8_t *buf, size_t size)
+/* returns FALSE if the eventfd was not signaled (only for non blocking fds) */
+static int eventfd_consume(int fd)
 {
-    int written_size = 0;
-    int ret;
-
-    while (written_size < size) {
-        ret = write(fd, buf + written_size, size - written_size);
-        if (ret == -1) {
-            if (errno != EINTR) {
-                spice_debug("EINTR in write");
-                return -1;
-            }
+    uint64_t count;
+
+    while (read(fd, &count, sizeof(count)) == -1) {
+        if (errno == EINTR) {
             continue;
         }
-        written_size += ret;
+        if (errno != EAGAIN) {
+            spice_printerr("error reading dispatcher eventfd: %s", strerror(errno));
+        }
+        return FALSE;
     }
-    return written_size;
+    return TRUE;
+}
+
+static void ring_copy_in(DispatcherRing *ring, uint32_t pos, const void *src, size_t size)
+{
+    uint32_t offset = pos & (DISPATCHER_RING_SIZE - 1);
+    size_t first = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const uint8_t *)src + first, size - first);
+}
+
+static void ring_copy_out(DispatcherRing *ring, uint32_t pos, void *dst, size_t size)
+{
+    uint32_t offset = pos & (DISPATCHER_RING_SIZE - 1);
+    size_t first = MIN(size, DISPATCHER_RING_SIZE - offset);
+
+    memcpy(dst, ring->data + offset, first);
+    memcpy((uint8_t *)dst + first, ring->data, size - first);
+}
+
+/* sleep on send_fd until cond is true. The receiver signals send_fd after it
+ * advances head or acked_serial, if sender_waiting is set */
+#define DISPATCHER_SENDER_WAIT(dispatcher, cond) {          \
+    DispatcherRing *_ring = (dispatcher)->ring;             \
+    while (!(cond)) {                                       \
+        _ring->sender_waiting = TRUE;                       \
+        __sync_synchronize();                               \
+        if (cond) {                                         \
+            break;                                          \
+        }                                                   \
+        eventfd_consume((dispatcher)->send_fd);             \
+    }                                                       \
+    _ring->sender_waiting = FALSE;                          \
 }
 
 static int dispatcher_handle_single_read(Dispatcher *dispatcher)
 {
-    int ret;
-    uint32_t type;
+    DispatcherRing *ring = dispatcher->ring;
+    DispatcherMessageHeader header;
     DispatcherMessage *msg = NULL;
     uint8_t *payload = dispatcher->payload;
-    uint32_t ack = ACK;
+    uint32_t head = ring->head;
 
-    if ((ret = read_safe(dispatcher->recv_fd, (uint8_t*)&type, sizeof(type), 0)) == -1) {
-        spice_printerr("error reading from dispatcher: %d", errno);
-        return 0;
-    }
-    if (ret == 0) {
+    if (head == ring->tail) {
         /* no messsage */
         return 0;
     }
-    msg = &dispatcher->messages[type];
-    if (read_safe(dispatcher->recv_fd, payload, msg->size, 1) == -1) {
-        spice_printerr("error reading from dispatcher: %d", errno);
-        /* TODO: close socketpair? */
-        return 0;
-    }
+    __sync_synchronize(); /* read the message only after seeing the tail */
+    ring_copy_out(ring, head, &header, sizeof(header));
+    msg = &dispatcher->messages[header.type];
+    ring_copy_out(ring, head + sizeof(header), payload, msg->size);
+    /* the payload was copied, release its space before calling the handler, so
+     * that senders of async messages don't wait for it */
+    __sync_synchronize();
+    ring->head = head + sizeof(header) + msg->size;
+
     if (msg->handler) {
         msg->handler(dispatcher->opaque, (void *)payload);
     } else {
-        spice_printerr("error: no handler for message type %d", type);
+        spice_printerr("error: no handler for message type %d", header.type);
     }
     if (msg->ack == DISPATCHER_ACK) {
-        if (write_safe(dispatcher->recv_fd,
-                       (uint8_t*)&ack, sizeof(ack)) == -1) {
-            spice_printerr("error writing ack for message %d", type);
-            /* TODO: close socketpair? */
-        }
+        ring->acked_serial = header.serial;
     } else if (msg->ack == DISPATCHER_ASYNC && dispatcher->handle_async_done) {
-        dispatcher->handle_async_done(dispatcher->opaque, type,
+        dispatcher->handle_async_done(dispatcher->opaque, header.type,
                                       (void *)payload);
     }
+    __sync_synchronize();
+    if (ring->sender_waiting) {
+        eventfd_signal(dispatcher->send_fd);
+    }
     return 1;
 }
 
 /*
  * dispatcher_handle_recv_read
- * doesn't handle being in the middle of a message. all reads are blocking.
+ * handles all the messages in the ring
  */
 void dispatcher_handle_recv_read(Dispatcher *dispatcher)
 {
+    /* consume the wakeup first: a message that is added after the ring was
+     * drained signals recv_fd again */
+    eventfd_consume(dispatcher->recv_fd);
     while (dispatcher_handle_single_read(dispatcher)) {
     }
 }
@@ -167,33 +192,65 @@ void dispatcher_send_message(Dispatcher *dispatcher, uint32_t message_type,
                              void *payload)
 {
     DispatcherMessage *msg;
-    uint32_t ack;
-    int send_fd = dispatcher->send_fd;
+    DispatcherRing *ring = dispatcher->ring;
+    DispatcherMessageHeader header;
+    uint32_t tail;
+    uint32_t size;
+    int i;
 
     assert(dispatcher->max_message_type > message_type);
     assert(dispatcher->messages[message_type].handler);
     msg = &dispatcher->messages[message_type];
+    size = sizeof(header) + msg->size;
     pthread_mutex_lock(&dispatcher->lock);
-    if (write_safe(send_fd, (uint8_t*)&message_type, sizeof(message_type)) == -1) {
-        spice_printerr("error: failed to send message type for message %d",
-                   message_type);
-        goto unlock;
-    }
-    if (write_safe(send_fd, payload, msg->size) == -1) {
-        spice_printerr("error: failed to send message body for message %d",
-                   message_type);
-        goto unlock;
+    DISPATCHER_SENDER_WAIT(dispatcher, RING_SPACE(ring) >= size);
+
+    header.type = message_type;
+    header.serial = ++dispatcher->send_serial;
+    tail = ring->tail;
+    ring_copy_in(ring, tail, &header, sizeof(header));
+    ring_copy_in(ring, tail + sizeof(header), payload, msg->size);
+    __sync_synchronize(); /* publish the message before the tail */
+    ring->tail = tail + size;
+    __sync_synchronize();
+    /* the receiver has drained everything before this message, it may be asleep */
+    if (ring->head == tail) {
+        eventfd_signal(dispatcher->recv_fd);
     }
+
     if (msg->ack == DISPATCHER_ACK) {
-        if (read_safe(send_fd, (uint8_t*)&ack, sizeof(ack), 1) == -1) {
-            spice_printerr("error: failed to read ack");
-        } else if (ack != ACK) {
-            spice_printerr("error: got wrong ack value in dispatcher "
-                       "for message %d\n", message_type);
-            /* TODO handling error? */
+        for (i = 0; i < DISPATCHER_ACK_SPIN && ring->acked_serial != header.serial; i++) {
         }
+        DISPATCHER_SENDER_WAIT(dispatcher, ring->acked_serial == header.serial);
     }
-unlock:
+    pthread_mutex_unlock(&dispatcher->lock);
+}
+
+void dispatcher_send_reply(Dispatcher *dispatcher, const void *data, size_t size)
+{
+    DispatcherRing *ring = dispatcher->ring;
+
+    assert(size <= DISPATCHER_REPLY_MAX);
+    assert(!ring->reply_ready);
+    memcpy(ring->reply, data, size);
+    __sync_synchronize(); /* publish the reply before the flag */
+    ring->reply_ready = TRUE;
+    __sync_synchronize();
+    if (ring->sender_waiting) {
+        eventfd_signal(dispatcher->send_fd);
+    }
+}
+
+void dispatcher_wait_reply(Dispatcher *dispatcher, void *data, size_t size)
+{
+    DispatcherRing *ring = dispatcher->ring;
+
+    assert(size <= DISPATCHER_REPLY_MAX);
+    pthread_mutex_lock(&dispatcher->lock);
+    DISPATCHER_SENDER_WAIT(dispatcher, ring->reply_ready);
+    __sync_synchronize(); /* read the reply only after seeing the flag */
+    memcpy(data, ring->reply, size);
+    ring->reply_ready = FALSE;
     pthread_mutex_unlock(&dispatcher->lock);
 }
 
@@ -213,6 +270,7 @@ void dispatcher_register_handler(Dispatcher *dispatcher, uint32_t message_type,
 
     assert(message_type < dispatcher->max_message_type);
     assert(dispatcher->messages[message_type].handler == 0);
+    assert(sizeof(DispatcherMessageHeader) + size <= DISPATCHER_RING_SIZE);
     msg = &dispatcher->messages[message_type];
     msg->handler = handler;
     msg->size = size;
@@ -250,19 +308,18 @@ static void setup_dummy_signal_handler(void)
 void dispatcher_init(Dispatcher *dispatcher, size_t max_message_type,
                      void *opaque)
 {
-    int channels[2];
-
 #ifdef DEBUG_DISPATCHER
     setup_dummy_signal_handler();
 #endif
     dispatcher->opaque = opaque;
-    if (socketpair(AF_LOCAL, SOCK_STREAM, 0, channels) == -1) {
-        spice_error("socketpair failed %s", strerror(errno));
+    dispatcher->recv_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dispatcher->send_fd = eventfd(0, EFD_CLOEXEC);
+    if (dispatcher->recv_fd == -1 || dispatcher->send_fd == -1) {
+        spice_error("eventfd failed %s", strerror(errno));
         return;
     }
+    dispatcher->ring = spice_new0(DispatcherRing, 1);
     pthread_mutex_init(&dispatcher->lock, NULL);
-    dispatcher->recv_fd = channels[0];
-    dispatcher->send_fd = channels[1];
     dispatcher->self = pthread_self();
 
     dispatcher->messages = spice_malloc0_n(max_message_type,
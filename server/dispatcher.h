@@ -19,10 +19,20 @@ typedef struct DispatcherMessage {
     dispatcher_handle_message handler;
 } DispatcherMessage;
 
+/*
+ * The messages are passed through a single producer, single consumer ring in memory.
+ * Senders are serialized by the dispatcher lock, and there is a single receiver thread.
+ * The eventfds are used only for wakeups: recv_fd when the ring becomes non empty, and
+ * send_fd when a sender waits for an ack, for free space in the ring or for a reply.
+ */
+typedef struct DispatcherRing DispatcherRing;
+
 struct Dispatcher {
     SpiceCoreInterface *recv_core;
-    int recv_fd;
-    int send_fd;
+    int recv_fd; /* eventfd, polled by the receiver */
+    int send_fd; /* eventfd, the sender blocks on it */
+    DispatcherRing *ring;
+    uint32_t send_serial;
     pthread_t self;
     pthread_mutex_t lock;
     DispatcherMessage *messages;
@@ -42,6 +52,26 @@ struct Dispatcher {
 void dispatcher_send_message(Dispatcher *dispatcher, uint32_t message_type,
                              void *payload);
 
+/*
+ * dispatcher_send_reply
+ * @data: reply, at most 16 bytes
+ * @size: reply size
+ *
+ * Called by the receiver, usually from a message handler, to pass a result back to
+ * a sender that waits for it with dispatcher_wait_reply. There is a single reply
+ * slot, so a reply must be consumed before the next one is sent.
+ */
+void dispatcher_send_reply(Dispatcher *dispatcher, const void *data, size_t size);
+
+/*
+ * dispatcher_wait_reply
+ * @data: filled with the reply
+ * @size: reply size
+ *
+ * Blocks the sender until the receiver calls dispatcher_send_reply.
+ */
+void dispatcher_wait_reply(Dispatcher *dispatcher, void *data, size_t size);
+
 /*
  * dispatcher_init
  * @max_message_type: number of message types. Allows upfront allocation
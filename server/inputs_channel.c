@@ -41,6 +41,8 @@
 #include "main_channel.h"
 #include "inputs_channel.h"
 #include "migration_protocol.h"
+#include "red_time.h"
+#include "stat.h"
 
 // TODO: RECEIVE_BUF_SIZE used to be the same for inputs_channel and main_channel
 // since it was defined once in reds.c which contained both.
@@ -74,11 +76,46 @@ typedef struct InputsChannelClient {
     uint16_t motion_count;
 } InputsChannelClient;
 
+/* When coalescing is enabled, the first mouse motion (or position) after an idle period
+ * is delivered immediately. Motions that arrive during the following
+ * INPUTS_COALESCE_INTERVAL are merged, and delivered when it expires. Key and button
+ * events are never delayed: they flush the pending motion and are delivered right away. */
+#define INPUTS_COALESCE_INTERVAL 5 /* ms */
+
+typedef struct InputsPendingMotion {
+    int pending;
+    uint64_t time; /* receive time of the oldest merged event */
+    int32_t dx;
+    int32_t dy;
+    uint32_t buttons_state;
+} InputsPendingMotion;
+
+typedef struct InputsPendingPosition {
+    int pending;
+    uint64_t time;
+    SpiceMsgcMousePosition pos;
+} InputsPendingPosition;
+
 typedef struct InputsChannel {
     RedChannel base;
     uint8_t recv_buf[RECEIVE_BUF_SIZE];
     VDAgentMouseState mouse_state;
     int src_during_migrate;
+
+    int coalesce;
+    SpiceTimer *coalesce_timer;
+    int coalesce_window; /* TRUE while coalesce_timer is running */
+    InputsPendingMotion pending_motion;
+    InputsPendingPosition pending_position;
+
+#ifdef RED_STATISTICS
+    StatNodeRef stat;
+    uint64_t *motion_counter;
+    uint64_t *motion_coalesced_counter;
+    uint64_t *key_counter;
+    uint64_t *button_counter;
+    StatHistogram motion_latency;
+#endif
 } InputsChannel;
 
 enum {
@@ -109,6 +146,7 @@ static SpiceTabletInstance *tablet = NULL;
 static SpiceTimer *key_modifiers_timer;
 
 static InputsChannel *g_inputs_channel = NULL;
+static int inputs_coalesce = FALSE;
 
 #define KEY_MODIFIERS_TTL (1000 * 2) /*2sec*/
 
@@ -319,6 +357,163 @@ static void inputs_channel_send_item(RedChannelClient *rcc, PipeItem *base)
     red_channel_client_begin_send_message(rcc);
 }
 
+static void inputs_channel_motion_latency_add(InputsChannel *inputs_channel, uint64_t time)
+{
+#ifdef RED_STATISTICS
+    stat_inc_counter(inputs_channel->motion_counter, 1);
+    stat_histogram_add(&inputs_channel->motion_latency, (red_now() - time) / 1000);
+#endif
+}
+
+static void inputs_channel_deliver_motion(InputsChannel *inputs_channel,
+                                          InputsPendingMotion *motion)
+{
+    if (mouse && reds_get_mouse_mode() == SPICE_MOUSE_MODE_SERVER) {
+        SpiceMouseInterface *sif;
+        sif = SPICE_CONTAINEROF(mouse->base.sif, SpiceMouseInterface, base);
+        sif->motion(mouse,
+                    motion->dx, motion->dy, 0,
+                    RED_MOUSE_STATE_TO_LOCAL(motion->buttons_state));
+        inputs_channel_motion_latency_add(inputs_channel, motion->time);
+    }
+}
+
+static void inputs_channel_deliver_position(InputsChannel *inputs_channel,
+                                            InputsPendingPosition *position)
+{
+    SpiceMsgcMousePosition *pos = &position->pos;
+
+    if (reds_get_mouse_mode() != SPICE_MOUSE_MODE_CLIENT) {
+        return;
+    }
+    spice_assert((reds_get_agent_mouse() && reds_has_vdagent()) || tablet);
+    if (!reds_get_agent_mouse() || !reds_has_vdagent()) {
+        SpiceTabletInterface *sif;
+        sif = SPICE_CONTAINEROF(tablet->base.sif, SpiceTabletInterface, base);
+        sif->position(tablet, pos->x, pos->y, RED_MOUSE_STATE_TO_LOCAL(pos->buttons_state));
+        inputs_channel_motion_latency_add(inputs_channel, position->time);
+        return;
+    }
+    VDAgentMouseState *mouse_state = &inputs_channel->mouse_state;
+    mouse_state->x = pos->x;
+    mouse_state->y = pos->y;
+    mouse_state->buttons = RED_MOUSE_BUTTON_STATE_TO_AGENT(pos->buttons_state);
+    mouse_state->display_id = pos->display_id;
+    reds_handle_agent_mouse_event(mouse_state);
+    inputs_channel_motion_latency_add(inputs_channel, position->time);
+}
+
+/* delivers the merged motion and position, if any. Returns TRUE if something was
+ * delivered */
+static int inputs_channel_flush_motion(InputsChannel *inputs_channel)
+{
+    int flushed = FALSE;
+
+    if (inputs_channel->pending_motion.pending) {
+        inputs_channel->pending_motion.pending = FALSE;
+        inputs_channel_deliver_motion(inputs_channel, &inputs_channel->pending_motion);
+        flushed = TRUE;
+    }
+    if (inputs_channel->pending_position.pending) {
+        inputs_channel->pending_position.pending = FALSE;
+        inputs_channel_deliver_position(inputs_channel, &inputs_channel->pending_position);
+        flushed = TRUE;
+    }
+    return flushed;
+}
+
+static void inputs_channel_coalesce_timer(void *opaque)
+{
+    InputsChannel *inputs_channel = opaque;
+
+    /* keep the window open as long as motion keeps arriving */
+    if (inputs_channel_flush_motion(inputs_channel)) {
+        core->timer_start(inputs_channel->coalesce_timer, INPUTS_COALESCE_INTERVAL);
+    } else {
+        inputs_channel->coalesce_window = FALSE;
+    }
+}
+
+/* returns TRUE if the event should be merged with the pending ones, instead of being
+ * delivered now */
+static int inputs_channel_coalesce_event(InputsChannel *inputs_channel)
+{
+    if (!inputs_channel->coalesce || !inputs_channel->coalesce_timer) {
+        return FALSE;
+    }
+    if (!inputs_channel->coalesce_window) {
+        inputs_channel->coalesce_window = TRUE;
+        core->timer_start(inputs_channel->coalesce_timer, INPUTS_COALESCE_INTERVAL);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void inputs_channel_push_motion(InputsChannel *inputs_channel,
+                                       SpiceMsgcMouseMotion *mouse_motion)
+{
+    InputsPendingMotion *pending = &inputs_channel->pending_motion;
+
+    if (pending->pending && pending->buttons_state != mouse_motion->buttons_state) {
+        inputs_channel_flush_motion(inputs_channel);
+    }
+    if (!inputs_channel_coalesce_event(inputs_channel)) {
+        InputsPendingMotion motion = {
+            .time = red_now(),
+            .dx = mouse_motion->dx,
+            .dy = mouse_motion->dy,
+            .buttons_state = mouse_motion->buttons_state,
+        };
+
+        inputs_channel_deliver_motion(inputs_channel, &motion);
+        return;
+    }
+    if (pending->pending) {
+        pending->dx += mouse_motion->dx;
+        pending->dy += mouse_motion->dy;
+#ifdef RED_STATISTICS
+        stat_inc_counter(inputs_channel->motion_coalesced_counter, 1);
+#endif
+        return;
+    }
+    pending->pending = TRUE;
+    pending->time = red_now();
+    pending->dx = mouse_motion->dx;
+    pending->dy = mouse_motion->dy;
+    pending->buttons_state = mouse_motion->buttons_state;
+}
+
+static void inputs_channel_push_position(InputsChannel *inputs_channel,
+                                         SpiceMsgcMousePosition *pos)
+{
+    InputsPendingPosition *pending = &inputs_channel->pending_position;
+
+    if (pending->pending && (pending->pos.buttons_state != pos->buttons_state ||
+                             pending->pos.display_id != pos->display_id)) {
+        inputs_channel_flush_motion(inputs_channel);
+    }
+    if (!inputs_channel_coalesce_event(inputs_channel)) {
+        InputsPendingPosition position = {
+            .time = red_now(),
+            .pos = *pos,
+        };
+
+        inputs_channel_deliver_position(inputs_channel, &position);
+        return;
+    }
+    if (pending->pending) {
+        /* positions are absolute, only the last one matters */
+        pending->pos = *pos;
+#ifdef RED_STATISTICS
+        stat_inc_counter(inputs_channel->motion_coalesced_counter, 1);
+#endif
+        return;
+    }
+    pending->pending = TRUE;
+    pending->time = red_now();
+    pending->pos = *pos;
+}
+
 static int inputs_channel_handle_parsed(RedChannelClient *rcc, uint32_t size, uint16_t type,
                                         void *message)
 {
@@ -328,6 +523,25 @@ static int inputs_channel_handle_parsed(RedChannelClient *rcc, uint32_t size, ui
     uint32_t i;
 
     spice_assert(g_inputs_channel == inputs_channel);
+    switch (type) {
+    case SPICE_MSGC_INPUTS_KEY_DOWN:
+    case SPICE_MSGC_INPUTS_KEY_UP:
+    case SPICE_MSGC_INPUTS_KEY_SCANCODE:
+    case SPICE_MSGC_INPUTS_KEY_MODIFIERS:
+#ifdef RED_STATISTICS
+        stat_inc_counter(inputs_channel->key_counter, 1);
+#endif
+        inputs_channel_flush_motion(inputs_channel);
+        break;
+    case SPICE_MSGC_INPUTS_MOUSE_PRESS:
+    case SPICE_MSGC_INPUTS_MOUSE_RELEASE:
+#ifdef RED_STATISTICS
+        stat_inc_counter(inputs_channel->button_counter, 1);
+#endif
+        inputs_channel_flush_motion(inputs_channel);
+        break;
+    }
+
     switch (type) {
     case SPICE_MSGC_INPUTS_KEY_DOWN: {
         SpiceMsgcKeyDown *key_up = (SpiceMsgcKeyDown *)buf;
@@ -362,13 +576,7 @@ static int inputs_channel_handle_parsed(RedChannelClient *rcc, uint32_t size, ui
             red_channel_client_pipe_add_type(rcc, PIPE_ITEM_MOUSE_MOTION_ACK);
             icc->motion_count = 0;
         }
-        if (mouse && reds_get_mouse_mode() == SPICE_MOUSE_MODE_SERVER) {
-            SpiceMouseInterface *sif;
-            sif = SPICE_CONTAINEROF(mouse->base.sif, SpiceMouseInterface, base);
-            sif->motion(mouse,
-                        mouse_motion->dx, mouse_motion->dy, 0,
-                        RED_MOUSE_STATE_TO_LOCAL(mouse_motion->buttons_state));
-        }
+        inputs_channel_push_motion(inputs_channel, mouse_motion);
         break;
     }
     case SPICE_MSGC_INPUTS_MOUSE_POSITION: {
@@ -379,22 +587,7 @@ static int inputs_channel_handle_parsed(RedChannelClient *rcc, uint32_t size, ui
             red_channel_client_pipe_add_type(rcc, PIPE_ITEM_MOUSE_MOTION_ACK);
             icc->motion_count = 0;
         }
-        if (reds_get_mouse_mode() != SPICE_MOUSE_MODE_CLIENT) {
-            break;
-        }
-        spice_assert((reds_get_agent_mouse() && reds_has_vdagent()) || tablet);
-        if (!reds_get_agent_mouse() || !reds_has_vdagent()) {
-            SpiceTabletInterface *sif;
-            sif = SPICE_CONTAINEROF(tablet->base.sif, SpiceTabletInterface, base);
-            sif->position(tablet, pos->x, pos->y, RED_MOUSE_STATE_TO_LOCAL(pos->buttons_state));
-            break;
-        }
-        VDAgentMouseState *mouse_state = &inputs_channel->mouse_state;
-        mouse_state->x = pos->x;
-        mouse_state->y = pos->y;
-        mouse_state->buttons = RED_MOUSE_BUTTON_STATE_TO_AGENT(pos->buttons_state);
-        mouse_state->display_id = pos->display_id;
-        reds_handle_agent_mouse_event(mouse_state);
+        inputs_channel_push_position(inputs_channel, pos);
         break;
     }
     case SPICE_MSGC_INPUTS_MOUSE_PRESS: {
@@ -507,6 +700,12 @@ static void inputs_channel_on_disconnect(RedChannelClient *rcc)
     if (!rcc) {
         return;
     }
+    g_inputs_channel->pending_motion.pending = FALSE;
+    g_inputs_channel->pending_position.pending = FALSE;
+    if (g_inputs_channel->coalesce_window) {
+        core->timer_cancel(g_inputs_channel->coalesce_timer);
+        g_inputs_channel->coalesce_window = FALSE;
+    }
     inputs_release_keys();
 }
 
@@ -586,6 +785,18 @@ static void inputs_push_keyboard_modifiers(uint8_t modifiers)
         inputs_key_modifiers_item_new, (void*)&modifiers);
 }
 
+void inputs_set_coalescing(int enable)
+{
+    inputs_coalesce = enable;
+    if (!g_inputs_channel) {
+        return;
+    }
+    g_inputs_channel->coalesce = enable;
+    if (!enable) {
+        inputs_channel_flush_motion(g_inputs_channel);
+    }
+}
+
 void inputs_on_keyboard_leds_change(void *opaque, uint8_t leds)
 {
     inputs_push_keyboard_modifiers(leds);
@@ -670,4 +881,24 @@ void inputs_init(void)
     if (!(key_modifiers_timer = core->timer_add(key_modifiers_sender, NULL))) {
         spice_error("key modifiers timer create failed");
     }
+
+    g_inputs_channel->coalesce = inputs_coalesce;
+    if (!(g_inputs_channel->coalesce_timer = core->timer_add(inputs_channel_coalesce_timer,
+                                                             g_inputs_channel))) {
+        spice_warning("inputs coalesce timer create failed, coalescing is disabled");
+    }
+#ifdef RED_STATISTICS
+    g_inputs_channel->stat = stat_add_node(INVALID_STAT_REF, "inputs_channel", TRUE);
+    red_channel_set_stat_node(&g_inputs_channel->base, g_inputs_channel->stat);
+    g_inputs_channel->motion_counter = stat_add_counter(g_inputs_channel->stat,
+                                                        "motion_events", TRUE);
+    g_inputs_channel->motion_coalesced_counter = stat_add_counter(g_inputs_channel->stat,
+                                                                  "motion_coalesced", TRUE);
+    g_inputs_channel->key_counter = stat_add_counter(g_inputs_channel->stat,
+                                                     "key_events", TRUE);
+    g_inputs_channel->button_counter = stat_add_counter(g_inputs_channel->stat,
+                                                        "button_events", TRUE);
+    stat_add_histogram(&g_inputs_channel->motion_latency, g_inputs_channel->stat,
+                       "motion_latency");
+#endif
 }
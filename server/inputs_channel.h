@@ -34,5 +34,6 @@ int inputs_set_mouse(SpiceMouseInstance *_mouse);
 int inputs_set_tablet(SpiceTabletInstance *_tablet);
 void inputs_detach_tablet(SpiceTabletInstance *_tablet);
 void inputs_set_tablet_logical_size(int x_res, int y_res);
+void inputs_set_coalescing(int enable);
 
 #endif
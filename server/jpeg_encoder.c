@@ -22,6 +22,12 @@
 #include "jpeg_encoder.h"
 #include <jpeglib.h>
 
+/* Big images are encoded with a restart marker every few MCU rows. The markers cost
+ * a couple of bytes each, and they let the client decode the rows between them in
+ * parallel. */
+#define JPEG_RESTART_MIN_AREA (256 * 256)
+#define JPEG_RESTART_ROWS 4
+
 typedef struct JpegEncoder {
     JpegEncoderUsrContext *usr;
 
@@ -35,6 +41,7 @@ typedef struct JpegEncoder {
         int height;
         int stride;
         unsigned int out_size;
+        /* NULL if the lines are passed to libjpeg as they are */
         void (*convert_line_to_RGB24) (uint8_t *line, int width, uint8_t **out_line);
     } cur_image;
 } JpegEncoder;
@@ -122,6 +129,7 @@ static void convert_RGB16_to_RGB24(uint8_t *line, int width, uint8_t **out_line)
    }
 }
 
+#ifndef JCS_EXTENSIONS
 static void convert_BGR24_to_RGB24(uint8_t *line, int width, uint8_t **out_line)
 {
     int x;
@@ -156,11 +164,7 @@ static void convert_BGRX32_to_RGB24(uint8_t *line, int width, uint8_t **out_line
         *out_pix++ = pixel & 0xff;
     }
 }
-
-static void convert_RGB24_to_RGB24(uint8_t *line, int width, uint8_t **out_line)
-{
-    *out_line = line;
-}
+#endif
 
 
 #define FILL_LINES() {                                                  \
@@ -182,7 +186,7 @@ static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_l
     width = jpeg->cur_image.width;
     stride = jpeg->cur_image.stride;
 
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
+    if (jpeg->cur_image.convert_line_to_RGB24) {
         RGB24_line = (uint8_t *)spice_malloc(width*3);
     }
 
@@ -190,12 +194,16 @@ static void do_jpeg_encode(JpegEncoder *jpeg, uint8_t *lines, unsigned int num_l
 
     for (;jpeg->cinfo.next_scanline < jpeg->cinfo.image_height; lines += stride) {
         FILL_LINES();
-        jpeg->cur_image.convert_line_to_RGB24(lines, width, &RGB24_line);
-        row_pointer[0] = RGB24_line;
+        if (jpeg->cur_image.convert_line_to_RGB24) {
+            jpeg->cur_image.convert_line_to_RGB24(lines, width, &RGB24_line);
+            row_pointer[0] = RGB24_line;
+        } else {
+            row_pointer[0] = lines;
+        }
         jpeg_write_scanlines(&jpeg->cinfo, row_pointer, 1);
     }
 
-    if (jpeg->cur_image.type != JPEG_IMAGE_TYPE_RGB24) {
+    if (jpeg->cur_image.convert_line_to_RGB24) {
         free(RGB24_line);
     }
 }
@@ -211,19 +219,31 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
     enc->cur_image.height = height;
     enc->cur_image.stride = stride;
     enc->cur_image.out_size = 0;
+    enc->cur_image.convert_line_to_RGB24 = NULL;
+    enc->cinfo.input_components = 3;
+    enc->cinfo.in_color_space = JCS_RGB;
 
+    /* libjpeg-turbo reads bgr and bgrx lines as they are */
     switch (type) {
     case JPEG_IMAGE_TYPE_RGB16:
         enc->cur_image.convert_line_to_RGB24 = convert_RGB16_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_RGB24:
-        enc->cur_image.convert_line_to_RGB24 = convert_RGB24_to_RGB24;
         break;
     case JPEG_IMAGE_TYPE_BGR24:
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.in_color_space = JCS_EXT_BGR;
+#else
         enc->cur_image.convert_line_to_RGB24 = convert_BGR24_to_RGB24;
+#endif
         break;
     case JPEG_IMAGE_TYPE_BGRX32:
+#ifdef JCS_EXTENSIONS
+        enc->cinfo.in_color_space = JCS_EXT_BGRX;
+        enc->cinfo.input_components = 4;
+#else
         enc->cur_image.convert_line_to_RGB24 = convert_BGRX32_to_RGB24;
+#endif
         break;
     default:
         spice_error("bad image type");
@@ -231,10 +251,11 @@ int jpeg_encode(JpegEncoderContext *jpeg, int quality, JpegEncoderImageType type
 
     enc->cinfo.image_width = width;
     enc->cinfo.image_height = height;
-    enc->cinfo.input_components = 3;
-    enc->cinfo.in_color_space = JCS_RGB;
     jpeg_set_defaults(&enc->cinfo);
     jpeg_set_quality(&enc->cinfo, quality, TRUE);
+    if (width * height >= JPEG_RESTART_MIN_AREA) {
+        enc->cinfo.restart_in_rows = JPEG_RESTART_ROWS;
+    }
 
     enc->dest_mgr.next_output_byte = io_ptr;
     enc->dest_mgr.free_in_buffer = num_io_bytes;
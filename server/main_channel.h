@@ -28,6 +28,10 @@
 // other options: is to make a reds_main_consts.h, to duplicate defines.
 #define REDS_AGENT_WINDOW_SIZE 10
 #define REDS_NUM_INTERNAL_AGENT_MESSAGES 1
+/* byte window of client data that is pending for the agent, see
+ * spice_char_device_set_byte_window */
+#define REDS_AGENT_MIN_BYTE_WINDOW (2 * SPICE_AGENT_MAX_DATA_SIZE)
+#define REDS_AGENT_MAX_BYTE_WINDOW (REDS_AGENT_WINDOW_SIZE * SPICE_AGENT_MAX_DATA_SIZE)
 
 // approximate max receive message size for main channel
 #define MAIN_CHANNEL_RECEIVE_BUF_SIZE \
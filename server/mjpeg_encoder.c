@@ -68,6 +68,22 @@ static const int mjpeg_quality_samples[MJPEG_QUALITY_SAMPLE_NUM] = {20, 30, 40,
  */
 #define MJPEG_WARMUP_TIME 3000L // 3 sec
 
+/*
+ * Big frames are encoded in parallel, in horizontal slices: each slice is encoded as a
+ * separate jpeg, and the slices are stitched to a single jpeg, with a restart marker
+ * between every two slices.
+ */
+#define MJPEG_SLICES_MIN_AREA (640 * 360)
+#define MJPEG_SLICE_MIN_HEIGHT 64
+#define MJPEG_MAX_SLICES (RED_RENDER_MAX_THREADS + 1)
+
+#define JPEG_MARKER_SOF0 0xc0
+#define JPEG_MARKER_RST0 0xd0
+#define JPEG_MARKER_SOI 0xd8
+#define JPEG_MARKER_EOI 0xd9
+#define JPEG_MARKER_SOS 0xda
+#define JPEG_MARKER_DRI 0xdd
+
 enum {
     MJPEG_QUALITY_EVAL_TYPE_SET,
     MJPEG_QUALITY_EVAL_TYPE_UPGRADE,
@@ -152,16 +168,44 @@ typedef struct MJpegEncoderRateControl {
     uint64_t warmup_start_time;
 } MJpegEncoderRateControl;
 
+typedef struct MJpegEncoderSlice {
+    RedRenderJob job;
+    MJpegEncoder *encoder;
+
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint8_t *row;
+    uint32_t row_size;
+
+    unsigned int first_line;
+    unsigned int num_lines;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t enc_size;
+} MJpegEncoderSlice;
+
 struct MJpegEncoder {
     uint8_t *row;
     uint32_t row_size;
     int first_frame;
 
+    RedRenderPool *render_pool;
+    MJpegEncoderSlice *slices[MJPEG_MAX_SLICES];
+    /* of the current frame, 0 if it isn't encoded in slices */
+    int num_slices;
+    uint8_t **lines;
+    unsigned int lines_size;
+    unsigned int num_lines;
+    uint8_t **dest;
+    size_t *dest_len;
+    uint64_t frame_start_time;
+    uint64_t avg_encode_time; // nano
+
     struct jpeg_compress_struct cinfo;
     struct jpeg_error_mgr jerr;
 
     unsigned int bytes_per_pixel; /* bytes per pixel of the input buffer */
-    void (*pixel_converter)(uint8_t *src, uint8_t *dest);
+    void (*line_converter)(uint8_t *src, uint8_t *dest, unsigned int width);
 
     int rate_control_is_active;
     MJpegEncoderRateControl rate_control;
@@ -219,43 +263,82 @@ MJpegEncoder *mjpeg_encoder_new(int bit_rate_control, uint64_t starting_bit_rate
     return enc;
 }
 
+static void mjpeg_encoder_slice_destroy(MJpegEncoderSlice *slice)
+{
+    jpeg_destroy_compress(&slice->cinfo);
+    free(slice->cinfo.dest);
+    free(slice->row);
+    free(slice->buf);
+    free(slice);
+}
+
 void mjpeg_encoder_destroy(MJpegEncoder *encoder)
 {
+    int i;
+
+    for (i = 0; i < MJPEG_MAX_SLICES; i++) {
+        if (encoder->slices[i]) {
+            mjpeg_encoder_slice_destroy(encoder->slices[i]);
+        }
+    }
+    free(encoder->lines);
     jpeg_destroy_compress(&encoder->cinfo);
     free(encoder->row);
     free(encoder);
 }
 
+void mjpeg_encoder_set_render_pool(MJpegEncoder *encoder, RedRenderPool *render_pool)
+{
+    encoder->render_pool = render_pool;
+}
+
 uint8_t mjpeg_encoder_get_bytes_per_pixel(MJpegEncoder *encoder)
 {
     return encoder->bytes_per_pixel;
 }
 
+/* Line conversion routines. Converting a whole line in a plain loop, instead of calling a
+ * function for each pixel, lets the compiler vectorize the conversion. */
 #ifndef JCS_EXTENSIONS
-/* Pixel conversion routines */
-static void pixel_rgb24bpp_to_24(uint8_t *src, uint8_t *dest)
+static void line_rgb24bpp_to_24(uint8_t *src, uint8_t *dest, unsigned int width)
 {
+    unsigned int x;
+
     /* libjpegs stores rgb, spice/win32 stores bgr */
-    *dest++ = src[2]; /* red */
-    *dest++ = src[1]; /* green */
-    *dest++ = src[0]; /* blue */
+    for (x = 0; x < width; x++, src += 3, dest += 3) {
+        dest[0] = src[2]; /* red */
+        dest[1] = src[1]; /* green */
+        dest[2] = src[0]; /* blue */
+    }
 }
 
-static void pixel_rgb32bpp_to_24(uint8_t *src, uint8_t *dest)
+static void line_rgb32bpp_to_24(uint8_t *src, uint8_t *dest, unsigned int width)
 {
-    uint32_t pixel = *(uint32_t *)src;
-    *dest++ = (pixel >> 16) & 0xff;
-    *dest++ = (pixel >>  8) & 0xff;
-    *dest++ = (pixel >>  0) & 0xff;
+    uint32_t *pixels = (uint32_t *)src;
+    unsigned int x;
+
+    for (x = 0; x < width; x++, dest += 3) {
+        uint32_t pixel = pixels[x];
+
+        dest[0] = (pixel >> 16) & 0xff;
+        dest[1] = (pixel >>  8) & 0xff;
+        dest[2] = (pixel >>  0) & 0xff;
+    }
 }
 #endif
 
-static void pixel_rgb16bpp_to_24(uint8_t *src, uint8_t *dest)
+static void line_rgb16bpp_to_24(uint8_t *src, uint8_t *dest, unsigned int width)
 {
-    uint16_t pixel = *(uint16_t *)src;
-    *dest++ = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
-    *dest++ = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
-    *dest++ = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+    uint16_t *pixels = (uint16_t *)src;
+    unsigned int x;
+
+    for (x = 0; x < width; x++, dest += 3) {
+        uint16_t pixel = pixels[x];
+
+        dest[0] = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        dest[1] = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        dest[2] = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+    }
 }
 
 
@@ -378,6 +461,20 @@ static uint32_t get_max_fps(uint64_t frame_size, uint64_t bytes_per_sec)
     return fps;
 }
 
+/*
+ * The frame rate is limited by the bit rate, and, when the frames are encoded in slices,
+ * also by the time it takes to encode a frame.
+ */
+static uint32_t mjpeg_encoder_get_max_fps(MJpegEncoder *encoder, uint64_t frame_size)
+{
+    uint32_t fps = get_max_fps(frame_size, encoder->rate_control.byte_rate);
+
+    if (encoder->avg_encode_time) {
+        fps = MIN(fps, (1000 * 1000 * 1000) / encoder->avg_encode_time);
+    }
+    return fps;
+}
+
 static inline void mjpeg_encoder_reset_quality(MJpegEncoder *encoder,
                                                int quality_id,
                                                uint32_t fps,
@@ -460,7 +557,7 @@ static inline void mjpeg_encoder_eval_quality(MJpegEncoder *encoder)
 
     src_fps = encoder->cbs.get_source_fps(encoder->cbs_opaque);
 
-    fps = get_max_fps(enc_size, rate_control->byte_rate);
+    fps = mjpeg_encoder_get_max_fps(encoder, enc_size);
     spice_debug("mjpeg %p: jpeg %d: %.2f (KB) fps %d src-fps %u",
                 encoder,
                 mjpeg_quality_samples[rate_control->quality_id],
@@ -544,8 +641,7 @@ complete_sample:
         final_quality_id = rate_control->quality_id;
     }
     final_quality_enc_size = quality_eval->encoded_size_by_quality[final_quality_id];
-    final_fps = get_max_fps(final_quality_enc_size,
-                            rate_control->byte_rate);
+    final_fps = mjpeg_encoder_get_max_fps(encoder, final_quality_enc_size);
 
     if (final_quality_id == quality_eval->min_quality_id) {
         final_fps = MAX(final_fps, quality_eval->min_quality_fps);
@@ -634,7 +730,7 @@ static void mjpeg_encoder_adjust_params_to_bit_rate(MJpegEncoder *encoder)
     latency = mjpeg_encoder_get_latency(encoder);
     new_avg_enc_size = rate_control->sum_recent_enc_size /
                        rate_control->num_recent_enc_frames;
-    new_fps = get_max_fps(new_avg_enc_size, rate_control->byte_rate);
+    new_fps = mjpeg_encoder_get_max_fps(encoder, new_avg_enc_size);
 
     spice_debug("cur-fps=%u new-fps=%u (new/old=%.2f) |"
                 "bit-rate=%.2f (Mbps) latency=%u (ms) quality=%d |"
@@ -726,6 +822,224 @@ static void mjpeg_encoder_adjust_fps(MJpegEncoder *encoder, uint64_t now)
     }
 }
 
+static inline uint64_t mjpeg_encoder_get_time(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+/* the number of slices to encode a frame in, 0 for encoding it serially */
+static int mjpeg_encoder_get_num_slices(MJpegEncoder *encoder, int width, int height)
+{
+    int num_slices;
+
+    if (!encoder->render_pool || width * height < MJPEG_SLICES_MIN_AREA) {
+        return 0;
+    }
+    num_slices = MIN(red_render_pool_get_num_threads(encoder->render_pool) + 1,
+                     height / MJPEG_SLICE_MIN_HEIGHT);
+    return num_slices > 1 ? num_slices : 0;
+}
+
+static void mjpeg_encoder_slice_encode(RedRenderJob *job, int thread_index)
+{
+    MJpegEncoderSlice *slice = SPICE_CONTAINEROF(job, MJpegEncoderSlice, job);
+    MJpegEncoder *encoder = slice->encoder;
+    mem_destination_mgr *dest;
+    unsigned int i;
+
+    jpeg_start_compress(&slice->cinfo, TRUE);
+    for (i = 0; i < slice->num_lines; i++) {
+        uint8_t *line = encoder->lines[slice->first_line + i];
+
+        if (encoder->line_converter) {
+            encoder->line_converter(line, slice->row, slice->cinfo.image_width);
+            line = slice->row;
+        }
+        jpeg_write_scanlines(&slice->cinfo, &line, 1);
+    }
+    jpeg_finish_compress(&slice->cinfo);
+    dest = (mem_destination_mgr *)slice->cinfo.dest;
+    slice->enc_size = dest->pub.next_output_byte - dest->buffer;
+}
+
+/* prepares the slices for encoding a frame with the settings of encoder->cinfo.
+ * Returns FALSE if the frame can't be encoded in slices: the restart interval, i.e.,
+ * the number of MCUs in a slice, is 16 bit, and wide frames may need more slices
+ * than MJPEG_MAX_SLICES. */
+static int mjpeg_encoder_start_slices(MJpegEncoder *encoder, int width, int height,
+                                      int quality)
+{
+    int mcu_width = 0;
+    int mcu_height = 0;
+    int mcus_per_row;
+    int slice_height, max_slice_height;
+    int i;
+
+    /* the slices, except for the last, must consist of whole MCU rows */
+    for (i = 0; i < encoder->cinfo.num_components; i++) {
+        mcu_width = MAX(mcu_width, encoder->cinfo.comp_info[i].h_samp_factor * DCTSIZE);
+        mcu_height = MAX(mcu_height, encoder->cinfo.comp_info[i].v_samp_factor * DCTSIZE);
+    }
+    mcus_per_row = (width + mcu_width - 1) / mcu_width;
+    max_slice_height = 0xffff / mcus_per_row * mcu_height;
+    slice_height = (height + encoder->num_slices - 1) / encoder->num_slices;
+    slice_height = (slice_height + mcu_height - 1) / mcu_height * mcu_height;
+    /* the slices are jobs of the render pool, there can be more of them than threads */
+    slice_height = MIN(slice_height, max_slice_height);
+    if (!slice_height || (height + slice_height - 1) / slice_height > MJPEG_MAX_SLICES) {
+        return FALSE;
+    }
+    encoder->num_slices = (height + slice_height - 1) / slice_height;
+
+    for (i = 0; i < encoder->num_slices; i++) {
+        MJpegEncoderSlice *slice = encoder->slices[i];
+
+        if (!slice) {
+            slice = encoder->slices[i] = spice_new0(MJpegEncoderSlice, 1);
+            slice->encoder = encoder;
+            slice->cinfo.err = jpeg_std_error(&slice->jerr);
+            jpeg_create_compress(&slice->cinfo);
+        }
+        red_render_job_init(&slice->job, mjpeg_encoder_slice_encode);
+        if (encoder->line_converter && slice->row_size < (uint32_t)width * 3) {
+            slice->row = spice_realloc(slice->row, width * 3);
+            slice->row_size = width * 3;
+        }
+        spice_jpeg_mem_dest(&slice->cinfo, &slice->buf, &slice->buf_size);
+
+        slice->first_line = i * slice_height;
+        slice->num_lines = MIN(slice_height, height - slice->first_line);
+        slice->cinfo.in_color_space = encoder->cinfo.in_color_space;
+        slice->cinfo.input_components = encoder->cinfo.input_components;
+        slice->cinfo.image_width = width;
+        slice->cinfo.image_height = slice->num_lines;
+        jpeg_set_defaults(&slice->cinfo);
+        slice->cinfo.dct_method = JDCT_IFAST;
+        jpeg_set_quality(&slice->cinfo, quality, TRUE);
+    }
+
+    if (encoder->lines_size < (unsigned int)height) {
+        encoder->lines = spice_realloc(encoder->lines, height * sizeof(uint8_t *));
+        encoder->lines_size = height;
+    }
+    encoder->num_lines = 0;
+    return TRUE;
+}
+
+/* returns the offset of the entropy coded data of the jpeg, and the offset of the
+ * SOS marker in sos_offset. If sof_offset isn't NULL, it returns the offset of the
+ * SOF0 marker in it. */
+static size_t jpeg_find_scan_data(uint8_t *jpeg, size_t size, size_t *sos_offset,
+                                  size_t *sof_offset)
+{
+    size_t offset = 2; /* SOI */
+
+    spice_assert(size > 4 && jpeg[0] == 0xff && jpeg[1] == JPEG_MARKER_SOI);
+    while (offset + 4 <= size) {
+        uint8_t marker = jpeg[offset + 1];
+        size_t len = (jpeg[offset + 2] << 8) | jpeg[offset + 3];
+
+        spice_assert(jpeg[offset] == 0xff);
+        if (marker == JPEG_MARKER_SOF0 && sof_offset) {
+            *sof_offset = offset;
+        }
+        if (marker == JPEG_MARKER_SOS) {
+            *sos_offset = offset;
+            return offset + 2 + len;
+        }
+        offset += 2 + len;
+    }
+    spice_error("no scan in jpeg");
+    return 0;
+}
+
+/* stitches the slices to a single jpeg in *encoder->dest, and returns its size */
+static size_t mjpeg_encoder_stitch_slices(MJpegEncoder *encoder)
+{
+    MJpegEncoderSlice *first = encoder->slices[0];
+    size_t sos_offset, sof_offset = 0;
+    size_t data_offset;
+    size_t size;
+    uint32_t restart_interval;
+    uint8_t *out;
+    int i;
+
+    data_offset = jpeg_find_scan_data(first->buf, first->enc_size, &sos_offset, &sof_offset);
+    spice_assert(sof_offset);
+
+    /* headers + DRI + the scans + RSTn between them + EOI */
+    size = sos_offset + 6 + (data_offset - sos_offset);
+    for (i = 0; i < encoder->num_slices; i++) {
+        MJpegEncoderSlice *slice = encoder->slices[i];
+        size_t slice_sos_offset;
+
+        size += slice->enc_size - 2 -
+                jpeg_find_scan_data(slice->buf, slice->enc_size, &slice_sos_offset, NULL);
+    }
+    size += 2 * (encoder->num_slices - 1) + 2;
+    if (*encoder->dest_len < size) {
+        free(*encoder->dest);
+        *encoder->dest = spice_malloc(size);
+        *encoder->dest_len = size;
+    }
+    out = *encoder->dest;
+
+    memcpy(out, first->buf, sos_offset);
+    /* the height in the SOF0 of the first slice is the height of the frame */
+    out[sof_offset + 5] = encoder->num_lines >> 8;
+    out[sof_offset + 6] = encoder->num_lines & 0xff;
+    out += sos_offset;
+
+    /* fits in 16 bits, see mjpeg_encoder_start_slices */
+    restart_interval = first->cinfo.MCUs_per_row * first->cinfo.total_iMCU_rows;
+    *out++ = 0xff;
+    *out++ = JPEG_MARKER_DRI;
+    *out++ = 0;
+    *out++ = 4;
+    *out++ = restart_interval >> 8;
+    *out++ = restart_interval & 0xff;
+
+    memcpy(out, first->buf + sos_offset, data_offset - sos_offset);
+    out += data_offset - sos_offset;
+
+    for (i = 0; i < encoder->num_slices; i++) {
+        MJpegEncoderSlice *slice = encoder->slices[i];
+        size_t slice_sos_offset;
+        size_t slice_data_offset;
+
+        if (i > 0) {
+            *out++ = 0xff;
+            *out++ = JPEG_MARKER_RST0 + (i - 1) % 8;
+        }
+        slice_data_offset = jpeg_find_scan_data(slice->buf, slice->enc_size,
+                                                &slice_sos_offset, NULL);
+        /* without the EOI */
+        memcpy(out, slice->buf + slice_data_offset, slice->enc_size - 2 - slice_data_offset);
+        out += slice->enc_size - 2 - slice_data_offset;
+    }
+    *out++ = 0xff;
+    *out++ = JPEG_MARKER_EOI;
+
+    spice_assert((size_t)(out - *encoder->dest) == size);
+    return size;
+}
+
+static size_t mjpeg_encoder_encode_slices(MJpegEncoder *encoder)
+{
+    int i;
+
+    spice_assert(encoder->num_lines == encoder->slices[encoder->num_slices - 1]->first_line +
+                                       encoder->slices[encoder->num_slices - 1]->num_lines);
+    for (i = 0; i < encoder->num_slices; i++) {
+        red_render_pool_add(encoder->render_pool, &encoder->slices[i]->job);
+    }
+    red_render_pool_wait(encoder->render_pool);
+    return mjpeg_encoder_stitch_slices(encoder);
+}
+
 int mjpeg_encoder_start_frame(MJpegEncoder *encoder, SpiceBitmapFmt format,
                               int width, int height,
                               uint8_t **dest, size_t *dest_len,
@@ -770,7 +1084,7 @@ int mjpeg_encoder_start_frame(MJpegEncoder *encoder, SpiceBitmapFmt format,
 
     encoder->cinfo.in_color_space   = JCS_RGB;
     encoder->cinfo.input_components = 3;
-    encoder->pixel_converter = NULL;
+    encoder->line_converter = NULL;
 
     switch (format) {
     case SPICE_BITMAP_FMT_32BIT:
@@ -780,19 +1094,19 @@ int mjpeg_encoder_start_frame(MJpegEncoder *encoder, SpiceBitmapFmt format,
         encoder->cinfo.in_color_space   = JCS_EXT_BGRX;
         encoder->cinfo.input_components = 4;
 #else
-        encoder->pixel_converter = pixel_rgb32bpp_to_24;
+        encoder->line_converter = line_rgb32bpp_to_24;
 #endif
         break;
     case SPICE_BITMAP_FMT_16BIT:
         encoder->bytes_per_pixel = 2;
-        encoder->pixel_converter = pixel_rgb16bpp_to_24;
+        encoder->line_converter = line_rgb16bpp_to_24;
         break;
     case SPICE_BITMAP_FMT_24BIT:
         encoder->bytes_per_pixel = 3;
 #ifdef JCS_EXTENSIONS
         encoder->cinfo.in_color_space = JCS_EXT_BGR;
 #else
-        encoder->pixel_converter = pixel_rgb24bpp_to_24;
+        encoder->line_converter = line_rgb24bpp_to_24;
 #endif
         break;
     default:
@@ -800,7 +1114,7 @@ int mjpeg_encoder_start_frame(MJpegEncoder *encoder, SpiceBitmapFmt format,
         return MJPEG_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    if (encoder->pixel_converter != NULL) {
+    if (encoder->line_converter != NULL) {
         unsigned int stride = width * 3;
         /* check for integer overflow */
         if (stride < width) {
@@ -812,15 +1126,25 @@ int mjpeg_encoder_start_frame(MJpegEncoder *encoder, SpiceBitmapFmt format,
         }
     }
 
-    spice_jpeg_mem_dest(&encoder->cinfo, dest, dest_len);
-
+    encoder->frame_start_time = mjpeg_encoder_get_time();
     encoder->cinfo.image_width      = width;
     encoder->cinfo.image_height     = height;
     jpeg_set_defaults(&encoder->cinfo);
     encoder->cinfo.dct_method       = JDCT_IFAST;
     quality = mjpeg_quality_samples[encoder->rate_control.quality_id];
     jpeg_set_quality(&encoder->cinfo, quality, TRUE);
-    jpeg_start_compress(&encoder->cinfo, encoder->first_frame);
+
+    encoder->num_slices = mjpeg_encoder_get_num_slices(encoder, width, height);
+    if (encoder->num_slices && !mjpeg_encoder_start_slices(encoder, width, height, quality)) {
+        encoder->num_slices = 0;
+    }
+    if (encoder->num_slices) {
+        encoder->dest = dest;
+        encoder->dest_len = dest_len;
+    } else {
+        spice_jpeg_mem_dest(&encoder->cinfo, dest, dest_len);
+        jpeg_start_compress(&encoder->cinfo, encoder->first_frame);
+    }
 
     encoder->num_frames++;
     encoder->avg_quality += quality;
@@ -831,16 +1155,14 @@ int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder, uint8_t *src_pixels,
                                   size_t image_width)
 {
     unsigned int scanlines_written;
-    uint8_t *row;
 
-    row = encoder->row;
-    if (encoder->pixel_converter) {
-        unsigned int x;
-        for (x = 0; x < image_width; x++) {
-            encoder->pixel_converter(src_pixels, row);
-            row += 3;
-            src_pixels += encoder->bytes_per_pixel;
-        }
+    if (encoder->num_slices) {
+        /* the slices are encoded when all the lines are available */
+        encoder->lines[encoder->num_lines++] = src_pixels;
+        return 1;
+    }
+    if (encoder->line_converter) {
+        encoder->line_converter(src_pixels, encoder->row, image_width);
         scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
     } else {
         scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &src_pixels, 1);
@@ -856,15 +1178,31 @@ int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder, uint8_t *src_pixels,
 
 size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder)
 {
-    mem_destination_mgr *dest = (mem_destination_mgr *) encoder->cinfo.dest;
     MJpegEncoderRateControl *rate_control = &encoder->rate_control;
+    uint64_t encode_time;
 
-    jpeg_finish_compress(&encoder->cinfo);
+    if (encoder->num_slices) {
+        rate_control->last_enc_size = mjpeg_encoder_encode_slices(encoder);
+    } else {
+        mem_destination_mgr *dest = (mem_destination_mgr *) encoder->cinfo.dest;
 
-    encoder->first_frame = FALSE;
-    rate_control->last_enc_size = dest->pub.next_output_byte - dest->buffer;
+        jpeg_finish_compress(&encoder->cinfo);
+        encoder->first_frame = FALSE;
+        rate_control->last_enc_size = dest->pub.next_output_byte - dest->buffer;
+    }
     rate_control->server_state.num_frames_encoded++;
 
+    /* a serial frame is encoded while the caller copies its lines, so its time isn't
+     * only the encoding time */
+    if (encoder->num_slices) {
+        encode_time = mjpeg_encoder_get_time() - encoder->frame_start_time;
+        encoder->avg_encode_time = encoder->avg_encode_time ?
+                                   (encoder->avg_encode_time * 3 + encode_time) / 4 :
+                                   encode_time;
+    } else {
+        encoder->avg_encode_time = 0;
+    }
+
     if (!rate_control->during_quality_eval ||
         rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_SIZE_CHANGE) {
 
@@ -1262,6 +1600,11 @@ uint64_t mjpeg_encoder_get_bit_rate(MJpegEncoder *encoder)
     return encoder->rate_control.byte_rate * 8;
 }
 
+int mjpeg_encoder_is_evaluating_quality(MJpegEncoder *encoder)
+{
+    return encoder->rate_control_is_active && encoder->rate_control.during_quality_eval;
+}
+
 void mjpeg_encoder_get_stats(MJpegEncoder *encoder, MJpegEncoderStats *stats)
 {
     spice_assert(encoder != NULL && stats != NULL);
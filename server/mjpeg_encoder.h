@@ -20,6 +20,7 @@
 #define _H_MJPEG_ENCODER
 
 #include "red_common.h"
+#include "red_render_pool.h"
 
 enum {
     MJPEG_ENCODER_FRAME_UNSUPPORTED = -1,
@@ -55,6 +56,12 @@ void mjpeg_encoder_destroy(MJpegEncoder *encoder);
 
 uint8_t mjpeg_encoder_get_bytes_per_pixel(MJpegEncoder *encoder);
 
+/*
+ * When a render pool is set, big frames are divided to slices that are encoded
+ * in parallel by the pool threads. The pool can be NULL.
+ */
+void mjpeg_encoder_set_render_pool(MJpegEncoder *encoder, RedRenderPool *render_pool);
+
 /*
  * dest must be either NULL or allocated by malloc, since it might be freed
  * during the encoding, if its size is too small.
@@ -70,6 +77,10 @@ int mjpeg_encoder_start_frame(MJpegEncoder *encoder, SpiceBitmapFmt format,
                               int width, int height,
                               uint8_t **dest, size_t *dest_len,
                               uint32_t frame_mm_time);
+/*
+ * src_pixels must stay valid till mjpeg_encoder_end_frame returns, since frames
+ * that are encoded in slices are encoded only when all their lines are available.
+ */
 int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder, uint8_t *src_pixels,
                                   size_t image_width);
 size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder);
@@ -109,6 +120,11 @@ void mjpeg_encoder_client_stream_report(MJpegEncoder *encoder,
 void mjpeg_encoder_notify_server_frame_drop(MJpegEncoder *encoder);
 
 uint64_t mjpeg_encoder_get_bit_rate(MJpegEncoder *encoder);
+/*
+ * Returns TRUE while the encoder compares the sizes of frames that are encoded with
+ * different qualities. The frames should cover the whole stream area during that time.
+ */
+int mjpeg_encoder_is_evaluating_quality(MJpegEncoder *encoder);
 void mjpeg_encoder_get_stats(MJpegEncoder *encoder, MJpegEncoderStats *stats);
 
 #endif
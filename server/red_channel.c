@@ -38,6 +38,7 @@
 #include "common/ring.h"
 
 #include "stat.h"
+#include "red_trace.h"
 #include "red_channel.h"
 #include "reds.h"
 #include "main_dispatcher.h"
@@ -397,6 +398,10 @@ static void red_channel_client_on_output(void *opaque, int n)
         rcc->connectivity_monitor.out_bytes += n;
     }
     stat_inc_counter(rcc->channel->out_bytes_counter, n);
+#ifdef RED_STATISTICS
+    stat_inc_counter(rcc->out_bytes_counter, n);
+#endif
+    red_trace_socket_write(rcc, n);
 }
 
 static void red_channel_client_on_input(void *opaque, int n)
@@ -406,6 +411,96 @@ static void red_channel_client_on_input(void *opaque, int n)
     if (rcc->connectivity_monitor.timer) {
         rcc->connectivity_monitor.in_bytes += n;
     }
+#ifdef RED_STATISTICS
+    stat_inc_counter(rcc->channel->in_bytes_counter, n);
+#endif
+}
+
+#ifdef RED_STATISTICS
+static void red_channel_client_stat_init(RedChannelClient *rcc)
+{
+    RedChannel *channel = rcc->channel;
+    char name[16];
+
+    rcc->stat = INVALID_STAT_REF;
+    if (channel->stat == INVALID_STAT_REF) {
+        return;
+    }
+    snprintf(name, sizeof(name), "client_%u", channel->stat_clients_count++);
+    rcc->stat = stat_add_node(channel->stat, name, TRUE);
+    if (rcc->stat == INVALID_STAT_REF) {
+        return;
+    }
+    rcc->pipe_size_counter = stat_add_counter(rcc->stat, "pipe_size", TRUE);
+    rcc->max_pipe_size_counter = stat_add_counter(rcc->stat, "max_pipe_size", TRUE);
+    rcc->out_messages_counter = stat_add_counter(rcc->stat, "out_messages", TRUE);
+    rcc->out_bytes_counter = stat_add_counter(rcc->stat, "out_bytes", TRUE);
+}
+
+static void red_channel_client_stat_destroy(RedChannelClient *rcc)
+{
+    uint64_t **counters[] = {&rcc->pipe_size_counter, &rcc->max_pipe_size_counter,
+                             &rcc->out_messages_counter, &rcc->out_bytes_counter};
+    int i;
+
+    if (rcc->stat == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < SPICE_N_ELEMENTS(counters); i++) {
+        if (*counters[i]) {
+            stat_remove_counter(*counters[i]);
+            *counters[i] = NULL;
+        }
+    }
+    stat_remove_node(rcc->stat);
+    rcc->stat = INVALID_STAT_REF;
+}
+
+static inline void red_channel_client_pipe_size_stat_update(RedChannelClient *rcc)
+{
+    stat_set_counter(rcc->pipe_size_counter, rcc->pipe_size);
+    if (rcc->max_pipe_size_counter && *rcc->max_pipe_size_counter < rcc->pipe_size) {
+        *rcc->max_pipe_size_counter = rcc->pipe_size;
+    }
+}
+#else
+#define red_channel_client_stat_init(rcc)
+#define red_channel_client_stat_destroy(rcc)
+#define red_channel_client_pipe_size_stat_update(rcc)
+#endif
+
+void red_channel_set_stat_node(RedChannel *channel, StatNodeRef stat)
+{
+#ifdef RED_STATISTICS
+    spice_assert(channel->stat == INVALID_STAT_REF);
+    channel->stat = stat;
+    if (stat == INVALID_STAT_REF) {
+        return;
+    }
+    channel->out_bytes_counter = stat_add_counter(stat, "out_bytes", TRUE);
+    channel->out_messages_counter = stat_add_counter(stat, "out_messages", TRUE);
+    channel->in_bytes_counter = stat_add_counter(stat, "in_bytes", TRUE);
+#endif
+}
+
+static void red_channel_stat_destroy(RedChannel *channel)
+{
+#ifdef RED_STATISTICS
+    uint64_t *counters[] = {channel->out_bytes_counter, channel->out_messages_counter,
+                            channel->in_bytes_counter};
+    int i;
+
+    if (channel->stat == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < SPICE_N_ELEMENTS(counters); i++) {
+        if (counters[i]) {
+            stat_remove_counter(counters[i]);
+        }
+    }
+    stat_remove_node(channel->stat);
+    channel->stat = INVALID_STAT_REF;
+#endif
 }
 
 static void red_channel_client_default_peer_on_error(RedChannelClient *rcc)
@@ -571,6 +666,7 @@ static void red_channel_client_send_item(RedChannelClient *rcc, PipeItem *item)
 
     spice_assert(red_channel_client_no_item_being_sent(rcc));
     red_channel_client_reset_send_data(rcc);
+    red_trace_marshall_start(rcc, item, item->type);
     switch (item->type) {
         case PIPE_ITEM_TYPE_SET_ACK:
             red_channel_client_send_set_ack(rcc);
@@ -629,6 +725,11 @@ static void red_channel_peer_on_out_msg_done(void *opaque)
     RedChannelClient *rcc = (RedChannelClient *)opaque;
 
     rcc->send_data.size = 0;
+    red_trace_msg_sent(rcc);
+#ifdef RED_STATISTICS
+    stat_inc_counter(rcc->channel->out_messages_counter, 1);
+    stat_inc_counter(rcc->out_messages_counter, 1);
+#endif
     red_channel_client_release_sent_item(rcc);
     if (rcc->send_data.blocked) {
         rcc->send_data.blocked = FALSE;
@@ -652,6 +753,7 @@ static void red_channel_peer_on_out_msg_done(void *opaque)
 static void red_channel_client_pipe_remove(RedChannelClient *rcc, PipeItem *item)
 {
     rcc->pipe_size--;
+    red_channel_client_pipe_size_stat_update(rcc);
     ring_remove(&item->link);
 }
 
@@ -917,6 +1019,7 @@ RedChannelClient *red_channel_client_create(int size, RedChannel *channel, RedCl
 
     ring_init(&rcc->pipe);
     rcc->pipe_size = 0;
+    red_channel_client_stat_init(rcc);
 
     stream->watch = channel->core->watch_add(stream->socket,
                                            SPICE_WATCH_EVENT_READ,
@@ -1071,6 +1174,9 @@ RedChannel *red_channel_create(int size,
     channel->thread_id = pthread_self();
 
     channel->out_bytes_counter = 0;
+#ifdef RED_STATISTICS
+    channel->stat = INVALID_STAT_REF;
+#endif
 
     spice_debug("channel type %d id %d thread_id 0x%lx",
                 channel->type, channel->id, channel->thread_id);
@@ -1122,6 +1228,9 @@ RedChannel *red_channel_create_dummy(int size, uint32_t type, uint32_t id)
                 channel->type, channel->id, channel->thread_id);
 
     channel->out_bytes_counter = 0;
+#ifdef RED_STATISTICS
+    channel->stat = INVALID_STAT_REF;
+#endif
 
     return channel;
 }
@@ -1217,6 +1326,7 @@ static void red_channel_ref(RedChannel *channel)
 static void red_channel_unref(RedChannel *channel)
 {
     if (!--channel->refs) {
+        red_channel_stat_destroy(channel);
         if (channel->local_caps.num_common_caps) {
             free(channel->local_caps.common_caps);
         }
@@ -1248,6 +1358,7 @@ static void red_channel_client_unref(RedChannelClient *rcc)
 
         red_channel_client_destroy_remote_caps(rcc);
         if (rcc->channel) {
+            red_channel_client_stat_destroy(rcc);
             red_channel_unref(rcc->channel);
         }
         free(rcc);
@@ -1608,6 +1719,8 @@ void red_channel_client_begin_send_message(RedChannelClient *rcc)
                                        rcc->send_data.size - rcc->send_data.header.header_size);
     rcc->ack_data.messages_window++;
     rcc->send_data.last_sent_serial = rcc->send_data.serial;
+    red_trace_marshall_end(rcc, rcc->send_data.header.get_msg_type(&rcc->send_data.header),
+                           rcc->send_data.size);
     rcc->send_data.header.data = NULL; /* avoid writing to this until we have a new message */
     red_channel_client_send(rcc);
 }
@@ -1671,6 +1784,8 @@ void red_channel_client_pipe_add(RedChannelClient *rcc, PipeItem *item)
         return;
     }
     rcc->pipe_size++;
+    red_channel_client_pipe_size_stat_update(rcc);
+    red_trace_pipe_add(rcc, item, rcc->pipe_size);
     ring_add(&rcc->pipe, &item->link);
 }
 
@@ -1688,6 +1803,8 @@ void red_channel_client_pipe_add_after(RedChannelClient *rcc,
         return;
     }
     rcc->pipe_size++;
+    red_channel_client_pipe_size_stat_update(rcc);
+    red_trace_pipe_add(rcc, item, rcc->pipe_size);
     ring_add_after(&item->link, &pos->link);
 }
 
@@ -1704,6 +1821,8 @@ void red_channel_client_pipe_add_tail_no_push(RedChannelClient *rcc,
         return;
     }
     rcc->pipe_size++;
+    red_channel_client_pipe_size_stat_update(rcc);
+    red_trace_pipe_add(rcc, item, rcc->pipe_size);
     ring_add_before(&item->link, &rcc->pipe);
 }
 
@@ -1713,6 +1832,8 @@ void red_channel_client_pipe_add_tail(RedChannelClient *rcc, PipeItem *item)
         return;
     }
     rcc->pipe_size++;
+    red_channel_client_pipe_size_stat_update(rcc);
+    red_trace_pipe_add(rcc, item, rcc->pipe_size);
     ring_add_before(&item->link, &rcc->pipe);
     red_channel_client_push(rcc);
 }
@@ -1794,6 +1915,7 @@ void red_channel_client_pipe_clear(RedChannelClient *rcc)
         red_channel_client_release_item(rcc, item, FALSE);
     }
     rcc->pipe_size = 0;
+    red_channel_client_pipe_size_stat_update(rcc);
 }
 
 void red_channel_client_ack_zero_messages_window(RedChannelClient *rcc)
@@ -1915,6 +2037,9 @@ RedChannelClient *red_channel_client_create_dummy(int size,
     rcc->incoming.header.data = rcc->incoming.header_buf;
     rcc->incoming.serial = 1;
     ring_init(&rcc->pipe);
+#ifdef RED_STATISTICS
+    rcc->stat = INVALID_STAT_REF;
+#endif
 
     rcc->dummy = TRUE;
     rcc->dummy_connected = TRUE;
@@ -31,6 +31,7 @@
 #include "spice.h"
 #include "red_common.h"
 #include "demarshallers.h"
+#include "stat.h"
 
 #define MAX_SEND_BUFS 1000
 #define CLIENT_ACK_WINDOW 20
@@ -298,6 +299,14 @@ struct RedChannelClient {
 
     RedChannelClientLatencyMonitor latency_monitor;
     RedChannelClientConnectivityMonitor connectivity_monitor;
+
+#ifdef RED_STATISTICS
+    StatNodeRef stat;
+    uint64_t *pipe_size_counter;
+    uint64_t *max_pipe_size_counter;
+    uint64_t *out_messages_counter;
+    uint64_t *out_bytes_counter;
+#endif
 };
 
 struct RedChannel {
@@ -335,7 +344,11 @@ struct RedChannel {
     // TODO: when different channel_clients are in different threads from Channel -> need to protect!
     pthread_t thread_id;
 #ifdef RED_STATISTICS
+    StatNodeRef stat;
+    uint32_t stat_clients_count; /* for naming the clients nodes */
     uint64_t *out_bytes_counter;
+    uint64_t *out_messages_counter;
+    uint64_t *in_bytes_counter;
 #endif
 };
 
@@ -376,6 +389,10 @@ void red_channel_register_client_cbs(RedChannel *channel, ClientCbs *client_cbs)
 void red_channel_set_common_cap(RedChannel *channel, uint32_t cap);
 void red_channel_set_cap(RedChannel *channel, uint32_t cap);
 void red_channel_set_data(RedChannel *channel, void *data);
+/* Publish the channel counters under the statistics node 'stat'. Each channel client
+ * that is created afterwards gets a sub node with its own counters (e.g., pipe size).
+ * The node is removed when the channel is freed. */
+void red_channel_set_stat_node(RedChannel *channel, StatNodeRef stat);
 
 RedChannelClient *red_channel_client_create(int size, RedChannel *channel, RedClient *client,
                                             RedsStream *stream,
@@ -80,6 +80,7 @@ typedef struct RedWorkeState {
 
 extern uint32_t streaming_video;
 extern spice_image_compression_t image_compression;
+extern int render_threads;
 extern spice_wan_compression_t jpeg_state;
 extern spice_wan_compression_t zlib_glz_state;
 
@@ -815,6 +816,23 @@ void red_dispatcher_set_mouse_mode(uint32_t mode)
     }
 }
 
+/* The client is connected to the migration target while the vm is still running.
+ * The workers use this period for flushing the display state ahead of the switch */
+void red_dispatcher_on_migrate_precopy(int enabled)
+{
+    RedWorkerMessageSetMigratePrecopy payload;
+    RedDispatcher *now = dispatchers;
+
+    spice_debug("enabled %d", enabled);
+    while (now) {
+        payload.enabled = enabled;
+        dispatcher_send_message(&now->dispatcher,
+                                RED_WORKER_MESSAGE_SET_MIGRATE_PRECOPY,
+                                &payload);
+        now = now->next;
+    }
+}
+
 void red_dispatcher_on_vm_stop(void)
 {
     RedDispatcher *now = dispatchers;
@@ -1056,7 +1074,7 @@ static RedChannel *red_dispatcher_display_channel_create(RedDispatcher *dispatch
     dispatcher_send_message(&dispatcher->dispatcher,
                             RED_WORKER_MESSAGE_DISPLAY_CHANNEL_CREATE,
                             &payload);
-    receive_data(dispatcher->dispatcher.send_fd, &display_channel, sizeof(RedChannel *));
+    dispatcher_wait_reply(&dispatcher->dispatcher, &display_channel, sizeof(RedChannel *));
     return display_channel;
 }
 
@@ -1068,7 +1086,7 @@ static RedChannel *red_dispatcher_cursor_channel_create(RedDispatcher *dispatche
     dispatcher_send_message(&dispatcher->dispatcher,
                             RED_WORKER_MESSAGE_CURSOR_CHANNEL_CREATE,
                             &payload);
-    receive_data(dispatcher->dispatcher.send_fd, &cursor_channel, sizeof(RedChannel *));
+    dispatcher_wait_reply(&dispatcher->dispatcher, &cursor_channel, sizeof(RedChannel *));
     return cursor_channel;
 }
 
@@ -1109,6 +1127,7 @@ void red_dispatcher_init(QXLInstance *qxl)
     init_data.jpeg_state = jpeg_state;
     init_data.zlib_glz_state = zlib_glz_state;
     init_data.streaming_video = streaming_video;
+    init_data.render_threads = render_threads;
 
     red_dispatcher->base.major_version = SPICE_INTERFACE_QXL_MAJOR;
     red_dispatcher->base.minor_version = SPICE_INTERFACE_QXL_MINOR;
@@ -1150,7 +1169,7 @@ void red_dispatcher_init(QXLInstance *qxl)
     }
     pthread_sigmask(SIG_SETMASK, &curr_sig_mask, NULL);
 
-    read_message(red_dispatcher->dispatcher.send_fd, &message);
+    dispatcher_wait_reply(&red_dispatcher->dispatcher, &message, sizeof(message));
     spice_assert(message == RED_WORKER_MESSAGE_READY);
 
     display_channel = red_dispatcher_display_channel_create(red_dispatcher);
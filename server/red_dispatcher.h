@@ -32,6 +32,7 @@ void red_dispatcher_on_sv_change(void);
 void red_dispatcher_set_mouse_mode(uint32_t mode);
 void red_dispatcher_on_vm_stop(void);
 void red_dispatcher_on_vm_start(void);
+void red_dispatcher_on_migrate_precopy(int enabled);
 int red_dispatcher_count(void);
 int red_dispatcher_add_renderer(const char *name);
 uint32_t red_dispatcher_qxl_ram_size(void);
@@ -205,4 +206,8 @@ typedef struct RedWorkerMessageMonitorsConfigAsync {
 typedef struct RedWorkerMessageDriverUnload {
 } RedWorkerMessageDriverUnload;
 
+typedef struct RedWorkerMessageSetMigratePrecopy {
+    int enabled;
+} RedWorkerMessageSetMigratePrecopy;
+
 #endif
@@ -0,0 +1,164 @@
+/*
+   Copyright (C) 2013 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "common/mem.h"
+#include "common/spice_common.h"
+
+#include "red_hot_areas.h"
+
+void hot_areas_init(HotAreas *areas)
+{
+    memset(areas, 0, sizeof(*areas));
+}
+
+void hot_areas_reset(HotAreas *areas, uint32_t width, uint32_t height)
+{
+    free(areas->cells);
+    hot_areas_init(areas);
+    if (!width || !height) {
+        return;
+    }
+    areas->width = (width + HOT_AREAS_CELL_SIZE - 1) / HOT_AREAS_CELL_SIZE;
+    areas->height = (height + HOT_AREAS_CELL_SIZE - 1) / HOT_AREAS_CELL_SIZE;
+    areas->cells = spice_new0(HotCell, areas->width * areas->height);
+}
+
+static inline int hot_cell_is_hot(HotCell *cell)
+{
+    int frames = 0;
+    int i;
+
+    for (i = 0; i < HOT_AREAS_WINDOW_SLOTS; i++) {
+        frames += cell->frames[i];
+    }
+    return frames >= HOT_AREAS_MIN_FRAMES;
+}
+
+static void hot_areas_clear_slot(HotAreas *areas, uint32_t slot)
+{
+    uint32_t i;
+
+    for (i = 0; i < areas->width * areas->height; i++) {
+        areas->cells[i].frames[slot] = 0;
+    }
+}
+
+static void hot_areas_count_hot_cells(HotAreas *areas)
+{
+    uint32_t i;
+
+    areas->num_hot_cells = 0;
+    for (i = 0; i < areas->width * areas->height; i++) {
+        areas->num_hot_cells += hot_cell_is_hot(&areas->cells[i]);
+    }
+}
+
+/* moves the window so that the current slot contains 'now' */
+static void hot_areas_advance(HotAreas *areas, uint64_t now)
+{
+    uint32_t slot;
+
+    if (now < areas->slot_start + HOT_AREAS_SLOT_DURATION) {
+        return;
+    }
+    hot_areas_count_hot_cells(areas);
+    if (now >= areas->slot_start + HOT_AREAS_WINDOW_SLOTS * HOT_AREAS_SLOT_DURATION) {
+        /* all the slots are out of the window */
+        for (slot = 0; slot < HOT_AREAS_WINDOW_SLOTS; slot++) {
+            hot_areas_clear_slot(areas, slot);
+        }
+        areas->slot_start = now;
+        return;
+    }
+    while (now >= areas->slot_start + HOT_AREAS_SLOT_DURATION) {
+        areas->slot = (areas->slot + 1) % HOT_AREAS_WINDOW_SLOTS;
+        hot_areas_clear_slot(areas, areas->slot);
+        areas->slot_start += HOT_AREAS_SLOT_DURATION;
+    }
+}
+
+/* converts rect to a range of cells, returns FALSE if it is empty */
+static int hot_areas_get_cells(HotAreas *areas, const SpiceRect *rect,
+                               uint32_t *left, uint32_t *top,
+                               uint32_t *right, uint32_t *bottom)
+{
+    if (!areas->cells || rect->left >= rect->right || rect->top >= rect->bottom ||
+        rect->right <= 0 || rect->bottom <= 0) {
+        return FALSE;
+    }
+    *left = MAX(rect->left, 0) / HOT_AREAS_CELL_SIZE;
+    *top = MAX(rect->top, 0) / HOT_AREAS_CELL_SIZE;
+    *right = MIN((rect->right + HOT_AREAS_CELL_SIZE - 1) / HOT_AREAS_CELL_SIZE, areas->width);
+    *bottom = MIN((rect->bottom + HOT_AREAS_CELL_SIZE - 1) / HOT_AREAS_CELL_SIZE,
+                  areas->height);
+    return *left < *right && *top < *bottom;
+}
+
+void hot_areas_add_update(HotAreas *areas, const SpiceRect *rect, uint64_t now)
+{
+    uint32_t left, top, right, bottom;
+    uint32_t x, y;
+
+    if (!hot_areas_get_cells(areas, rect, &left, &top, &right, &bottom)) {
+        return;
+    }
+    hot_areas_advance(areas, now);
+    for (y = top; y < bottom; y++) {
+        HotCell *cell = &areas->cells[y * areas->width + left];
+
+        for (x = left; x < right; x++, cell++) {
+            if (now - cell->last_update < HOT_AREAS_FRAME_INTERVAL) {
+                continue;
+            }
+            cell->last_update = now;
+            if (cell->frames[areas->slot] < UINT8_MAX) {
+                cell->frames[areas->slot]++;
+            }
+        }
+    }
+}
+
+int hot_areas_rect_is_hot(HotAreas *areas, const SpiceRect *rect, uint64_t now)
+{
+    uint32_t left, top, right, bottom;
+    uint32_t x, y;
+    uint32_t hot = 0;
+
+    if (!hot_areas_get_cells(areas, rect, &left, &top, &right, &bottom)) {
+        return FALSE;
+    }
+    hot_areas_advance(areas, now);
+    for (y = top; y < bottom; y++) {
+        HotCell *cell = &areas->cells[y * areas->width + left];
+
+        for (x = left; x < right; x++, cell++) {
+            hot += hot_cell_is_hot(cell);
+        }
+    }
+    /* at least 3/4 of the cells */
+    return hot * 4 >= (right - left) * (bottom - top) * 3;
+}
+
+uint32_t hot_areas_get_num_hot_cells(HotAreas *areas)
+{
+    return areas->num_hot_cells;
+}
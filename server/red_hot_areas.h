@@ -0,0 +1,61 @@
+/*
+   Copyright (C) 2013 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Tracks how often each area of the primary surface is updated, regardless of the
+ * shape of the drawables that update it. The surface is divided to cells, and each
+ * cell counts the frames in which it was updated during a sliding window. A cell
+ * that is updated at a video rate is hot. */
+
+#ifndef _H_RED_HOT_AREAS
+#define _H_RED_HOT_AREAS
+
+#include <stdint.h>
+#include "common/draw.h"
+
+#define HOT_AREAS_CELL_SIZE 64
+/* the window is divided to slots; the oldest slot is cleared when a new one starts */
+#define HOT_AREAS_WINDOW_SLOTS 4
+#define HOT_AREAS_SLOT_DURATION (250 * 1000 * 1000) // nano
+/* updates of a cell that are closer than this belong to the same frame */
+#define HOT_AREAS_FRAME_INTERVAL (10 * 1000 * 1000) // nano
+/* the number of frames in the window (1 sec) from which a cell is hot */
+#define HOT_AREAS_MIN_FRAMES 12
+
+typedef struct HotCell {
+    uint64_t last_update;
+    uint8_t frames[HOT_AREAS_WINDOW_SLOTS];
+} HotCell;
+
+typedef struct HotAreas {
+    uint32_t width;  // in cells
+    uint32_t height; // in cells
+    HotCell *cells;
+    uint64_t slot_start;
+    uint32_t slot;
+    uint32_t num_hot_cells;
+} HotAreas;
+
+void hot_areas_init(HotAreas *areas);
+/* resets the areas to a surface of the given size (in pixels), 0 frees them */
+void hot_areas_reset(HotAreas *areas, uint32_t width, uint32_t height);
+void hot_areas_add_update(HotAreas *areas, const SpiceRect *rect, uint64_t now);
+/* returns TRUE if most of the rect is hot */
+int hot_areas_rect_is_hot(HotAreas *areas, const SpiceRect *rect, uint64_t now);
+/* the number of hot cells, as of the start of the current slot */
+uint32_t hot_areas_get_num_hot_cells(HotAreas *areas);
+
+#endif
@@ -37,7 +37,7 @@ typedef struct RedDrawable {
     uint32_t mm_time;
     int32_t surfaces_dest[3];
     SpiceRect surfaces_rects[3];
-    union {
+    union RedDrawableOp {
         SpiceFill fill;
         SpiceOpaque opaque;
         SpiceCopy copy;
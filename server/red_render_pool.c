@@ -0,0 +1,216 @@
+/*
+   Copyright (C) 2013 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <pthread.h>
+
+#include "common/mem.h"
+#include "common/spice_common.h"
+#include "common/region.h"
+
+#include "red_render_pool.h"
+
+struct RedRenderPool {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    Ring jobs;
+    QRegion batch_area; /* only used by the thread that adds the jobs */
+    int running;
+    int quit;
+    int num_threads;
+    pthread_t threads[RED_RENDER_MAX_THREADS];
+};
+
+typedef struct RedRenderThread {
+    RedRenderPool *pool;
+    int index;
+} RedRenderThread;
+
+/* called with the lock held */
+static RedRenderJob *red_render_pool_get_job(RedRenderPool *pool)
+{
+    RingItem *link;
+
+    if (!(link = ring_get_tail(&pool->jobs))) {
+        return NULL;
+    }
+    ring_remove(link);
+    pool->running++;
+    return SPICE_CONTAINEROF(link, RedRenderJob, link);
+}
+
+/* called with the lock held */
+static void red_render_pool_job_done(RedRenderPool *pool)
+{
+    if (!--pool->running && ring_is_empty(&pool->jobs)) {
+        pthread_cond_signal(&pool->done_cond);
+    }
+}
+
+static void *red_render_thread_main(void *arg)
+{
+    RedRenderThread *thread = arg;
+    RedRenderPool *pool = thread->pool;
+    int index = thread->index;
+    RedRenderJob *job;
+
+    free(thread);
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && !(job = red_render_pool_get_job(pool))) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        job->func(job, index);
+        pthread_mutex_lock(&pool->lock);
+        red_render_pool_job_done(pool);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+RedRenderPool *red_render_pool_new(int num_threads)
+{
+    RedRenderPool *pool;
+    RedRenderThread *thread;
+    int i;
+
+    spice_return_val_if_fail(num_threads > 0 && num_threads <= RED_RENDER_MAX_THREADS, NULL);
+
+    pool = spice_new0(RedRenderPool, 1);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    ring_init(&pool->jobs);
+    region_init(&pool->batch_area);
+    for (i = 0; i < num_threads; i++) {
+        thread = spice_new(RedRenderThread, 1);
+        thread->pool = pool;
+        thread->index = i;
+        if (pthread_create(&pool->threads[i], NULL, red_render_thread_main, thread)) {
+            spice_warning("failed to create render thread");
+            free(thread);
+            break;
+        }
+    }
+    pool->num_threads = i;
+    if (!pool->num_threads) {
+        red_render_pool_destroy(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void red_render_pool_destroy(RedRenderPool *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = TRUE;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    region_destroy(&pool->batch_area);
+    free(pool);
+}
+
+int red_render_pool_get_num_threads(RedRenderPool *pool)
+{
+    return pool->num_threads;
+}
+
+void red_render_job_init(RedRenderJob *job, red_render_job_func_t func)
+{
+    ring_item_init(&job->link);
+    job->func = func;
+}
+
+void red_render_pool_add(RedRenderPool *pool, RedRenderJob *job)
+{
+    pthread_mutex_lock(&pool->lock);
+    ring_add(&pool->jobs, &job->link);
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void red_render_pool_wait(RedRenderPool *pool)
+{
+    RedRenderJob *job;
+
+    pthread_mutex_lock(&pool->lock);
+    /* help with the jobs that no render thread took yet, instead of sleeping */
+    while ((job = red_render_pool_get_job(pool))) {
+        pthread_mutex_unlock(&pool->lock);
+        job->func(job, pool->num_threads);
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+    }
+    while (pool->running) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    region_clear(&pool->batch_area);
+}
+
+void red_render_pool_add_area(RedRenderPool *pool, RedRenderJob *job, const SpiceRect *area)
+{
+    region_add(&pool->batch_area, area);
+    red_render_pool_add(pool, job);
+}
+
+int red_render_pool_batch_touches(RedRenderPool *pool, const SpiceRect *area)
+{
+    return region_touches_rect(&pool->batch_area, area);
+}
+
+int red_render_rect_can_tile(const SpiceRect *bbox)
+{
+    int width = bbox->right - bbox->left;
+    int height = bbox->bottom - bbox->top;
+
+    return width * height >= RED_RENDER_TILE_MIN_AREA && height >= 2 * RED_RENDER_TILE_MIN_HEIGHT;
+}
+
+int red_render_pool_split_bands(RedRenderPool *pool, const SpiceRect *bbox, SpiceRect *bands)
+{
+    int num_bands = pool->num_threads + 1;
+    int band_height;
+    SpiceRect band;
+    int i;
+
+    band_height = (bbox->bottom - bbox->top + num_bands - 1) / num_bands;
+    band_height = MAX(band_height, RED_RENDER_TILE_MIN_HEIGHT);
+
+    band = *bbox;
+    for (i = 0; i < num_bands && band.top < bbox->bottom; i++) {
+        band.bottom = MIN(band.top + band_height, bbox->bottom);
+        bands[i] = band;
+        band.top = band.bottom;
+    }
+    return i;
+}
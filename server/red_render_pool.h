@@ -0,0 +1,69 @@
+/*
+   Copyright (C) 2013 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_RED_RENDER_POOL
+#define _H_RED_RENDER_POOL
+
+#include "common/ring.h"
+#include "common/draw.h"
+
+#define RED_RENDER_MAX_THREADS 8
+
+/* operations smaller than this are drawn by a single thread, without splitting them */
+#define RED_RENDER_TILE_MIN_AREA (256 * 256)
+#define RED_RENDER_TILE_MIN_HEIGHT 32
+
+typedef struct RedRenderPool RedRenderPool;
+typedef struct RedRenderJob RedRenderJob;
+
+/* thread_index is in [0, red_render_pool_get_num_threads(pool)]. The thread that
+ * calls red_render_pool_wait runs jobs too, with the last index. No two jobs run at the
+ * same time with the same thread_index, so it can select per thread resources
+ * (e.g. a canvas). */
+typedef void (*red_render_job_func_t)(RedRenderJob *job, int thread_index);
+
+struct RedRenderJob {
+    RingItem link;
+    red_render_job_func_t func;
+};
+
+/* a pool of threads that render jobs in parallel, in batches: the jobs that were added
+ * before red_render_pool_wait are not ordered between them, and all of them are done
+ * when it returns. The pool must be used from a single thread. */
+RedRenderPool *red_render_pool_new(int num_threads);
+void red_render_pool_destroy(RedRenderPool *pool);
+int red_render_pool_get_num_threads(RedRenderPool *pool);
+
+void red_render_job_init(RedRenderJob *job, red_render_job_func_t func);
+void red_render_pool_add(RedRenderPool *pool, RedRenderJob *job);
+void red_render_pool_wait(RedRenderPool *pool);
+
+/* the jobs of a batch must not draw on the same pixels. A job that is added with
+ * red_render_pool_add_area records the area that it draws, until the next
+ * red_render_pool_wait, so that the caller can start a new batch for a job that
+ * touches it. */
+void red_render_pool_add_area(RedRenderPool *pool, RedRenderJob *job, const SpiceRect *area);
+int red_render_pool_batch_touches(RedRenderPool *pool, const SpiceRect *area);
+
+/* a large operation is drawn in parallel by splitting it to horizontal bands that
+ * don't overlap, one for each render thread and one for the thread that waits.
+ * red_render_pool_split_bands fills bands (RED_RENDER_MAX_THREADS + 1 rects at most)
+ * and returns their number. */
+int red_render_rect_can_tile(const SpiceRect *bbox);
+int red_render_pool_split_bands(RedRenderPool *pool, const SpiceRect *bbox, SpiceRect *bands);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+   Copyright (C) 2013 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Static tracing probes (USDT) on the path of a command, from the moment it is read
+ * from the QXL ring until its message is written to the socket.
+ *
+ * The probes are compiled in only with --enable-usdt. Even then, a probe is a single nop
+ * until a tracer (perf, systemtap, bpftrace) attaches to it.
+ * The provider name is "spice_server". The probes are listed below, in the order they are
+ * hit by a drawable; tools/spice_trace_latency.py turns a trace of them into a per
+ * command latency breakdown. */
+
+#ifndef _H_RED_TRACE
+#define _H_RED_TRACE
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef ENABLE_USDT
+
+#include <stdint.h>
+#include <sys/sdt.h>
+
+#define RED_TRACE_PTR(p) ((uint64_t)(uintptr_t)(p))
+
+/* a command was read from the QXL ring */
+#define red_trace_cmd_fetch(worker_id, type, data) \
+    DTRACE_PROBE3(spice_server, cmd_fetch, worker_id, type, (uint64_t)(data))
+/* the drawable of the last fetched command was added to the tree */
+#define red_trace_drawable_insert(drawable, added) \
+    DTRACE_PROBE2(spice_server, drawable_insert, RED_TRACE_PTR(drawable), added)
+/* the drawable was queued to a display channel client as 'item' */
+#define red_trace_drawable_pipe_add(drawable, item) \
+    DTRACE_PROBE2(spice_server, drawable_pipe_add, RED_TRACE_PTR(drawable), RED_TRACE_PTR(item))
+/* any pipe item was queued to a channel client */
+#define red_trace_pipe_add(rcc, item, pipe_size) \
+    DTRACE_PROBE3(spice_server, pipe_add, RED_TRACE_PTR(rcc), RED_TRACE_PTR(item), pipe_size)
+/* the item was removed from the pipe, in order to marshall it */
+#define red_trace_marshall_start(rcc, item, type) \
+    DTRACE_PROBE3(spice_server, marshall_start, RED_TRACE_PTR(rcc), RED_TRACE_PTR(item), type)
+#define red_trace_compress_start(codec) \
+    DTRACE_PROBE1(spice_server, compress_start, codec)
+#define red_trace_compress_end(codec, orig_size, comp_size) \
+    DTRACE_PROBE3(spice_server, compress_end, codec, orig_size, comp_size)
+/* the message was marshalled, and it is about to be sent */
+#define red_trace_marshall_end(rcc, msg_type, size) \
+    DTRACE_PROBE3(spice_server, marshall_end, RED_TRACE_PTR(rcc), msg_type, size)
+#define red_trace_socket_write(rcc, n) \
+    DTRACE_PROBE2(spice_server, socket_write, RED_TRACE_PTR(rcc), n)
+/* the last byte of the current message of rcc was written to the socket */
+#define red_trace_msg_sent(rcc) \
+    DTRACE_PROBE1(spice_server, msg_sent, RED_TRACE_PTR(rcc))
+
+#else
+
+#define red_trace_cmd_fetch(worker_id, type, data)
+#define red_trace_drawable_insert(drawable, added)
+#define red_trace_drawable_pipe_add(drawable, item)
+#define red_trace_pipe_add(rcc, item, pipe_size)
+#define red_trace_marshall_start(rcc, item, type)
+#define red_trace_compress_start(codec)
+#define red_trace_compress_end(codec, orig_size, comp_size)
+#define red_trace_marshall_end(rcc, msg_type, size)
+#define red_trace_socket_write(rcc, n)
+#define red_trace_msg_sent(rcc)
+
+#endif
+
+#endif
@@ -84,8 +84,11 @@
 #include "main_dispatcher.h"
 #include "spice_server_utils.h"
 #include "red_time.h"
+#include "red_trace.h"
 #include "spice_bitmap_utils.h"
 #include "spice_image_cache.h"
+#include "red_render_pool.h"
+#include "red_hot_areas.h"
 
 //#define COMPRESS_STAT
 //#define DUMP_BITMAP
@@ -113,6 +116,8 @@
 #define RED_STREAM_CONTINUS_MAX_DELTA (1000 * 1000 * 1000)
 #define RED_STREAM_TIMOUT (1000 * 1000 * 1000)
 #define RED_STREAM_FRAMES_START_CONDITION 20
+/* for drawables in areas that are updated at a video rate (see red_hot_areas.h) */
+#define RED_STREAM_HOT_FRAMES_START_CONDITION 4
 #define RED_STREAM_GRADUAL_FRAMES_START_CONDITION 0.2
 #define RED_STREAM_FRAMES_RESET_CONDITION 100
 #define RED_STREAM_MIN_SIZE (96 * 96)
@@ -266,6 +271,53 @@ double inline stat_byte_to_mega(uint64_t size)
 #define stat_compress_add(a, b, c, d)
 #endif
 
+/* unlike COMPRESS_STAT, these are published in the statistics shared memory, and are
+ * cheap enough to be always collected */
+enum {
+    CODEC_STAT_QUIC,
+    CODEC_STAT_LZ,
+    CODEC_STAT_GLZ,
+    CODEC_STAT_ZLIB_GLZ,
+    CODEC_STAT_JPEG,
+    CODEC_STAT_JPEG_ALPHA,
+
+    CODEC_STAT_COUNT,
+};
+
+#ifdef RED_STATISTICS
+static const char *codec_stat_names[CODEC_STAT_COUNT] = {
+    "quic", "lz", "glz", "zlib_glz", "jpeg", "jpeg_alpha",
+};
+
+typedef struct RedCodecStat {
+    StatNodeRef node;
+    uint64_t *orig_bytes;
+    uint64_t *comp_bytes;
+    StatHistogram latency;
+} RedCodecStat;
+
+static void red_codec_stat_init(RedCodecStat *codec_stat, StatNodeRef parent, const char *name)
+{
+    codec_stat->node = stat_add_node(parent, name, TRUE);
+    codec_stat->orig_bytes = stat_add_counter(codec_stat->node, "orig_bytes", TRUE);
+    codec_stat->comp_bytes = stat_add_counter(codec_stat->node, "comp_bytes", TRUE);
+    stat_add_histogram(&codec_stat->latency, codec_stat->node, "latency");
+}
+
+static inline void red_codec_stat_add(RedCodecStat *codec_stat, uint64_t start,
+                                      uint64_t orig_size, uint64_t comp_size)
+{
+    stat_inc_counter(codec_stat->orig_bytes, orig_size);
+    stat_inc_counter(codec_stat->comp_bytes, comp_size);
+    stat_histogram_add(&codec_stat->latency, (red_now() - start) / 1000);
+}
+
+#define display_channel_codec_stat_add(dc, codec, start, orig, comp) \
+    red_codec_stat_add(&(dc)->codec_stat[codec], start, orig, comp)
+#else
+#define display_channel_codec_stat_add(dc, codec, start, orig, comp)
+#endif
+
 #define MAX_EVENT_SOURCES 20
 #define INF_EVENT_WAIT ~0
 
@@ -366,6 +418,7 @@ typedef struct StreamActivateReportItem {
 typedef struct CursorItem {
     uint32_t group_id;
     int refs;
+    red_time_t creation_time;
     RedCursorCmd *red_cursor;
 } CursorItem;
 
@@ -388,6 +441,17 @@ typedef struct LocalCursor {
 #define WIDE_CLIENT_ACK_WINDOW 40
 #define NARROW_CLIENT_ACK_WINDOW 20
 
+/* Migration pre-copy phase (see handle_dev_set_migrate_precopy): drawables that are
+ * older than MIGRATE_PRECOPY_MIN_AGE are rendered and released, for at most
+ * MIGRATE_PRECOPY_STEP_TIME in each loop iteration, and the display pipe is kept
+ * shorter. Thus, when the vm stops, only the latest updates are left to flush
+ * and send before the switch. Nothing is sent to the destination server: the
+ * surfaces and the pixmap cache reach it through the client and MSG_MIGRATE_DATA, as
+ * before. */
+#define MIGRATE_PRECOPY_MAX_PIPE_SIZE (WIDE_CLIENT_ACK_WINDOW + 1)
+#define MIGRATE_PRECOPY_MIN_AGE (100 * 1000 * 1000) // nano
+#define MIGRATE_PRECOPY_STEP_TIME (2 * 1000 * 1000) // nano
+
 #define BITS_CACHE_HASH_SHIFT 10
 #define BITS_CACHE_HASH_SIZE (1 << BITS_CACHE_HASH_SHIFT)
 #define BITS_CACHE_HASH_MASK (BITS_CACHE_HASH_SIZE - 1)
@@ -488,6 +552,14 @@ typedef struct StreamAgent {
 
     uint32_t report_id;
     uint32_t client_required_latency;
+
+    /* for partial frames: the hashes of the macroblocks of the last frame that was sent,
+     * and of the frame that is being sent */
+    uint32_t *block_hashes;
+    uint32_t *new_block_hashes;
+    uint32_t num_blocks;
+    int block_hashes_valid;
+    int partial_frames; /* since the last full frame */
 #ifdef STREAM_STATS
     StreamStats stats;
 #endif
@@ -731,6 +803,15 @@ struct DisplayChannel {
     uint64_t *cache_hits_counter;
     uint64_t *add_to_cache_counter;
     uint64_t *non_cache_counter;
+    RedCodecStat codec_stat[CODEC_STAT_COUNT];
+    StatNodeRef streams_stat;
+    uint64_t *stream_frames_counter;
+    uint64_t *stream_bytes_counter;
+    uint64_t *stream_drops_counter;
+    uint64_t *stream_partial_frames_counter;
+    uint64_t *stream_unchanged_frames_counter;
+    uint64_t *stream_superseded_frames_counter;
+    StatHistogram stream_encode_latency;
 #endif
 #ifdef COMPRESS_STAT
     stat_info_t lz_stat;
@@ -756,6 +837,10 @@ typedef struct CursorChannel {
 
 #ifdef RED_STATISTICS
     StatNodeRef stat;
+    uint64_t *shapes_counter;
+    uint64_t *shape_bytes_counter;
+    uint64_t *shape_cache_hits_counter;
+    StatHistogram set_latency;
 #endif
 } CursorChannel;
 
@@ -824,9 +909,7 @@ struct Drawable {
     Ring pipes;
     PipeItem *pipe_item_rest;
     uint32_t size_pipe_item_rest;
-#ifdef UPDATE_AREA_BY_TREE
     RingItem collect_link;
-#endif
     RedDrawable *red_drawable;
 
     Ring glz_ring;
@@ -838,6 +921,7 @@ struct Drawable {
     Stream *stream;
     Stream *sized_stream;
     int streamable;
+    int hot; // in a hot area of the primary surface when it was added
     BitmapGradualType copy_bitmap_graduality;
     uint32_t group_id;
     DependItem depend_items[3];
@@ -883,6 +967,8 @@ typedef struct DrawContext {
     int32_t stride;
     uint32_t format;
     void *line_0;
+    /* see red_surface_create_render_canvases */
+    SpiceCanvas *render_canvases[RED_RENDER_MAX_THREADS + 1];
 } DrawContext;
 
 typedef struct RedSurface {
@@ -974,6 +1060,9 @@ typedef struct RedWorker {
 
     ImageCache image_cache;
 
+    RedRenderPool *render_pool;
+    Ring render_batch;
+
     spice_image_compression_t image_compression;
     spice_wan_compression_t jpeg_state;
     spice_wan_compression_t zlib_glz_state;
@@ -984,6 +1073,7 @@ typedef struct RedWorker {
     Stream streams_buf[NUM_STREAMS];
     Stream *free_streams;
     Ring streams;
+    HotAreas hot_areas;
     ItemTrace items_trace[NUM_TRACE_ITEMS];
     uint32_t next_item_trace;
     uint64_t streams_size_total;
@@ -1015,9 +1105,26 @@ typedef struct RedWorker {
     StatNodeRef stat;
     uint64_t *wakeup_counter;
     uint64_t *command_counter;
+    uint64_t *update_area_drawn_counter;
+    uint64_t *update_area_deferred_counter;
+    StatHistogram update_area_latency;
+    uint64_t *render_async_counter;
+    uint64_t *render_tiled_counter;
+    StatNodeRef stream_detect_stat;
+    uint64_t *stream_detect_hits_counter;
+    uint64_t *stream_detect_misses_counter;
+    uint64_t *hot_area_hits_counter;
+    uint64_t *hot_area_misses_counter;
+    uint64_t *hot_cells_counter;
+    StatNodeRef surfaces_stat;
+    uint64_t *surfaces_counter;
+    uint64_t *surfaces_memory_counter;
+    uint64_t *offscreen_surfaces_counter;
+    uint64_t *offscreen_surfaces_memory_counter;
 #endif
 
     int driver_cap_monitors_config;
+    int migrate_precopy;
     int set_client_capabilities_pending;
 } RedWorker;
 
@@ -1036,6 +1143,7 @@ typedef struct BitmapData {
 } BitmapData;
 
 static void red_draw_qxl_drawable(RedWorker *worker, Drawable *drawable);
+static void red_surface_destroy_render_canvases(RedSurface *surface);
 static void red_current_flush(RedWorker *worker, int surface_id);
 #ifdef DRAW_ALL
 #define red_update_area(worker, rect, surface_id)
@@ -1458,6 +1566,7 @@ static inline void red_pipe_add_drawable(DisplayChannelClient *dcc, Drawable *dr
 
     red_handle_drawable_surfaces_client_synced(dcc, drawable);
     dpi = get_drawable_pipe_item(dcc, drawable);
+    red_trace_drawable_pipe_add(drawable, &dpi->dpi_pipe_item);
     red_channel_client_pipe_add(&dcc->common.base, &dpi->dpi_pipe_item);
 }
 
@@ -1481,6 +1590,7 @@ static inline void red_pipe_add_drawable_to_tail(DisplayChannelClient *dcc, Draw
     }
     red_handle_drawable_surfaces_client_synced(dcc, drawable);
     dpi = get_drawable_pipe_item(dcc, drawable);
+    red_trace_drawable_pipe_add(drawable, &dpi->dpi_pipe_item);
     red_channel_client_pipe_add_tail(&dcc->common.base, &dpi->dpi_pipe_item);
 }
 
@@ -1497,6 +1607,7 @@ static inline void red_pipes_add_drawable_after(RedWorker *worker,
         dcc = dpi_pos_after->dcc;
         red_handle_drawable_surfaces_client_synced(dcc, drawable);
         dpi = get_drawable_pipe_item(dcc, drawable);
+        red_trace_drawable_pipe_add(drawable, &dpi->dpi_pipe_item);
         red_channel_client_pipe_add_after(&dcc->common.base, &dpi->dpi_pipe_item,
                                           &dpi_pos_after->dpi_pipe_item);
     }
@@ -1690,6 +1801,26 @@ static inline void red_destroy_surface_item(RedWorker *worker,
     red_channel_client_pipe_add(&dcc->common.base, &destroy->pipe_item);
 }
 
+/* Accounts the memory that surface_id is drawn on. It is guest memory, mapped by the
+ * worker canvases. */
+static inline void red_account_surface(RedWorker *worker, uint32_t surface_id, int created)
+{
+#ifdef RED_STATISTICS
+    RedSurface *surface = &worker->surfaces[surface_id];
+    uint64_t size = (uint64_t)surface->context.height * abs(surface->context.stride);
+
+    if (!created) {
+        size = -size;
+    }
+    stat_inc_counter(worker->surfaces_counter, created ? 1 : -1);
+    stat_inc_counter(worker->surfaces_memory_counter, size);
+    if (!is_primary_surface(worker, surface_id)) {
+        stat_inc_counter(worker->offscreen_surfaces_counter, created ? 1 : -1);
+        stat_inc_counter(worker->offscreen_surfaces_memory_counter, size);
+    }
+#endif
+}
+
 static inline void red_destroy_surface(RedWorker *worker, uint32_t surface_id)
 {
     RedSurface *surface = &worker->surfaces[surface_id];
@@ -1700,10 +1831,12 @@ static inline void red_destroy_surface(RedWorker *worker, uint32_t surface_id)
         // only primary surface streams are supported
         if (is_primary_surface(worker, surface_id)) {
             red_reset_stream_trace(worker);
+            hot_areas_reset(&worker->hot_areas, 0, 0);
         }
         spice_assert(surface->context.canvas);
 
         surface->context.canvas->ops->destroy(surface->context.canvas);
+        red_surface_destroy_render_canvases(surface);
         if (surface->create.info) {
             worker->qxl->st->qif->release_resource(worker->qxl, surface->create);
         }
@@ -1713,6 +1846,7 @@ static inline void red_destroy_surface(RedWorker *worker, uint32_t surface_id)
 
         region_destroy(&surface->draw_dirty_region);
         surface->context.canvas = NULL;
+        red_account_surface(worker, surface_id, FALSE);
         WORKER_FOREACH_DCC_SAFE(worker, link, next, dcc) {
             red_destroy_surface_item(worker, dcc, surface_id);
         }
@@ -2525,6 +2659,8 @@ static void push_stream_clip(DisplayChannelClient* dcc, StreamAgent *agent)
         spice_critical("alloc failed");
     }
     item->clip_type = SPICE_CLIP_TYPE_RECTS;
+    /* the parts that were hidden might not hold the last frame on the client anymore */
+    agent->block_hashes_valid = FALSE;
 
     n_rects = pixman_region32_n_rects(&agent->clip);
 
@@ -2995,6 +3131,16 @@ static void red_display_update_streams_max_latency(DisplayChannelClient *dcc, St
     dcc->streams_max_latency = new_max_latency;
 }
 
+static void red_stream_agent_free_block_hashes(StreamAgent *agent)
+{
+    free(agent->block_hashes);
+    free(agent->new_block_hashes);
+    agent->block_hashes = NULL;
+    agent->new_block_hashes = NULL;
+    agent->num_blocks = 0;
+    agent->block_hashes_valid = FALSE;
+}
+
 static void red_display_stream_agent_stop(DisplayChannelClient *dcc, StreamAgent *agent)
 {
     red_display_update_streams_max_latency(dcc, agent);
@@ -3002,6 +3148,7 @@ static void red_display_stream_agent_stop(DisplayChannelClient *dcc, StreamAgent
         mjpeg_encoder_destroy(agent->mjpeg_encoder);
         agent->mjpeg_encoder = NULL;
     }
+    red_stream_agent_free_block_hashes(agent);
 }
 
 static void red_stream_update_client_playback_latency(void *opaque, uint32_t delay_ms)
@@ -3035,6 +3182,8 @@ static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
     agent->drops = 0;
     agent->fps = MAX_FPS;
     agent->dcc = dcc;
+    agent->block_hashes_valid = FALSE;
+    agent->partial_frames = 0;
 
     if (dcc->use_mjpeg_encoder_rate_control) {
         MJpegEncoderRateControlCbs mjpeg_cbs;
@@ -3049,6 +3198,7 @@ static void red_display_create_stream(DisplayChannelClient *dcc, Stream *stream)
     } else {
         agent->mjpeg_encoder = mjpeg_encoder_new(FALSE, 0, NULL, NULL);
     }
+    mjpeg_encoder_set_render_pool(agent->mjpeg_encoder, dcc->common.worker->render_pool);
     red_channel_client_pipe_add(&dcc->common.base, &agent->create_item);
 
     if (red_channel_client_test_remote_cap(&dcc->common.base, SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -3170,6 +3320,7 @@ static void red_display_destroy_streams_agents(DisplayChannelClient *dcc)
             mjpeg_encoder_destroy(agent->mjpeg_encoder);
             agent->mjpeg_encoder = NULL;
         }
+        red_stream_agent_free_block_hashes(agent);
     }
 }
 
@@ -3271,6 +3422,23 @@ static inline int red_is_next_stream_frame(RedWorker *worker, const Drawable *ca
                                       FALSE);
 }
 
+/* TRUE if new_frame hides all of frame once it is drawn */
+static inline int red_stream_frame_covers(Drawable *new_frame, Drawable *frame)
+{
+    return new_frame->red_drawable->clip.type == SPICE_CLIP_TYPE_NONE &&
+           rect_contains(&new_frame->red_drawable->bbox, &frame->red_drawable->bbox);
+}
+
+/* The frame is pending and nothing was pushed to the client after it. The next frame
+ * is about to be pushed right after it and cover it, so there is no point in encoding
+ * it when the socket becomes ready: the client would only get to see the newest one. */
+static inline int red_stream_frame_is_superseded(DisplayChannelClient *dcc,
+                                                 DrawablePipeItem *dpi, int covered)
+{
+    return covered && pipe_item_is_linked(&dpi->dpi_pipe_item) &&
+           ring_get_head(&dcc->common.base.pipe) == &dpi->dpi_pipe_item.link;
+}
+
 static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawable *new_frame)
 {
     DrawablePipeItem *dpi;
@@ -3278,6 +3446,8 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawa
     int index;
     StreamAgent *agent;
     RingItem *ring_item, *next;
+    int same_generation;
+    int covered;
 
     spice_assert(stream->current);
 
@@ -3285,24 +3455,39 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawa
         return;
     }
 
-    if (new_frame->process_commands_generation == stream->current->process_commands_generation) {
-        spice_debug("ignoring drop, same process_commands_generation as previous frame");
-        return;
-    }
-
+    same_generation = new_frame->process_commands_generation ==
+                      stream->current->process_commands_generation;
+    covered = red_stream_frame_covers(new_frame, stream->current);
     index = get_stream_id(worker, stream);
     DRAWABLE_FOREACH_DPI_SAFE(stream->current, ring_item, next, dpi) {
+        int superseded;
+
         dcc = dpi->dcc;
         agent = &dcc->stream_agents[index];
 
+        superseded = red_stream_frame_is_superseded(dcc, dpi, covered);
+        if (superseded) {
+#ifdef RED_STATISTICS
+            stat_inc_counter(worker->display_channel->stream_superseded_frames_counter, 1);
+#endif
+            red_channel_client_pipe_remove_and_release(&dcc->common.base, &dpi->dpi_pipe_item);
+        }
+
+        if (same_generation) {
+            continue;
+        }
+
         if (!dcc->use_mjpeg_encoder_rate_control &&
             !dcc->common.is_low_bandwidth) {
             continue;
         }
 
-        if (pipe_item_is_linked(&dpi->dpi_pipe_item)) {
+        if (superseded || pipe_item_is_linked(&dpi->dpi_pipe_item)) {
 #ifdef STREAM_STATS
             agent->stats.num_drops_pipe++;
+#endif
+#ifdef RED_STATISTICS
+            stat_inc_counter(worker->display_channel->stream_drops_counter, 1);
 #endif
             if (dcc->use_mjpeg_encoder_rate_control) {
                 mjpeg_encoder_notify_server_frame_drop(agent->mjpeg_encoder);
@@ -3312,6 +3497,10 @@ static inline void pre_stream_item_swap(RedWorker *worker, Stream *stream, Drawa
         }
     }
 
+    if (same_generation) {
+        spice_debug("ignoring drop, same process_commands_generation as previous frame");
+        return;
+    }
 
     WORKER_FOREACH_DCC_SAFE(worker, ring_item, next, dcc) {
         double drop_factor;
@@ -3371,7 +3560,10 @@ static inline void red_update_copy_graduality(RedWorker* worker, Drawable *drawa
 
 static inline int red_is_stream_start(Drawable *drawable)
 {
-    return ((drawable->frames_count >= RED_STREAM_FRAMES_START_CONDITION) &&
+    int frames_start_condition = drawable->hot ? RED_STREAM_HOT_FRAMES_START_CONDITION :
+                                                 RED_STREAM_FRAMES_START_CONDITION;
+
+    return ((drawable->frames_count >= frames_start_condition) &&
             (drawable->gradual_frames_count >=
             (RED_STREAM_GRADUAL_FRAMES_START_CONDITION * drawable->frames_count)));
 }
@@ -3383,6 +3575,9 @@ static int red_stream_add_frame(RedWorker *worker,
                                 int gradual_frames_count,
                                 int last_gradual_frame)
 {
+#ifdef RED_STATISTICS
+    stat_inc_counter(worker->stream_detect_hits_counter, 1);
+#endif
     red_update_copy_graduality(worker, frame_drawable);
     frame_drawable->frames_count = frames_count + 1;
     frame_drawable->gradual_frames_count  = gradual_frames_count;
@@ -3402,6 +3597,11 @@ static int red_stream_add_frame(RedWorker *worker,
     }
 
     if (red_is_stream_start(frame_drawable)) {
+#ifdef RED_STATISTICS
+        if (frame_drawable->frames_count < RED_STREAM_FRAMES_START_CONDITION) {
+            stat_inc_counter(worker->hot_area_hits_counter, 1);
+        }
+#endif
         red_create_stream(worker, frame_drawable);
         return TRUE;
     }
@@ -3426,6 +3626,9 @@ static inline void red_stream_maintenance(RedWorker *worker, Drawable *candidate
                                                        stream,
                                                        TRUE);
         if (is_next_frame != STREAM_FRAME_NONE) {
+#ifdef RED_STATISTICS
+            stat_inc_counter(worker->stream_detect_hits_counter, 1);
+#endif
             pre_stream_item_swap(worker, stream, candidate);
             red_detach_stream(worker, stream, FALSE);
             prev->streamable = FALSE; //prevent item trace
@@ -3577,6 +3780,9 @@ static inline void red_use_stream_trace(RedWorker *worker, Drawable *drawable)
                                                        stream,
                                                        TRUE);
         if (is_next_frame != STREAM_FRAME_NONE) {
+#ifdef RED_STATISTICS
+            stat_inc_counter(worker->stream_detect_hits_counter, 1);
+#endif
             if (stream->current) {
                 stream->current->streamable = FALSE; //prevent item trace
                 pre_stream_item_swap(worker, stream, drawable);
@@ -3601,10 +3807,16 @@ static inline void red_use_stream_trace(RedWorker *worker, Drawable *drawable)
                                      trace->frames_count,
                                      trace->gradual_frames_count,
                                      trace->last_gradual_frame)) {
-                return;
+                break;
             }
         }
     }
+#ifdef RED_STATISTICS
+    /* red_stream_add_frame wasn't called */
+    if (!drawable->frames_count) {
+        stat_inc_counter(worker->stream_detect_misses_counter, 1);
+    }
+#endif
 }
 
 static void red_reset_stream_trace(RedWorker *worker)
@@ -3880,6 +4092,7 @@ static inline int red_current_add_qxl(RedWorker *worker, Ring *ring, Drawable *d
         red_update_streamable(worker, drawable, red_drawable);
         ret = red_current_add(worker, ring, drawable);
     }
+    red_trace_drawable_insert(drawable, ret);
 #ifdef RED_WORKER_STAT
     if ((++worker->add_count % 100) == 0) {
         stat_time_t total = worker->add_stat.total;
@@ -4054,9 +4267,7 @@ static Drawable *get_drawable(RedWorker *worker, uint8_t effect, RedDrawable *re
 #endif
     ring_item_init(&drawable->list_link);
     ring_item_init(&drawable->surface_list_link);
-#ifdef UPDATE_AREA_BY_TREE
     ring_item_init(&drawable->collect_link);
-#endif
     ring_item_init(&drawable->tree_item.base.siblings_link);
     drawable->tree_item.base.type = TREE_ITEM_TYPE_DRAWABLE;
     region_init(&drawable->tree_item.base.rgn);
@@ -4151,6 +4362,28 @@ static inline void red_inc_surfaces_drawable_dependencies(RedWorker *worker, Dra
     }
 }
 
+/* Feeds the update rate of the areas of the primary surface, and marks the drawables in
+ * hot areas: they start a stream after fewer frames. It doesn't depend on the shape of
+ * the drawables, so it also catches content that is updated by many small tiles. The
+ * images of hot drawables are still compressed by their graduality, see
+ * red_compress_image. */
+static inline void red_update_hot_areas(RedWorker *worker, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+
+    if (worker->streaming_video == STREAM_VIDEO_OFF ||
+        !is_primary_surface(worker, drawable->surface_id)) {
+        return;
+    }
+    hot_areas_add_update(&worker->hot_areas, &red_drawable->bbox, drawable->creation_time);
+    drawable->hot = hot_areas_rect_is_hot(&worker->hot_areas, &red_drawable->bbox,
+                                          drawable->creation_time);
+#ifdef RED_STATISTICS
+    stat_set_counter(worker->hot_cells_counter,
+                     hot_areas_get_num_hot_cells(&worker->hot_areas));
+#endif
+}
+
 static inline void red_process_drawable(RedWorker *worker, RedDrawable *red_drawable,
                                         uint32_t group_id)
 {
@@ -4196,6 +4429,8 @@ static inline void red_process_drawable(RedWorker *worker, RedDrawable *red_draw
         goto cleanup;
     }
 
+    red_update_hot_areas(worker, drawable);
+
     if (!red_handle_self_bitmap(worker, drawable)) {
         goto cleanup;
     }
@@ -4351,145 +4586,444 @@ static void localize_mask(RedWorker *worker, SpiceQMask *mask, SpiceImage *image
     }
 }
 
-static void red_draw_qxl_drawable(RedWorker *worker, Drawable *drawable)
+static inline int region_touches_rect(QRegion *rgn, const SpiceRect *rect)
 {
-    RedSurface *surface;
-    SpiceCanvas *canvas;
-    SpiceClip clip = drawable->red_drawable->clip;
+    pixman_box32_t box = {rect->left, rect->top, rect->right, rect->bottom};
 
-    surface = &worker->surfaces[drawable->surface_id];
-    canvas = surface->context.canvas;
+    return pixman_region32_contains_rectangle(rgn, &box) != PIXMAN_REGION_OUT;
+}
 
-    image_cache_aging(&worker->image_cache);
+/* A drawing operation with its images localized, see render_op_init. It can be drawn
+ * by render_op_draw on any canvas of the surface, e.g. by a render thread. */
+typedef struct RenderOp {
+    Drawable *drawable;
+    union RedDrawableOp u;
+    SpiceImage images[3];
+} RenderOp;
+
+/* an operation that is drawn by a render thread, together with the independent
+ * operations of the same batch (see red_draw_drawable_async) */
+typedef struct RenderBatchItem {
+    RedRenderJob job;
+    RingItem link;
+    RedSurface *surface;
+    RenderOp op;
+} RenderBatchItem;
 
-    worker->preload_group_id = drawable->group_id;
+/* a horizontal band of a large operation (see red_draw_tiled) */
+typedef struct RenderTile {
+    RedRenderJob job;
+    RedSurface *surface;
+    RenderOp *op;
+    SpiceClip clip;
+} RenderTile;
 
-    region_add(&surface->draw_dirty_region, &drawable->red_drawable->bbox);
+static void render_op_init(RedWorker *worker, RenderOp *op, Drawable *drawable)
+{
+    op->drawable = drawable;
+    op->u = drawable->red_drawable->u;
 
     switch (drawable->red_drawable->type) {
-    case QXL_DRAW_FILL: {
-        SpiceFill fill = drawable->red_drawable->u.fill;
-        SpiceImage img1, img2;
-        localize_brush(worker, &fill.brush, &img1);
-        localize_mask(worker, &fill.mask, &img2);
-        canvas->ops->draw_fill(canvas, &drawable->red_drawable->bbox,
-                               &clip, &fill);
-        break;
-    }
-    case QXL_DRAW_OPAQUE: {
-        SpiceOpaque opaque = drawable->red_drawable->u.opaque;
-        SpiceImage img1, img2, img3;
-        localize_brush(worker, &opaque.brush, &img1);
-        localize_bitmap(worker, &opaque.src_bitmap, &img2, drawable);
-        localize_mask(worker, &opaque.mask, &img3);
-        canvas->ops->draw_opaque(canvas, &drawable->red_drawable->bbox, &clip, &opaque);
-        break;
-    }
-    case QXL_DRAW_COPY: {
-        SpiceCopy copy = drawable->red_drawable->u.copy;
-        SpiceImage img1, img2;
-        localize_bitmap(worker, &copy.src_bitmap, &img1, drawable);
-        localize_mask(worker, &copy.mask, &img2);
-        canvas->ops->draw_copy(canvas, &drawable->red_drawable->bbox,
-                               &clip, &copy);
-        break;
-    }
-    case QXL_DRAW_TRANSPARENT: {
-        SpiceTransparent transparent = drawable->red_drawable->u.transparent;
-        SpiceImage img1;
-        localize_bitmap(worker, &transparent.src_bitmap, &img1, drawable);
-        canvas->ops->draw_transparent(canvas,
-                                      &drawable->red_drawable->bbox, &clip, &transparent);
-        break;
-    }
-    case QXL_DRAW_ALPHA_BLEND: {
-        SpiceAlphaBlend alpha_blend = drawable->red_drawable->u.alpha_blend;
-        SpiceImage img1;
-        localize_bitmap(worker, &alpha_blend.src_bitmap, &img1, drawable);
-        canvas->ops->draw_alpha_blend(canvas,
-                                      &drawable->red_drawable->bbox, &clip, &alpha_blend);
-        break;
-    }
-    case QXL_COPY_BITS: {
-        canvas->ops->copy_bits(canvas, &drawable->red_drawable->bbox,
-                               &clip, &drawable->red_drawable->u.copy_bits.src_pos);
-        break;
-    }
-    case QXL_DRAW_BLEND: {
-        SpiceBlend blend = drawable->red_drawable->u.blend;
-        SpiceImage img1, img2;
-        localize_bitmap(worker, &blend.src_bitmap, &img1, drawable);
-        localize_mask(worker, &blend.mask, &img2);
-        canvas->ops->draw_blend(canvas, &drawable->red_drawable->bbox,
-                                &clip, &blend);
-        break;
-    }
-    case QXL_DRAW_BLACKNESS: {
-        SpiceBlackness blackness = drawable->red_drawable->u.blackness;
-        SpiceImage img1;
-        localize_mask(worker, &blackness.mask, &img1);
-        canvas->ops->draw_blackness(canvas,
-                                    &drawable->red_drawable->bbox, &clip, &blackness);
-        break;
-    }
-    case QXL_DRAW_WHITENESS: {
-        SpiceWhiteness whiteness = drawable->red_drawable->u.whiteness;
-        SpiceImage img1;
-        localize_mask(worker, &whiteness.mask, &img1);
-        canvas->ops->draw_whiteness(canvas,
-                                    &drawable->red_drawable->bbox, &clip, &whiteness);
-        break;
-    }
-    case QXL_DRAW_INVERS: {
-        SpiceInvers invers = drawable->red_drawable->u.invers;
-        SpiceImage img1;
-        localize_mask(worker, &invers.mask, &img1);
-        canvas->ops->draw_invers(canvas,
-                                 &drawable->red_drawable->bbox, &clip, &invers);
-        break;
-    }
-    case QXL_DRAW_ROP3: {
-        SpiceRop3 rop3 = drawable->red_drawable->u.rop3;
-        SpiceImage img1, img2, img3;
-        localize_brush(worker, &rop3.brush, &img1);
-        localize_bitmap(worker, &rop3.src_bitmap, &img2, drawable);
-        localize_mask(worker, &rop3.mask, &img3);
-        canvas->ops->draw_rop3(canvas, &drawable->red_drawable->bbox,
-                               &clip, &rop3);
-        break;
-    }
-    case QXL_DRAW_COMPOSITE: {
-        SpiceComposite composite = drawable->red_drawable->u.composite;
-        SpiceImage src, mask;
-        localize_bitmap(worker, &composite.src_bitmap, &src, drawable);
-        if (composite.mask_bitmap)
-            localize_bitmap(worker, &composite.mask_bitmap, &mask, drawable);
-        canvas->ops->draw_composite(canvas, &drawable->red_drawable->bbox,
-                                    &clip, &composite);
-        break;
-    }
-    case QXL_DRAW_STROKE: {
-        SpiceStroke stroke = drawable->red_drawable->u.stroke;
-        SpiceImage img1;
-        localize_brush(worker, &stroke.brush, &img1);
-        canvas->ops->draw_stroke(canvas,
-                                 &drawable->red_drawable->bbox, &clip, &stroke);
+    case QXL_DRAW_FILL:
+        localize_brush(worker, &op->u.fill.brush, &op->images[0]);
+        localize_mask(worker, &op->u.fill.mask, &op->images[1]);
         break;
-    }
-    case QXL_DRAW_TEXT: {
-        SpiceText text = drawable->red_drawable->u.text;
-        SpiceImage img1, img2;
-        localize_brush(worker, &text.fore_brush, &img1);
-        localize_brush(worker, &text.back_brush, &img2);
-        canvas->ops->draw_text(canvas, &drawable->red_drawable->bbox,
-                               &clip, &text);
+    case QXL_DRAW_OPAQUE:
+        localize_brush(worker, &op->u.opaque.brush, &op->images[0]);
+        localize_bitmap(worker, &op->u.opaque.src_bitmap, &op->images[1], drawable);
+        localize_mask(worker, &op->u.opaque.mask, &op->images[2]);
+        break;
+    case QXL_DRAW_COPY:
+        localize_bitmap(worker, &op->u.copy.src_bitmap, &op->images[0], drawable);
+        localize_mask(worker, &op->u.copy.mask, &op->images[1]);
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        localize_bitmap(worker, &op->u.transparent.src_bitmap, &op->images[0], drawable);
+        break;
+    case QXL_DRAW_ALPHA_BLEND:
+        localize_bitmap(worker, &op->u.alpha_blend.src_bitmap, &op->images[0], drawable);
+        break;
+    case QXL_COPY_BITS:
+        break;
+    case QXL_DRAW_BLEND:
+        localize_bitmap(worker, &op->u.blend.src_bitmap, &op->images[0], drawable);
+        localize_mask(worker, &op->u.blend.mask, &op->images[1]);
+        break;
+    case QXL_DRAW_BLACKNESS:
+        localize_mask(worker, &op->u.blackness.mask, &op->images[0]);
+        break;
+    case QXL_DRAW_WHITENESS:
+        localize_mask(worker, &op->u.whiteness.mask, &op->images[0]);
+        break;
+    case QXL_DRAW_INVERS:
+        localize_mask(worker, &op->u.invers.mask, &op->images[0]);
+        break;
+    case QXL_DRAW_ROP3:
+        localize_brush(worker, &op->u.rop3.brush, &op->images[0]);
+        localize_bitmap(worker, &op->u.rop3.src_bitmap, &op->images[1], drawable);
+        localize_mask(worker, &op->u.rop3.mask, &op->images[2]);
+        break;
+    case QXL_DRAW_COMPOSITE:
+        localize_bitmap(worker, &op->u.composite.src_bitmap, &op->images[0], drawable);
+        if (op->u.composite.mask_bitmap)
+            localize_bitmap(worker, &op->u.composite.mask_bitmap, &op->images[1], drawable);
+        break;
+    case QXL_DRAW_STROKE:
+        localize_brush(worker, &op->u.stroke.brush, &op->images[0]);
+        break;
+    case QXL_DRAW_TEXT:
+        localize_brush(worker, &op->u.text.fore_brush, &op->images[0]);
+        localize_brush(worker, &op->u.text.back_brush, &op->images[1]);
+        break;
+    default:
         break;
     }
+}
+
+static void render_op_draw(RenderOp *op, SpiceCanvas *canvas, SpiceClip *clip)
+{
+    RedDrawable *red_drawable = op->drawable->red_drawable;
+    SpiceRect *bbox = &red_drawable->bbox;
+
+    switch (red_drawable->type) {
+    case QXL_DRAW_FILL:
+        canvas->ops->draw_fill(canvas, bbox, clip, &op->u.fill);
+        break;
+    case QXL_DRAW_OPAQUE:
+        canvas->ops->draw_opaque(canvas, bbox, clip, &op->u.opaque);
+        break;
+    case QXL_DRAW_COPY:
+        canvas->ops->draw_copy(canvas, bbox, clip, &op->u.copy);
+        break;
+    case QXL_DRAW_TRANSPARENT:
+        canvas->ops->draw_transparent(canvas, bbox, clip, &op->u.transparent);
+        break;
+    case QXL_DRAW_ALPHA_BLEND:
+        canvas->ops->draw_alpha_blend(canvas, bbox, clip, &op->u.alpha_blend);
+        break;
+    case QXL_COPY_BITS:
+        canvas->ops->copy_bits(canvas, bbox, clip, &op->u.copy_bits.src_pos);
+        break;
+    case QXL_DRAW_BLEND:
+        canvas->ops->draw_blend(canvas, bbox, clip, &op->u.blend);
+        break;
+    case QXL_DRAW_BLACKNESS:
+        canvas->ops->draw_blackness(canvas, bbox, clip, &op->u.blackness);
+        break;
+    case QXL_DRAW_WHITENESS:
+        canvas->ops->draw_whiteness(canvas, bbox, clip, &op->u.whiteness);
+        break;
+    case QXL_DRAW_INVERS:
+        canvas->ops->draw_invers(canvas, bbox, clip, &op->u.invers);
+        break;
+    case QXL_DRAW_ROP3:
+        canvas->ops->draw_rop3(canvas, bbox, clip, &op->u.rop3);
+        break;
+    case QXL_DRAW_COMPOSITE:
+        canvas->ops->draw_composite(canvas, bbox, clip, &op->u.composite);
+        break;
+    case QXL_DRAW_STROKE:
+        canvas->ops->draw_stroke(canvas, bbox, clip, &op->u.stroke);
+        break;
+    case QXL_DRAW_TEXT:
+        canvas->ops->draw_text(canvas, bbox, clip, &op->u.text);
+        break;
     default:
         spice_warning("invalid type");
     }
 }
 
+/* the canvases of the render threads draw on the memory of the surface, each with
+ * its own decoders, so that they can draw independent operations in parallel */
+static void red_surface_create_render_canvases(RedWorker *worker, RedSurface *surface)
+{
+    DrawContext *context = &surface->context;
+    int i;
+
+    for (i = 0; i <= red_render_pool_get_num_threads(worker->render_pool); i++) {
+        if (context->render_canvases[i]) {
+            continue;
+        }
+        context->render_canvases[i] = canvas_create_for_data(context->width, context->height,
+                                                             context->format, context->line_0,
+                                                             context->stride,
+                                                             &worker->image_cache.base,
+                                                             &worker->image_surfaces,
+                                                             NULL, NULL, NULL);
+    }
+}
+
+static void red_surface_destroy_render_canvases(RedSurface *surface)
+{
+    int i;
+
+    for (i = 0; i <= RED_RENDER_MAX_THREADS; i++) {
+        if (surface->context.render_canvases[i]) {
+            surface->context.render_canvases[i]->ops->destroy(surface->context.render_canvases[i]);
+            surface->context.render_canvases[i] = NULL;
+        }
+    }
+}
+
+/* the render threads may draw neighbour pixels at the same time, which mustn't share
+ * bytes */
+static inline int red_surface_can_render_parallel(RedWorker *worker, RedSurface *surface)
+{
+    return worker->render_pool && surface->context.canvas_draws_on_surface &&
+           SPICE_SURFACE_FMT_DEPTH(surface->context.format) >= 16;
+}
+
+/* the image cache is not thread safe, and the images that depend on it are drawn
+ * by the worker. localize_bitmap leaves the images that it doesn't copy (e.g. guest
+ * bitmaps with SPICE_IMAGE_FLAGS_CACHE_ME) in the guest memory, so the images that
+ * the operation really draws are checked, not only its image stores. */
+static inline int image_is_render_safe(SpiceImage *image)
+{
+    return !image || (image->descriptor.type != SPICE_IMAGE_TYPE_FROM_CACHE &&
+                      !(image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_ME));
+}
+
+static inline int brush_is_render_safe(SpiceBrush *brush)
+{
+    return brush->type != SPICE_BRUSH_TYPE_PATTERN || image_is_render_safe(brush->u.pattern.pat);
+}
+
+static int render_op_is_render_safe(RenderOp *op)
+{
+    union RedDrawableOp *u = &op->u;
+
+    switch (op->drawable->red_drawable->type) {
+    case QXL_DRAW_FILL:
+        return brush_is_render_safe(&u->fill.brush) && image_is_render_safe(u->fill.mask.bitmap);
+    case QXL_DRAW_OPAQUE:
+        return brush_is_render_safe(&u->opaque.brush) &&
+               image_is_render_safe(u->opaque.src_bitmap) &&
+               image_is_render_safe(u->opaque.mask.bitmap);
+    case QXL_DRAW_COPY:
+        return image_is_render_safe(u->copy.src_bitmap) &&
+               image_is_render_safe(u->copy.mask.bitmap);
+    case QXL_DRAW_TRANSPARENT:
+        return image_is_render_safe(u->transparent.src_bitmap);
+    case QXL_DRAW_ALPHA_BLEND:
+        return image_is_render_safe(u->alpha_blend.src_bitmap);
+    case QXL_DRAW_BLEND:
+        return image_is_render_safe(u->blend.src_bitmap) &&
+               image_is_render_safe(u->blend.mask.bitmap);
+    case QXL_DRAW_BLACKNESS:
+        return image_is_render_safe(u->blackness.mask.bitmap);
+    case QXL_DRAW_WHITENESS:
+        return image_is_render_safe(u->whiteness.mask.bitmap);
+    case QXL_DRAW_INVERS:
+        return image_is_render_safe(u->invers.mask.bitmap);
+    case QXL_DRAW_ROP3:
+        return brush_is_render_safe(&u->rop3.brush) &&
+               image_is_render_safe(u->rop3.src_bitmap) &&
+               image_is_render_safe(u->rop3.mask.bitmap);
+    case QXL_DRAW_COMPOSITE:
+        return image_is_render_safe(u->composite.src_bitmap) &&
+               image_is_render_safe(u->composite.mask_bitmap);
+    case QXL_DRAW_STROKE:
+        return brush_is_render_safe(&u->stroke.brush);
+    case QXL_DRAW_TEXT:
+        return brush_is_render_safe(&u->text.fore_brush) &&
+               brush_is_render_safe(&u->text.back_brush);
+    default:
+        return TRUE;
+    }
+}
+
+/* returns TRUE if each band of the operation can be drawn separately. The images are
+ * decoded by each canvas that draws them, so only operations without images are
+ * split */
+static int red_drawable_can_tile(RedWorker *worker, RedSurface *surface, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceRect *bbox = &red_drawable->bbox;
+
+    if (!red_surface_can_render_parallel(worker, surface) || !red_render_rect_can_tile(bbox)) {
+        return FALSE;
+    }
+
+    switch (red_drawable->type) {
+    case QXL_DRAW_FILL:
+        return red_drawable->u.fill.brush.type != SPICE_BRUSH_TYPE_PATTERN &&
+               !red_drawable->u.fill.mask.bitmap;
+    case QXL_DRAW_BLACKNESS:
+        return !red_drawable->u.blackness.mask.bitmap;
+    case QXL_DRAW_WHITENESS:
+        return !red_drawable->u.whiteness.mask.bitmap;
+    case QXL_DRAW_INVERS:
+        return !red_drawable->u.invers.mask.bitmap;
+    default:
+        return FALSE;
+    }
+}
+
+static SpiceClipRects *clip_rects_intersect_band(SpiceClip *clip, SpiceRect *band)
+{
+    SpiceClipRects *rects;
+    uint32_t i;
+
+    if (clip->type == SPICE_CLIP_TYPE_NONE) {
+        rects = spice_malloc(sizeof(SpiceClipRects) + sizeof(SpiceRect));
+        rects->num_rects = 1;
+        rects->rects[0] = *band;
+        return rects;
+    }
+
+    spice_assert(clip->type == SPICE_CLIP_TYPE_RECTS);
+    rects = spice_malloc(sizeof(SpiceClipRects) + clip->rects->num_rects * sizeof(SpiceRect));
+    rects->num_rects = 0;
+    for (i = 0; i < clip->rects->num_rects; i++) {
+        SpiceRect rect = clip->rects->rects[i];
+
+        rect.top = MAX(rect.top, band->top);
+        rect.bottom = MIN(rect.bottom, band->bottom);
+        if (rect.top < rect.bottom && rect.left < rect.right) {
+            rects->rects[rects->num_rects++] = rect;
+        }
+    }
+    return rects;
+}
+
+static void red_render_tile(RedRenderJob *job, int thread_index)
+{
+    RenderTile *tile = SPICE_CONTAINEROF(job, RenderTile, job);
+
+    render_op_draw(tile->op, tile->surface->context.render_canvases[thread_index], &tile->clip);
+}
+
+/* draws a large operation by splitting it to horizontal bands (see
+ * red_render_pool_split_bands). The bands don't overlap, so they can be drawn in
+ * any order. */
+static void red_draw_tiled(RedWorker *worker, RedSurface *surface, RenderOp *op)
+{
+    RedDrawable *red_drawable = op->drawable->red_drawable;
+    RenderTile tiles[RED_RENDER_MAX_THREADS + 1];
+    SpiceRect bands[RED_RENDER_MAX_THREADS + 1];
+    int num_tiles;
+    int i;
+
+    red_surface_create_render_canvases(worker, surface);
+    num_tiles = red_render_pool_split_bands(worker->render_pool, &red_drawable->bbox, bands);
+    for (i = 0; i < num_tiles; i++) {
+        red_render_job_init(&tiles[i].job, red_render_tile);
+        tiles[i].surface = surface;
+        tiles[i].op = op;
+        tiles[i].clip.type = SPICE_CLIP_TYPE_RECTS;
+        tiles[i].clip.rects = clip_rects_intersect_band(&red_drawable->clip, &bands[i]);
+        red_render_pool_add(worker->render_pool, &tiles[i].job);
+    }
+    red_render_pool_wait(worker->render_pool);
+
+    for (i = 0; i < num_tiles; i++) {
+        free(tiles[i].clip.rects);
+    }
+#ifdef RED_STATISTICS
+    stat_inc_counter(worker->render_tiled_counter, 1);
+#endif
+}
+
+/* waits for the operations of the current batch, see red_draw_drawable_async */
+static void red_render_wait(RedWorker *worker)
+{
+    RingItem *link;
+
+    if (ring_is_empty(&worker->render_batch)) {
+        return;
+    }
+    red_render_pool_wait(worker->render_pool);
+    while ((link = ring_get_head(&worker->render_batch))) {
+        RenderBatchItem *item = SPICE_CONTAINEROF(link, RenderBatchItem, link);
+
+        ring_remove(link);
+        release_drawable(worker, item->op.drawable);
+        free(item);
+    }
+}
+
+static void red_render_batch_item(RedRenderJob *job, int thread_index)
+{
+    RenderBatchItem *item = SPICE_CONTAINEROF(job, RenderBatchItem, job);
+
+    render_op_draw(&item->op, item->surface->context.render_canvases[thread_index],
+                   &item->op.drawable->red_drawable->clip);
+}
+
+static void red_prepare_draw(RedWorker *worker, RedSurface *surface, Drawable *drawable)
+{
+    image_cache_aging(&worker->image_cache);
+
+    worker->preload_group_id = drawable->group_id;
+
+    region_add(&surface->draw_dirty_region, &drawable->red_drawable->bbox);
+}
+
+static void red_draw_qxl_drawable(RedWorker *worker, Drawable *drawable)
+{
+    RedSurface *surface;
+    RenderOp op;
+
+    red_render_wait(worker);
+    surface = &worker->surfaces[drawable->surface_id];
+    red_prepare_draw(worker, surface, drawable);
+    render_op_init(worker, &op, drawable);
+    if (red_drawable_can_tile(worker, surface, drawable)) {
+        red_draw_tiled(worker, surface, &op);
+        return;
+    }
+    render_op_draw(&op, surface->context.canvas, &drawable->red_drawable->clip);
+}
+
+/* Queues the drawable to a render thread, in the current batch of independent
+ * drawables. Returns FALSE if it can't be drawn by a render thread: it reads from
+ * surfaces, which may be drawn by the batch, or it uses the image cache.
+ * A drawable that overlaps the batch starts a new batch, so the drawables that
+ * overlap are still drawn in order. */
+static int red_draw_drawable_async(RedWorker *worker, Drawable *drawable)
+{
+    RedSurface *surface = &worker->surfaces[drawable->surface_id];
+    RedDrawable *red_drawable = drawable->red_drawable;
+    RenderBatchItem *item;
+    int x;
+
+    if (!red_surface_can_render_parallel(worker, surface) ||
+        red_drawable_can_tile(worker, surface, drawable) ||
+        red_drawable->type == QXL_COPY_BITS) {
+        return FALSE;
+    }
+    for (x = 0; x < 3; ++x) {
+        if (drawable->surfaces_dest[x] != -1) {
+            return FALSE;
+        }
+    }
+
+    if (red_render_pool_batch_touches(worker->render_pool, &red_drawable->bbox)) {
+        red_render_wait(worker);
+    }
+
+    red_surface_create_render_canvases(worker, surface);
+    red_prepare_draw(worker, surface, drawable);
+    item = spice_new0(RenderBatchItem, 1);
+    render_op_init(worker, &item->op, drawable);
+    if (!render_op_is_render_safe(&item->op)) {
+        red_render_wait(worker);
+        render_op_draw(&item->op, surface->context.canvas, &red_drawable->clip);
+        free(item);
+        return TRUE;
+    }
+
+    red_render_job_init(&item->job, red_render_batch_item);
+    item->surface = surface;
+    drawable->refs++;
+    ring_add(&worker->render_batch, &item->link);
+    red_render_pool_add_area(worker->render_pool, &item->job, &red_drawable->bbox);
+#ifdef RED_STATISTICS
+    stat_inc_counter(worker->render_async_counter, 1);
+#endif
+    return TRUE;
+}
+
 #ifndef DRAW_ALL
 
 static void red_draw_drawable(RedWorker *worker, Drawable *drawable)
@@ -4703,14 +5237,74 @@ static void red_update_area_till(RedWorker *worker, const SpiceRect *area, int s
     validate_area(worker, area, surface_id);
 }
 
+/* the area that a copy bits drawable reads from its own surface */
+static inline void copy_bits_src_area(Drawable *drawable, SpiceRect *src_area)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+
+    src_area->left = red_drawable->u.copy_bits.src_pos.x;
+    src_area->top = red_drawable->u.copy_bits.src_pos.y;
+    src_area->right = src_area->left + red_drawable->bbox.right - red_drawable->bbox.left;
+    src_area->bottom = src_area->top + red_drawable->bbox.bottom - red_drawable->bbox.top;
+}
+
+/* returns TRUE if the drawable paints, or reads from its own surface, pixels in rgn */
+static int red_drawable_touches_region(Drawable *drawable, QRegion *rgn)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceRect src_area;
+    int x;
+
+    if (region_touches_rect(rgn, &red_drawable->bbox)) {
+        return TRUE;
+    }
+    if (has_shadow(red_drawable)) {
+        copy_bits_src_area(drawable, &src_area);
+        if (region_touches_rect(rgn, &src_area)) {
+            return TRUE;
+        }
+    }
+    for (x = 0; x < 3; ++x) {
+        if (drawable->surfaces_dest[x] == drawable->surface_id &&
+            region_touches_rect(rgn, &red_drawable->surfaces_rects[x])) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static void red_drawable_add_touched_area(Drawable *drawable, QRegion *rgn)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceRect src_area;
+    int x;
+
+    region_add(rgn, &red_drawable->bbox);
+    if (has_shadow(red_drawable)) {
+        copy_bits_src_area(drawable, &src_area);
+        region_add(rgn, &src_area);
+    }
+    for (x = 0; x < 3; ++x) {
+        if (drawable->surfaces_dest[x] == drawable->surface_id) {
+            region_add(rgn, &red_drawable->surfaces_rects[x]);
+        }
+    }
+}
+
 static void red_update_area(RedWorker *worker, const SpiceRect *area, int surface_id)
 {
     RedSurface *surface;
     Ring *ring;
     RingItem *ring_item;
+    Ring items;
     QRegion rgn;
     Drawable *last;
     Drawable *now;
+    uint32_t num_drawn = 0;
+    uint32_t num_deferred = 0;
+#ifdef RED_STATISTICS
+    uint64_t start_time = red_now();
+#endif
 #ifdef ACYCLIC_SURFACE_DEBUG
     int gn;
 #endif
@@ -4740,31 +5334,67 @@ static void red_update_area(RedWorker *worker, const SpiceRect *area, int surfac
             break;
         }
     }
-    region_destroy(&rgn);
 
     if (!last) {
+        region_destroy(&rgn);
         validate_area(worker, area, surface_id);
         return;
     }
 
+    /* Collect only the drawables that the area depends on, instead of all the drawables
+     * that are older than 'last'. Going from 'last' to the oldest drawable, a drawable is
+     * needed if it paints or reads pixels that a needed newer drawable paints or reads
+     * (rgn). The rest commute with the needed drawables, and stay in the tree. */
+    ring_init(&items);
+    ring_item = &last->surface_list_link;
     do {
+        now = SPICE_CONTAINEROF(ring_item, Drawable, surface_list_link);
+        if (now == last || red_drawable_touches_region(now, &rgn)) {
+            red_drawable_add_touched_area(now, &rgn);
+            /* red_draw_drawable can re-enter through red_flush_source_surfaces. A drawable
+             * that an outer call already collected is drawn by it */
+            if (!ring_item_is_linked(&now->collect_link)) {
+                now->refs++;
+                /* add to head, so that the oldest drawable is first */
+                ring_add(&items, &now->collect_link);
+                num_drawn++;
+            }
+        } else {
+            num_deferred++;
+        }
+    } while ((ring_item = ring_next(ring, ring_item)));
+    region_destroy(&rgn);
+
+    while ((ring_item = ring_get_head(&items))) {
         Container *container;
 
-        ring_item = ring_get_tail(&surface->current_list);
-        now = SPICE_CONTAINEROF(ring_item, Drawable, surface_list_link);
-        now->refs++;
-        container = now->tree_item.base.container;
-        current_remove_drawable(worker, now);
-        container_cleanup(worker, container);
-        red_draw_drawable(worker, now);
+        now = SPICE_CONTAINEROF(ring_item, Drawable, collect_link);
+        ring_remove(ring_item);
+        /* drawing the source surfaces of a drawable may have already rendered it */
+        if (ring_item_is_linked(&now->surface_list_link)) {
+            container = now->tree_item.base.container;
+            current_remove_drawable(worker, now);
+            container_cleanup(worker, container);
+            /* independent drawables are drawn in parallel by the render threads */
+            if (!red_draw_drawable_async(worker, now)) {
+                red_render_wait(worker);
+                red_draw_drawable(worker, now);
+            }
+        }
         release_drawable(worker, now);
 #ifdef ACYCLIC_SURFACE_DEBUG
         if (gn != surface->current_gn) {
             spice_error("cyclic surface dependencies");
         }
 #endif
-    } while (now != last);
+    }
+    red_render_wait(worker);
     validate_area(worker, area, surface_id);
+#ifdef RED_STATISTICS
+    stat_inc_counter(worker->update_area_drawn_counter, num_drawn);
+    stat_inc_counter(worker->update_area_deferred_counter, num_deferred);
+    stat_histogram_add(&worker->update_area_latency, (red_now() - start_time) / 1000);
+#endif
 }
 
 #endif
@@ -4844,11 +5474,38 @@ static CursorItem *get_cursor_item(RedWorker *worker, RedCursorCmd *cmd, uint32_
 
     cursor_item->refs = 1;
     cursor_item->group_id = group_id;
+    cursor_item->creation_time = red_now();
     cursor_item->red_cursor = cmd;
 
     return cursor_item;
 }
 
+/* Guests often recreate identical shapes with new unique ids (e.g. the frames of an
+ * animated busy cursor), or don't set a unique id at all. The shape is identified by its
+ * content instead, so that the client cache can be used for them. */
+static uint64_t red_cursor_hash(SpiceCursor *cursor)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t word;
+    uint8_t *data = cursor->data;
+    uint32_t len = cursor->data_size;
+
+    word = ((uint64_t)cursor->header.type << 48) | ((uint64_t)cursor->header.width << 32) |
+           ((uint64_t)cursor->header.height << 16) | cursor->header.hot_spot_x;
+    hash = (hash ^ word) * 1099511628211ULL;
+    hash = (hash ^ cursor->header.hot_spot_y) * 1099511628211ULL;
+    for (; len >= sizeof(word); len -= sizeof(word), data += sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 29;
+    }
+    for (; len > 0; len--, data++) {
+        hash = (hash ^ *data) * 1099511628211ULL;
+    }
+    /* 0 means no caching */
+    return hash ? hash : 1;
+}
+
 static CursorPipeItem *ref_cursor_pipe_item(CursorPipeItem *item)
 {
     spice_assert(item);
@@ -4890,6 +5547,7 @@ static void qxl_process_cursor(RedWorker *worker, RedCursorCmd *cursor_cmd, uint
 
     switch (cursor_cmd->type) {
     case QXL_CURSOR_SET:
+        cursor_cmd->u.set.shape.header.unique = red_cursor_hash(&cursor_cmd->u.set.shape);
         worker->cursor_visible = cursor_cmd->u.set.visible;
         red_set_cursor(worker, cursor_item);
         break;
@@ -5005,6 +5663,7 @@ static int red_process_commands(RedWorker *worker, uint32_t max_pipe_size, int *
             continue;
         }
         stat_inc_counter(worker->command_counter, 1);
+        red_trace_cmd_fetch(worker->id, ext_cmd.cmd.type, ext_cmd.cmd.data);
         worker->repoll_cmd_ring = 0;
         switch (ext_cmd.cmd.type) {
         case QXL_CMD_DRAW: {
@@ -6009,6 +6668,10 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
 #ifdef COMPRESS_STAT
     stat_time_t start_time = stat_now();
 #endif
+#ifdef RED_STATISTICS
+    uint64_t codec_start = red_now();
+#endif
+    red_trace_compress_start(CODEC_STAT_GLZ);
     spice_assert(bitmap_fmt_is_rgb(src->format));
     GlzData *glz_data = &dcc->glz_data;
     ZlibData *zlib_data;
@@ -6045,6 +6708,9 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
                           &glz_drawable_instance->glz_instance);
 
     stat_compress_add(&display_channel->glz_stat, start_time, src->stride * src->y, glz_size);
+    display_channel_codec_stat_add(display_channel, CODEC_STAT_GLZ, codec_start,
+                                   src->stride * src->y, glz_size);
+    red_trace_compress_end(CODEC_STAT_GLZ, src->stride * src->y, glz_size);
 
     if (!display_channel->enable_zlib_glz_wrap || (glz_size < MIN_GLZ_SIZE_FOR_ZLIB)) {
         goto glz;
@@ -6052,6 +6718,10 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
 #ifdef COMPRESS_STAT
     start_time = stat_now();
 #endif
+#ifdef RED_STATISTICS
+    codec_start = red_now();
+#endif
+    red_trace_compress_start(CODEC_STAT_ZLIB_GLZ);
     zlib_data = &worker->zlib_data;
 
     zlib_data->data.bufs_tail = red_display_alloc_compress_buf(dcc);
@@ -6090,6 +6760,9 @@ static inline int red_glz_compress_image(DisplayChannelClient *dcc,
     o_comp_data->comp_buf_size = zlib_size;
 
     stat_compress_add(&display_channel->zlib_glz_stat, start_time, glz_size, zlib_size);
+    display_channel_codec_stat_add(display_channel, CODEC_STAT_ZLIB_GLZ, codec_start,
+                                   glz_size, zlib_size);
+    red_trace_compress_end(CODEC_STAT_ZLIB_GLZ, glz_size, zlib_size);
     return TRUE;
 glz:
     dest->descriptor.type = SPICE_IMAGE_TYPE_GLZ_RGB;
@@ -6115,6 +6788,10 @@ static inline int red_lz_compress_image(DisplayChannelClient *dcc,
 #ifdef COMPRESS_STAT
     stat_time_t start_time = stat_now();
 #endif
+#ifdef RED_STATISTICS
+    uint64_t codec_start = red_now();
+#endif
+    red_trace_compress_start(CODEC_STAT_LZ);
 
     lz_data->data.bufs_tail = red_display_alloc_compress_buf(dcc);
     lz_data->data.bufs_head = lz_data->data.bufs_tail;
@@ -6176,6 +6853,9 @@ static inline int red_lz_compress_image(DisplayChannelClient *dcc,
 
     stat_compress_add(&display_channel->lz_stat, start_time, src->stride * src->y,
                       o_comp_data->comp_buf_size);
+    display_channel_codec_stat_add(display_channel, CODEC_STAT_LZ, codec_start,
+                                   src->stride * src->y, o_comp_data->comp_buf_size);
+    red_trace_compress_end(CODEC_STAT_LZ, src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 
@@ -6201,6 +6881,10 @@ static int red_jpeg_compress_image(DisplayChannelClient *dcc, SpiceImage *dest,
 #ifdef COMPRESS_STAT
     stat_time_t start_time = stat_now();
 #endif
+#ifdef RED_STATISTICS
+    uint64_t codec_start = red_now();
+#endif
+    red_trace_compress_start(CODEC_STAT_JPEG);
     switch (src->format) {
     case SPICE_BITMAP_FMT_16BIT:
         jpeg_in_type = JPEG_IMAGE_TYPE_RGB16;
@@ -6275,6 +6959,9 @@ static int red_jpeg_compress_image(DisplayChannelClient *dcc, SpiceImage *dest,
 
         stat_compress_add(&display_channel->jpeg_stat, start_time, src->stride * src->y,
                           o_comp_data->comp_buf_size);
+        display_channel_codec_stat_add(display_channel, CODEC_STAT_JPEG, codec_start,
+                                       src->stride * src->y, o_comp_data->comp_buf_size);
+        red_trace_compress_end(CODEC_STAT_JPEG, src->stride * src->y, o_comp_data->comp_buf_size);
         return TRUE;
     }
 
@@ -6318,6 +7005,9 @@ static int red_jpeg_compress_image(DisplayChannelClient *dcc, SpiceImage *dest,
     o_comp_data->is_lossy = TRUE;
     stat_compress_add(&display_channel->jpeg_alpha_stat, start_time, src->stride * src->y,
                       o_comp_data->comp_buf_size);
+    display_channel_codec_stat_add(display_channel, CODEC_STAT_JPEG_ALPHA, codec_start,
+                                   src->stride * src->y, o_comp_data->comp_buf_size);
+    red_trace_compress_end(CODEC_STAT_JPEG_ALPHA, src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 
@@ -6335,6 +7025,10 @@ static inline int red_quic_compress_image(DisplayChannelClient *dcc, SpiceImage
 #ifdef COMPRESS_STAT
     stat_time_t start_time = stat_now();
 #endif
+#ifdef RED_STATISTICS
+    uint64_t codec_start = red_now();
+#endif
+    red_trace_compress_start(CODEC_STAT_QUIC);
 
     switch (src->format) {
     case SPICE_BITMAP_FMT_32BIT:
@@ -6405,6 +7099,9 @@ static inline int red_quic_compress_image(DisplayChannelClient *dcc, SpiceImage
 
     stat_compress_add(&display_channel->quic_stat, start_time, src->stride * src->y,
                       o_comp_data->comp_buf_size);
+    display_channel_codec_stat_add(display_channel, CODEC_STAT_QUIC, codec_start,
+                                   src->stride * src->y, o_comp_data->comp_buf_size);
+    red_trace_compress_end(CODEC_STAT_QUIC, src->stride * src->y, o_comp_data->comp_buf_size);
     return TRUE;
 }
 
@@ -6473,10 +7170,20 @@ static inline int red_compress_image(DisplayChannelClient *dcc,
             (image_compression == SPICE_IMAGE_COMPRESS_AUTO_GLZ))) {
             // if we use lz for alpha, the stride can't be extra
             if (src->format != SPICE_BITMAP_FMT_RGBA || !_stride_is_extra(src)) {
+#ifdef RED_STATISTICS
+                if (drawable->hot) {
+                    stat_inc_counter(display_channel->common.worker->hot_area_hits_counter, 1);
+                }
+#endif
                 return red_jpeg_compress_image(dcc, dest,
                                                src, o_comp_data, drawable->group_id);
             }
         }
+#ifdef RED_STATISTICS
+        if (drawable->hot) {
+            stat_inc_counter(display_channel->common.worker->hot_area_misses_counter, 1);
+        }
+#endif
         return red_quic_compress_image(dcc, dest,
                                        src, o_comp_data, drawable->group_id);
     } else {
@@ -6734,6 +7441,10 @@ static void fill_attr(SpiceMarshaller *m, SpiceLineAttr *attr, uint32_t group_id
 static void fill_cursor(CursorChannelClient *ccc, SpiceCursor *red_cursor,
                         CursorItem *cursor, AddBufInfo *addbuf)
 {
+#ifdef RED_STATISTICS
+    CursorChannel *cursor_channel = SPICE_CONTAINEROF(ccc->common.base.channel, CursorChannel,
+                                                      common.base);
+#endif
     RedCursorCmd *cursor_cmd;
     addbuf->data = NULL;
 
@@ -6748,6 +7459,9 @@ static void fill_cursor(CursorChannelClient *ccc, SpiceCursor *red_cursor,
     if (red_cursor->header.unique) {
         if (red_cursor_cache_find(ccc, red_cursor->header.unique)) {
             red_cursor->flags |= SPICE_CURSOR_FLAGS_FROM_CACHE;
+#ifdef RED_STATISTICS
+            stat_inc_counter(cursor_channel->shape_cache_hits_counter, 1);
+#endif
             return;
         }
         if (red_cursor_cache_add(ccc, red_cursor->header.unique, 1)) {
@@ -6760,6 +7474,10 @@ static void fill_cursor(CursorChannelClient *ccc, SpiceCursor *red_cursor,
         addbuf->data = red_cursor->data;
         addbuf->size = red_cursor->data_size;
     }
+#ifdef RED_STATISTICS
+    stat_inc_counter(cursor_channel->shapes_counter, 1);
+    stat_inc_counter(cursor_channel->shape_bytes_counter, red_cursor->data_size);
+#endif
 }
 
 static inline void red_display_reset_send_data(DisplayChannelClient *dcc)
@@ -8376,6 +9094,149 @@ static int encode_frame(DisplayChannelClient *dcc, const SpiceRect *src,
     return TRUE;
 }
 
+/* Partial frames: when only a part of an unscaled stream changed since the last frame that
+ * was sent, only the bounding box of the macroblocks that changed is encoded, and it is sent
+ * as a sized frame that is destined to that part of the stream area. The blocks are compared
+ * by their hashes, in the order the lines are encoded. */
+#define STREAM_BLOCK_SIZE 16
+/* a full frame is sent at least once in this number of frames, for recovering from partial
+ * frames that the client dropped */
+#define STREAM_MAX_PARTIAL_FRAMES 30
+
+/* results of red_marshall_stream_data */
+enum {
+    STREAM_FRAME_NOT_STREAMED, /* the drawable should be sent as a regular draw */
+    STREAM_FRAME_SENT,
+    STREAM_FRAME_SKIPPED, /* dropped or unchanged, there is nothing to send */
+};
+
+static inline int red_stream_get_bytes_per_pixel(SpiceBitmapFmt format)
+{
+    switch (format) {
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA:
+        return 4;
+    case SPICE_BITMAP_FMT_24BIT:
+        return 3;
+    case SPICE_BITMAP_FMT_16BIT:
+        return 2;
+    default:
+        return 0;
+    }
+}
+
+static inline uint32_t red_stream_hash_line(uint32_t hash, const uint8_t *data, int len)
+{
+    uint32_t word;
+
+    for (; len >= (int)sizeof(word); len -= sizeof(word), data += sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ word) * 16777619;
+        hash ^= hash >> 15;
+    }
+    for (; len > 0; len--, data++) {
+        hash = (hash ^ *data) * 16777619;
+    }
+    return hash;
+}
+
+/* computes agent->new_block_hashes. Returns FALSE if the frame can't be sent partially. */
+static int red_stream_hash_frame(DisplayChannelClient *dcc, StreamAgent *agent,
+                                 Stream *stream, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable;
+    SpiceRect *src = &red_drawable->u.copy.src_area;
+    SpiceBitmap *image = &red_drawable->u.copy.src_bitmap->u.bitmap;
+    SpiceChunks *chunks = image->data;
+    size_t offset = 0;
+    int chunk = 0;
+    int blocks_width;
+    uint32_t num_blocks;
+    int bpp;
+    int i, x;
+
+    if (drawable->sized_stream ||
+        !red_channel_client_test_remote_cap(&dcc->common.base, SPICE_DISPLAY_CAP_SIZED_STREAM) ||
+        stream->width != red_drawable->bbox.right - red_drawable->bbox.left ||
+        stream->height != red_drawable->bbox.bottom - red_drawable->bbox.top ||
+        !(bpp = red_stream_get_bytes_per_pixel(image->format))) {
+        return FALSE;
+    }
+
+    blocks_width = (stream->width + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE;
+    num_blocks = blocks_width * ((stream->height + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE);
+    if (agent->num_blocks != num_blocks) {
+        red_stream_agent_free_block_hashes(agent);
+        agent->num_blocks = num_blocks;
+        agent->block_hashes = spice_new(uint32_t, agent->num_blocks);
+        agent->new_block_hashes = spice_new(uint32_t, agent->num_blocks);
+    }
+    memset(agent->new_block_hashes, 0, agent->num_blocks * sizeof(uint32_t));
+
+    const int skip_lines = stream->top_down ? src->top : image->y - src->bottom;
+    for (i = 0; i < skip_lines; i++) {
+        red_get_image_line(chunks, &offset, &chunk, image->stride);
+    }
+
+    for (i = 0; i < stream->height; i++) {
+        uint8_t *line = red_get_image_line(chunks, &offset, &chunk, image->stride);
+        uint32_t *hash = &agent->new_block_hashes[(i / STREAM_BLOCK_SIZE) * blocks_width];
+
+        if (!line) {
+            return FALSE;
+        }
+        line += src->left * bpp;
+        for (x = 0; x < stream->width; x += STREAM_BLOCK_SIZE, hash++) {
+            *hash = red_stream_hash_line(*hash, line + x * bpp,
+                                         MIN(STREAM_BLOCK_SIZE, stream->width - x) * bpp);
+        }
+    }
+    return TRUE;
+}
+
+/* Returns TRUE if only area should be encoded. area is in the order the lines are encoded,
+ * and it is empty if the frame didn't change. */
+static int red_stream_get_partial_area(StreamAgent *agent, Stream *stream, SpiceRect *area)
+{
+    int blocks_width = (stream->width + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE;
+    int blocks_height = (stream->height + STREAM_BLOCK_SIZE - 1) / STREAM_BLOCK_SIZE;
+    int x, y;
+
+    if (!agent->block_hashes_valid || agent->partial_frames >= STREAM_MAX_PARTIAL_FRAMES ||
+        mjpeg_encoder_is_evaluating_quality(agent->mjpeg_encoder)) {
+        return FALSE;
+    }
+
+    area->left = blocks_width;
+    area->top = blocks_height;
+    area->right = area->bottom = 0;
+    for (y = 0; y < blocks_height; y++) {
+        uint32_t *hash = &agent->block_hashes[y * blocks_width];
+        uint32_t *new_hash = &agent->new_block_hashes[y * blocks_width];
+
+        for (x = 0; x < blocks_width; x++) {
+            if (hash[x] != new_hash[x]) {
+                area->left = MIN(area->left, x);
+                area->right = MAX(area->right, x + 1);
+                area->top = MIN(area->top, y);
+                area->bottom = y + 1;
+            }
+        }
+    }
+    if (!area->right) {
+        area->left = area->top = 0;
+        return TRUE;
+    }
+    area->left *= STREAM_BLOCK_SIZE;
+    area->top *= STREAM_BLOCK_SIZE;
+    area->right = MIN(area->right * STREAM_BLOCK_SIZE, stream->width);
+    area->bottom = MIN(area->bottom * STREAM_BLOCK_SIZE, stream->height);
+
+    /* encoding most of the frame separately doesn't save enough */
+    return (area->right - area->left) * (area->bottom - area->top) * 2 <=
+           stream->width * stream->height;
+}
+
 static inline int red_marshall_stream_data(RedChannelClient *rcc,
                   SpiceMarshaller *base_marshaller, Drawable *drawable)
 {
@@ -8388,6 +9249,9 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     int n;
     int width, height;
     int ret;
+    SpiceRect src_area;
+    int hashed, partial;
+    SpiceRect area;
 
     if (!stream) {
         spice_assert(drawable->sized_stream);
@@ -8399,7 +9263,7 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
     image = drawable->red_drawable->u.copy.src_bitmap;
 
     if (image->descriptor.type != SPICE_IMAGE_TYPE_BITMAP) {
-        return FALSE;
+        return STREAM_FRAME_NOT_STREAMED;
     }
 
     if (drawable->sized_stream) {
@@ -8409,7 +9273,7 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
             width = src_rect->right - src_rect->left;
             height = src_rect->bottom - src_rect->top;
         } else {
-            return FALSE;
+            return STREAM_FRAME_NOT_STREAMED;
         }
     } else {
         width = stream->width;
@@ -8426,10 +9290,37 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
 #ifdef STREAM_STATS
             agent->stats.num_drops_fps++;
 #endif
-            return TRUE;
+#ifdef RED_STATISTICS
+            stat_inc_counter(display_channel->stream_drops_counter, 1);
+#endif
+            return STREAM_FRAME_SKIPPED;
         }
     }
 
+    src_area = drawable->red_drawable->u.copy.src_area;
+    hashed = red_stream_hash_frame(dcc, agent, stream, drawable);
+    partial = hashed && red_stream_get_partial_area(agent, stream, &area);
+    if (partial) {
+        if (rect_is_empty(&area)) {
+#ifdef RED_STATISTICS
+            stat_inc_counter(display_channel->stream_unchanged_frames_counter, 1);
+#endif
+            return STREAM_FRAME_SKIPPED;
+        }
+        width = area.right - area.left;
+        height = area.bottom - area.top;
+        /* the lines of bottom-up bitmaps are encoded from the bottom */
+        if (stream->top_down) {
+            src_area.top += area.top;
+            src_area.bottom = src_area.top + height;
+        } else {
+            src_area.top = src_area.bottom - area.bottom;
+            src_area.bottom -= area.top;
+        }
+        src_area.left += area.left;
+        src_area.right = src_area.left + width;
+    }
+
     /* workaround for vga streams */
     frame_mm_time =  drawable->red_drawable->mm_time ?
                         drawable->red_drawable->mm_time :
@@ -8446,24 +9337,33 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
 #ifdef STREAM_STATS
         agent->stats.num_drops_fps++;
 #endif
-        return TRUE;
+#ifdef RED_STATISTICS
+        stat_inc_counter(display_channel->stream_drops_counter, 1);
+#endif
+        return STREAM_FRAME_SKIPPED;
     case MJPEG_ENCODER_FRAME_UNSUPPORTED:
-        return FALSE;
+        agent->block_hashes_valid = FALSE;
+        return STREAM_FRAME_NOT_STREAMED;
     case MJPEG_ENCODER_FRAME_ENCODE_START:
         break;
     default:
         spice_error("bad return value (%d) from mjpeg_encoder_start_frame", ret);
-        return FALSE;
+        return STREAM_FRAME_NOT_STREAMED;
     }
 
-    if (!encode_frame(dcc, &drawable->red_drawable->u.copy.src_area,
-                      &image->u.bitmap, stream)) {
-        return FALSE;
+    if (!encode_frame(dcc, &src_area, &image->u.bitmap, stream)) {
+        agent->block_hashes_valid = FALSE;
+        return STREAM_FRAME_NOT_STREAMED;
     }
     n = mjpeg_encoder_end_frame(agent->mjpeg_encoder);
     dcc->send_data.stream_outbuf_size = outbuf_size;
+#ifdef RED_STATISTICS
+    stat_histogram_add(&display_channel->stream_encode_latency, (red_now() - time_now) / 1000);
+    stat_inc_counter(display_channel->stream_frames_counter, 1);
+    stat_inc_counter(display_channel->stream_bytes_counter, n);
+#endif
 
-    if (!drawable->sized_stream) {
+    if (!drawable->sized_stream && !partial) {
         SpiceMsgDisplayStreamData stream_data;
 
         red_channel_client_init_send_data(rcc, SPICE_MSG_DISPLAY_STREAM_DATA, NULL);
@@ -8485,23 +9385,45 @@ static inline int red_marshall_stream_data(RedChannelClient *rcc,
         stream_data.height = height;
         stream_data.dest = drawable->red_drawable->bbox;
 
-        spice_debug("stream %d: sized frame: dest ==> ", stream_data.base.id);
-        rect_debug(&stream_data.dest);
+        if (partial) {
+            SpiceRect *src = &drawable->red_drawable->u.copy.src_area;
+
+            stream_data.dest.left += src_area.left - src->left;
+            stream_data.dest.top += src_area.top - src->top;
+            stream_data.dest.right = stream_data.dest.left + width;
+            stream_data.dest.bottom = stream_data.dest.top + height;
+#ifdef RED_STATISTICS
+            stat_inc_counter(display_channel->stream_partial_frames_counter, 1);
+#endif
+        } else {
+            spice_debug("stream %d: sized frame: dest ==> ", stream_data.base.id);
+            rect_debug(&stream_data.dest);
+        }
         spice_marshall_msg_display_stream_data_sized(base_marshaller, &stream_data);
     }
     spice_marshaller_add_ref(base_marshaller,
                              dcc->send_data.stream_outbuf, n);
     agent->last_send_time = time_now;
+    if (hashed) {
+        uint32_t *block_hashes = agent->block_hashes;
+
+        agent->block_hashes = agent->new_block_hashes;
+        agent->new_block_hashes = block_hashes;
+        agent->partial_frames = partial ? agent->partial_frames + 1 : 0;
+    }
+    agent->block_hashes_valid = hashed;
 #ifdef STREAM_STATS
     agent->stats.num_frames_sent++;
     agent->stats.size_sent += n;
     agent->stats.end = frame_mm_time;
 #endif
 
-    return TRUE;
+    return STREAM_FRAME_SENT;
 }
 
-static inline void marshall_qxl_drawable(RedChannelClient *rcc,
+/* returns FALSE if the drawable is a stream frame that was skipped, and nothing was
+ * marshalled */
+static inline int marshall_qxl_drawable(RedChannelClient *rcc,
     SpiceMarshaller *m, DrawablePipeItem *dpi)
 {
     Drawable *item = dpi->drawable;
@@ -8510,13 +9432,21 @@ static inline void marshall_qxl_drawable(RedChannelClient *rcc,
     spice_assert(display_channel && rcc);
     /* allow sized frames to be streamed, even if they where replaced by another frame, since
      * newer frames might not cover sized frames completely if they are bigger */
-    if ((item->stream || item->sized_stream) && red_marshall_stream_data(rcc, m, item)) {
-        return;
+    if (item->stream || item->sized_stream) {
+        switch (red_marshall_stream_data(rcc, m, item)) {
+        case STREAM_FRAME_SENT:
+            return TRUE;
+        case STREAM_FRAME_SKIPPED:
+            return FALSE;
+        default:
+            break;
+        }
     }
     if (!display_channel->enable_jpeg)
         red_marshall_qxl_drawable(display_channel->common.worker, rcc, m, dpi);
     else
         red_lossy_marshall_qxl_drawable(display_channel->common.worker, rcc, m, dpi);
+    return TRUE;
 }
 
 static inline void red_marshall_verb(RedChannelClient *rcc, uint16_t verb)
@@ -8940,6 +9870,10 @@ static void red_marshall_cursor(RedChannelClient *rcc,
             fill_cursor(ccc, &cursor_set.cursor, cursor, &info);
             spice_marshall_msg_cursor_set(m, &cursor_set);
             add_buf_from_info(m, &info);
+#ifdef RED_STATISTICS
+            stat_histogram_add(&cursor_channel->set_latency,
+                               (red_now() - cursor->creation_time) / 1000);
+#endif
             break;
         }
     case QXL_CURSOR_HIDE:
@@ -9037,7 +9971,11 @@ static void display_channel_send_item(RedChannelClient *rcc, PipeItem *pipe_item
     switch (pipe_item->type) {
     case PIPE_ITEM_TYPE_DRAW: {
         DrawablePipeItem *dpi = SPICE_CONTAINEROF(pipe_item, DrawablePipeItem, dpi_pipe_item);
-        marshall_qxl_drawable(rcc, m, dpi);
+        if (!marshall_qxl_drawable(rcc, m, dpi)) {
+            /* a dropped or unchanged stream frame: no message was started */
+            display_channel_client_release_item_before_push(dcc, pipe_item);
+            return;
+        }
         break;
     }
     case PIPE_ITEM_TYPE_INVAL_ONE:
@@ -9478,6 +10416,9 @@ static inline void red_create_surface(RedWorker *worker, uint32_t surface_id, ui
     ring_init(&surface->depend_on_me);
     region_init(&surface->draw_dirty_region);
     surface->refs = 1;
+    if (is_primary_surface(worker, surface_id)) {
+        hot_areas_reset(&worker->hot_areas, width, height);
+    }
     if (worker->renderer != RED_RENDERER_INVALID) {
         surface->context.canvas = create_canvas_for_surface(worker, surface, worker->renderer,
                                                             width, height, stride,
@@ -9485,6 +10426,7 @@ static inline void red_create_surface(RedWorker *worker, uint32_t surface_id, ui
         if (!surface->context.canvas) {
             spice_critical("drawing canvas creating failed - can`t create same type canvas");
         }
+        red_account_surface(worker, surface_id, TRUE);
 
         if (send_client) {
             red_worker_create_surface_item(worker, surface_id);
@@ -9501,6 +10443,7 @@ static inline void red_create_surface(RedWorker *worker, uint32_t surface_id, ui
                                                             surface->context.format, line_0);
         if (surface->context.canvas) { //no need canvas check
             worker->renderer = worker->renderers[i];
+            red_account_surface(worker, surface_id, TRUE);
             if (send_client) {
                 red_worker_create_surface_item(worker, surface_id);
                 if (data_is_valid) {
@@ -10489,6 +11432,9 @@ static void display_channel_release_item(RedChannelClient *rcc, PipeItem *item,
 static void display_channel_create(RedWorker *worker, int migrate)
 {
     DisplayChannel *display_channel;
+#ifdef RED_STATISTICS
+    int i;
+#endif
 
     if (worker->display_channel) {
         return;
@@ -10514,14 +11460,32 @@ static void display_channel_create(RedWorker *worker, int migrate)
     display_channel = worker->display_channel;
 #ifdef RED_STATISTICS
     display_channel->stat = stat_add_node(worker->stat, "display_channel", TRUE);
-    display_channel->common.base.out_bytes_counter = stat_add_counter(display_channel->stat,
-                                                               "out_bytes", TRUE);
+    red_channel_set_stat_node(&display_channel->common.base, display_channel->stat);
     display_channel->cache_hits_counter = stat_add_counter(display_channel->stat,
                                                            "cache_hits", TRUE);
     display_channel->add_to_cache_counter = stat_add_counter(display_channel->stat,
                                                              "add_to_cache", TRUE);
     display_channel->non_cache_counter = stat_add_counter(display_channel->stat,
                                                           "non_cache", TRUE);
+    for (i = 0; i < CODEC_STAT_COUNT; i++) {
+        red_codec_stat_init(&display_channel->codec_stat[i], display_channel->stat,
+                            codec_stat_names[i]);
+    }
+    display_channel->streams_stat = stat_add_node(display_channel->stat, "streams", TRUE);
+    display_channel->stream_frames_counter = stat_add_counter(display_channel->streams_stat,
+                                                              "frames", TRUE);
+    display_channel->stream_bytes_counter = stat_add_counter(display_channel->streams_stat,
+                                                             "bytes", TRUE);
+    display_channel->stream_drops_counter = stat_add_counter(display_channel->streams_stat,
+                                                             "drops", TRUE);
+    display_channel->stream_partial_frames_counter =
+        stat_add_counter(display_channel->streams_stat, "partial_frames", TRUE);
+    display_channel->stream_unchanged_frames_counter =
+        stat_add_counter(display_channel->streams_stat, "unchanged_frames", TRUE);
+    display_channel->stream_superseded_frames_counter =
+        stat_add_counter(display_channel->streams_stat, "superseded_frames", TRUE);
+    stat_add_histogram(&display_channel->stream_encode_latency, display_channel->streams_stat,
+                       "encode_latency");
 #endif
     stat_compress_init(&display_channel->lz_stat, lz_stat_name);
     stat_compress_init(&display_channel->glz_stat, glz_stat_name);
@@ -10762,6 +11726,11 @@ static void cursor_channel_create(RedWorker *worker, int migrate)
         NULL,
         NULL,
         NULL);
+#ifdef RED_STATISTICS
+    if (worker->cursor_channel) {
+        worker->cursor_channel->stat = INVALID_STAT_REF;
+    }
+#endif
 }
 
 static void red_connect_cursor(RedWorker *worker, RedClient *client, RedsStream *stream,
@@ -10786,8 +11755,15 @@ static void red_connect_cursor(RedWorker *worker, RedClient *client, RedsStream
         return;
     }
 #ifdef RED_STATISTICS
-    channel->stat = stat_add_node(worker->stat, "cursor_channel", TRUE);
-    channel->common.base.out_bytes_counter = stat_add_counter(channel->stat, "out_bytes", TRUE);
+    if (channel->stat == INVALID_STAT_REF) {
+        channel->stat = stat_add_node(worker->stat, "cursor_channel", TRUE);
+        red_channel_set_stat_node(&channel->common.base, channel->stat);
+        channel->shapes_counter = stat_add_counter(channel->stat, "shapes", TRUE);
+        channel->shape_bytes_counter = stat_add_counter(channel->stat, "shape_bytes", TRUE);
+        channel->shape_cache_hits_counter = stat_add_counter(channel->stat, "shape_cache_hits",
+                                                             TRUE);
+        stat_add_histogram(&channel->set_latency, channel->stat, "set_latency");
+    }
 #endif
     on_new_cursor_channel(worker, &ccc->common.base);
 }
@@ -11400,11 +12376,8 @@ void handle_dev_create_primary_surface_async(void *opaque, void *payload)
     dev_create_primary_surface(worker, msg->surface_id, msg->surface);
 }
 
-/* exception for Dispatcher, data going from red_worker to main thread,
- * TODO: use a different dispatcher?
- * TODO: leave direct usage of channel(fd)? It's only used right after the
- * pthread is created, since the channel duration is the lifetime of the spice
- * server. */
+/* the channel create messages are answered with a reply from red_worker to the
+ * main thread, which waits for it with dispatcher_wait_reply */
 
 void handle_dev_display_channel_create(void *opaque, void *payload)
 {
@@ -11414,7 +12387,8 @@ void handle_dev_display_channel_create(void *opaque, void *payload)
     // TODO: handle seemless migration. Temp, setting migrate to FALSE
     display_channel_create(worker, FALSE);
     red_channel = &worker->display_channel->common.base;
-    send_data(worker->channel, &red_channel, sizeof(RedChannel *));
+    dispatcher_send_reply(red_dispatcher_get_dispatcher(worker->red_dispatcher),
+                          &red_channel, sizeof(RedChannel *));
 }
 
 void handle_dev_display_connect(void *opaque, void *payload)
@@ -11488,7 +12462,6 @@ static void handle_dev_monitors_config_async(void *opaque, void *payload)
     red_worker_push_monitors_config(worker);
 }
 
-/* TODO: special, perhaps use another dispatcher? */
 void handle_dev_cursor_channel_create(void *opaque, void *payload)
 {
     RedWorker *worker = opaque;
@@ -11497,7 +12470,8 @@ void handle_dev_cursor_channel_create(void *opaque, void *payload)
     // TODO: handle seemless migration. Temp, setting migrate to FALSE
     cursor_channel_create(worker, FALSE);
     red_channel = &worker->cursor_channel->common.base;
-    send_data(worker->channel, &red_channel, sizeof(RedChannel *));
+    dispatcher_send_reply(red_dispatcher_get_dispatcher(worker->red_dispatcher),
+                          &red_channel, sizeof(RedChannel *));
 }
 
 void handle_dev_cursor_connect(void *opaque, void *payload)
@@ -11631,6 +12605,40 @@ void handle_dev_driver_unload(void *opaque, void *payload)
     worker->driver_cap_monitors_config = 0;
 }
 
+void handle_dev_set_migrate_precopy(void *opaque, void *payload)
+{
+    RedWorkerMessageSetMigratePrecopy *msg = payload;
+    RedWorker *worker = opaque;
+
+    worker->migrate_precopy = msg->enabled;
+}
+
+/* renders and releases the oldest drawables, so that handle_dev_stop will only need
+ * to flush the drawables that were added since */
+static void red_migrate_precopy_flush(RedWorker *worker)
+{
+    uint64_t start = red_now();
+    struct timespec time;
+    red_time_t now;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    now = timespec_to_red_time(&time);
+    while (!ring_is_empty(&worker->current_list)) {
+        RingItem *ring_item = ring_get_tail(&worker->current_list);
+        Drawable *drawable = SPICE_CONTAINEROF(ring_item, Drawable, list_link);
+
+        if (now - drawable->creation_time < MIGRATE_PRECOPY_MIN_AGE ||
+            red_now() - start > MIGRATE_PRECOPY_STEP_TIME) {
+            break;
+        }
+        free_one_drawable(worker, FALSE);
+    }
+    if (!ring_is_empty(&worker->current_list)) {
+        worker->event_timeout = MIN(worker->event_timeout,
+                                    MIGRATE_PRECOPY_MIN_AGE / (1000 * 1000));
+    }
+}
+
 static int loadvm_command(RedWorker *worker, QXLCommandExt *ext)
 {
     RedCursorCmd *cursor_cmd;
@@ -11868,6 +12876,11 @@ static void register_callbacks(Dispatcher *dispatcher)
                                 handle_dev_driver_unload,
                                 sizeof(RedWorkerMessageDriverUnload),
                                 DISPATCHER_NONE);
+    dispatcher_register_handler(dispatcher,
+                                RED_WORKER_MESSAGE_SET_MIGRATE_PRECOPY,
+                                handle_dev_set_migrate_precopy,
+                                sizeof(RedWorkerMessageSetMigratePrecopy),
+                                DISPATCHER_NONE);
 }
 
 
@@ -11910,6 +12923,12 @@ static void red_init(RedWorker *worker, WorkerInitData *init_data)
     ring_init(&worker->current_list);
     image_cache_init(&worker->image_cache);
     image_surface_init(worker);
+    hot_areas_init(&worker->hot_areas);
+    ring_init(&worker->render_batch);
+    if (init_data->render_threads > 0) {
+        worker->render_pool = red_render_pool_new(MIN(init_data->render_threads,
+                                                      RED_RENDER_MAX_THREADS));
+    }
     drawables_init(worker);
     cursor_items_init(worker);
     red_init_streams(worker);
@@ -11922,6 +12941,30 @@ static void red_init(RedWorker *worker, WorkerInitData *init_data)
     worker->stat = stat_add_node(INVALID_STAT_REF, worker_str, TRUE);
     worker->wakeup_counter = stat_add_counter(worker->stat, "wakeups", TRUE);
     worker->command_counter = stat_add_counter(worker->stat, "commands", TRUE);
+    worker->update_area_drawn_counter = stat_add_counter(worker->stat, "update_area_drawn",
+                                                         TRUE);
+    worker->update_area_deferred_counter = stat_add_counter(worker->stat, "update_deferred",
+                                                            TRUE);
+    stat_add_histogram(&worker->update_area_latency, worker->stat, "update_area_latency");
+    worker->render_async_counter = stat_add_counter(worker->stat, "render_async", TRUE);
+    worker->render_tiled_counter = stat_add_counter(worker->stat, "render_tiled", TRUE);
+    worker->stream_detect_stat = stat_add_node(worker->stat, "stream_detection", TRUE);
+    worker->stream_detect_hits_counter = stat_add_counter(worker->stream_detect_stat,
+                                                          "hits", TRUE);
+    worker->stream_detect_misses_counter = stat_add_counter(worker->stream_detect_stat,
+                                                            "misses", TRUE);
+    worker->hot_area_hits_counter = stat_add_counter(worker->stream_detect_stat,
+                                                     "hot_area_hits", TRUE);
+    worker->hot_area_misses_counter = stat_add_counter(worker->stream_detect_stat,
+                                                       "hot_area_misses", TRUE);
+    worker->hot_cells_counter = stat_add_counter(worker->stream_detect_stat, "hot_cells", TRUE);
+    worker->surfaces_stat = stat_add_node(worker->stat, "surfaces", TRUE);
+    worker->surfaces_counter = stat_add_counter(worker->surfaces_stat, "count", TRUE);
+    worker->surfaces_memory_counter = stat_add_counter(worker->surfaces_stat, "memory", TRUE);
+    worker->offscreen_surfaces_counter = stat_add_counter(worker->surfaces_stat,
+                                                          "offscreen_count", TRUE);
+    worker->offscreen_surfaces_memory_counter = stat_add_counter(worker->surfaces_stat,
+                                                                 "offscreen_memory", TRUE);
 #endif
     for (i = 0; i < MAX_EVENT_SOURCES; i++) {
         worker->poll_fds[i].fd = -1;
@@ -11949,7 +12992,7 @@ static void red_init(RedWorker *worker, WorkerInitData *init_data)
     srand(time(NULL));
 
     message = RED_WORKER_MESSAGE_READY;
-    write_message(worker->channel, &message);
+    dispatcher_send_reply(dispatcher, &message, sizeof(message));
 }
 
 static void red_display_cc_free_glz_drawables(RedChannelClient *rcc)
@@ -11966,6 +13009,8 @@ SPICE_GNUC_NORETURN void *red_worker_main(void *arg)
     spice_info("begin");
     spice_assert(MAX_PIPE_SIZE > WIDE_CLIENT_ACK_WINDOW &&
            MAX_PIPE_SIZE > NARROW_CLIENT_ACK_WINDOW); //ensure wakeup by ack message
+    spice_assert(MIGRATE_PRECOPY_MAX_PIPE_SIZE > WIDE_CLIENT_ACK_WINDOW &&
+           MIGRATE_PRECOPY_MAX_PIPE_SIZE > NARROW_CLIENT_ACK_WINDOW);
 
 #if  defined(RED_WORKER_STAT) || defined(COMPRESS_STAT)
     if (pthread_getcpuclockid(pthread_self(), &clock_id)) {
@@ -12033,7 +13078,12 @@ SPICE_GNUC_NORETURN void *red_worker_main(void *arg)
         if (worker->running) {
             int ring_is_empty;
             red_process_cursor(worker, MAX_PIPE_SIZE, &ring_is_empty);
-            red_process_commands(worker, MAX_PIPE_SIZE, &ring_is_empty);
+            if (worker->migrate_precopy) {
+                red_process_commands(worker, MIGRATE_PRECOPY_MAX_PIPE_SIZE, &ring_is_empty);
+                red_migrate_precopy_flush(worker);
+            } else {
+                red_process_commands(worker, MAX_PIPE_SIZE, &ring_is_empty);
+            }
         }
         red_push(worker);
     }
@@ -81,7 +81,7 @@ typedef struct __attribute__ ((__packed__)) VDInternalBuf {
 
 #ifdef RED_STATISTICS
 
-#define REDS_MAX_STAT_NODES 100
+#define REDS_MAX_STAT_NODES 1024
 #define REDS_STAT_SHM_SIZE (sizeof(SpiceStat) + REDS_MAX_STAT_NODES * sizeof(SpiceStatNode))
 
 typedef struct RedsStatValue {
@@ -148,6 +148,8 @@ typedef struct RedsState {
                                     between the 2 servers */
     int dst_do_seamless_migrate; /* per migration. Updated after the migration handshake
                                     between the 2 servers */
+    int mig_precopy; /* src: the client is connected to the dst, and the vm is still
+                        running. The workers flush their display state ahead of the switch */
     Ring mig_target_clients;
     int num_mig_target_clients;
     RedsMigSpice *mig_spice;
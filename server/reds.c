@@ -115,6 +115,7 @@ static pthread_mutex_t *lock_cs;
 static long *lock_count;
 uint32_t streaming_video = STREAM_VIDEO_FILTER;
 spice_image_compression_t image_compression = SPICE_IMAGE_COMPRESS_AUTO_GLZ;
+int render_threads = 0;
 spice_wan_compression_t jpeg_state = SPICE_WAN_COMPRESSION_AUTO;
 spice_wan_compression_t zlib_glz_state = SPICE_WAN_COMPRESSION_AUTO;
 int agent_mouse = TRUE;
@@ -364,9 +365,38 @@ StatNodeRef stat_add_node(StatNodeRef parent, const char *name, int visible)
     return ref;
 }
 
+/* the removed node is unlinked from the tree, so its slot can be reused. The children
+ * of the node should be removed before it */
+static void unlink_stat_node(StatNodeRef ref)
+{
+    SpiceStatNode *node = &reds->stat->nodes[ref];
+    uint32_t i;
+
+    if (reds->stat->root_index == ref) {
+        reds->stat->root_index = node->next_sibling_index;
+        return;
+    }
+    for (i = 0; i < REDS_MAX_STAT_NODES; i++) {
+        SpiceStatNode *n = &reds->stat->nodes[i];
+
+        if (i == ref || !(n->flags & SPICE_STAT_NODE_FLAG_ENABLED)) {
+            continue;
+        }
+        if (n->first_child_index == ref) {
+            n->first_child_index = node->next_sibling_index;
+            return;
+        }
+        if (n->next_sibling_index == ref) {
+            n->next_sibling_index = node->next_sibling_index;
+            return;
+        }
+    }
+}
+
 static void stat_remove(SpiceStatNode *node)
 {
     pthread_mutex_lock(&reds->stat_lock);
+    unlink_stat_node(node - reds->stat->nodes);
     node->flags &= ~SPICE_STAT_NODE_FLAG_ENABLED;
     reds->stat->generation++;
     reds->stat->num_of_nodes--;
@@ -396,6 +426,48 @@ void stat_remove_counter(uint64_t *counter)
     stat_remove((SpiceStatNode *)(counter - offsetof(SpiceStatNode, value)));
 }
 
+void stat_add_histogram(StatHistogram *hist, StatNodeRef parent, const char *name)
+{
+    char bucket_name[sizeof(((SpiceStatNode *)0)->name)];
+    int i;
+
+    memset(hist, 0, sizeof(*hist));
+    hist->node = stat_add_node(parent, name, TRUE);
+    if (hist->node == INVALID_STAT_REF) {
+        return;
+    }
+    hist->count = stat_add_counter(hist->node, "count", TRUE);
+    hist->total = stat_add_counter(hist->node, "total_us", TRUE);
+    for (i = 0; i < STAT_HISTOGRAM_NUM_BUCKETS - 1; i++) {
+        snprintf(bucket_name, sizeof(bucket_name), "us_%06u", STAT_HISTOGRAM_BASE_USEC << i);
+        hist->buckets[i] = stat_add_counter(hist->node, bucket_name, TRUE);
+    }
+    hist->buckets[i] = stat_add_counter(hist->node, "us_inf", TRUE);
+}
+
+void stat_remove_histogram(StatHistogram *hist)
+{
+    int i;
+
+    if (hist->node == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < STAT_HISTOGRAM_NUM_BUCKETS; i++) {
+        if (hist->buckets[i]) {
+            stat_remove_counter(hist->buckets[i]);
+        }
+    }
+    if (hist->count) {
+        stat_remove_counter(hist->count);
+    }
+    if (hist->total) {
+        stat_remove_counter(hist->total);
+    }
+    stat_remove_node(hist->node);
+    memset(hist, 0, sizeof(*hist));
+    hist->node = INVALID_STAT_REF;
+}
+
 void reds_update_stat_value(uint32_t value)
 {
     RedsStatValue *stat_value = &reds->roundtrip_stat;
@@ -440,6 +512,15 @@ static RedChannel *reds_find_channel(uint32_t type, uint32_t id)
     return NULL;
 }
 
+static void reds_mig_set_precopy(int enabled)
+{
+    if (reds->mig_precopy == enabled) {
+        return;
+    }
+    reds->mig_precopy = enabled;
+    red_dispatcher_on_migrate_precopy(enabled);
+}
+
 static void reds_mig_cleanup(void)
 {
     if (reds->mig_inprogress) {
@@ -616,6 +697,7 @@ static void reds_disconnect(void)
     RING_FOREACH_SAFE(link, next, &reds->clients) {
         reds_client_disconnect(SPICE_CONTAINEROF(link, RedClient, link));
     }
+    reds_mig_set_precopy(FALSE);
     reds_mig_cleanup();
 }
 
@@ -1140,6 +1222,9 @@ void reds_on_main_agent_data(MainChannelClient *mcc, void *message, size_t size)
 void reds_on_main_migrate_connected(int seamless)
 {
     reds->src_do_seamless_migrate = seamless;
+    if (seamless) {
+        reds_mig_set_precopy(TRUE);
+    }
     if (reds->mig_wait_connect) {
         reds_mig_cleanup();
     }
@@ -3438,6 +3523,7 @@ static void reds_mig_finished(int completed)
     spice_info(NULL);
 
     reds->mig_inprogress = TRUE;
+    reds_mig_set_precopy(FALSE);
 
     if (reds->src_do_seamless_migrate && completed) {
         reds_migrate_channels_seamless();
@@ -3530,6 +3616,10 @@ static SpiceCharDeviceState *attach_to_red_agent(SpiceCharDeviceInstance *sin)
                                                      REDS_NUM_INTERNAL_AGENT_MESSAGES,
                                                      &char_dev_state_cbs,
                                                      NULL);
+        spice_char_device_set_byte_window(state->base,
+                                          REDS_AGENT_MIN_BYTE_WINDOW,
+                                          REDS_AGENT_MAX_BYTE_WINDOW);
+        spice_char_device_state_stat_register(state->base, "agent");
     } else {
         spice_char_device_state_reset_dev_instance(state->base, sin);
     }
@@ -3940,6 +4030,10 @@ static int do_spice_init(SpiceCoreInterface *core_interface)
 #endif
 
     reds->main_channel = main_channel_init();
+#ifdef RED_STATISTICS
+    red_channel_set_stat_node(&reds->main_channel->base,
+                              stat_add_node(INVALID_STAT_REF, "main_channel", TRUE));
+#endif
     inputs_init();
 
     reds->mouse_mode = SPICE_MOUSE_MODE_SERVER;
@@ -4309,6 +4403,23 @@ SPICE_GNUC_VISIBLE int spice_server_set_agent_file_xfer(SpiceServer *s, int enab
     return 0;
 }
 
+SPICE_GNUC_VISIBLE int spice_server_set_inputs_coalescing(SpiceServer *s, int enable)
+{
+    spice_assert(reds == s);
+    inputs_set_coalescing(enable);
+    return 0;
+}
+
+SPICE_GNUC_VISIBLE int spice_server_set_render_threads(SpiceServer *s, int threads)
+{
+    spice_assert(reds == s);
+    if (threads < 0) {
+        return -1;
+    }
+    render_threads = threads;
+    return 0;
+}
+
 /* returns FALSE if info is invalid */
 static int reds_set_migration_dest_info(const char* dest,
                                         int port, int secure_port,
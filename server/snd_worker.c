@@ -302,6 +302,9 @@ static int snd_send_data(SndChannel *channel)
             }
         } else {
             channel->send_data.pos += n;
+#ifdef RED_STATISTICS
+            stat_inc_counter(channel->worker->base_channel->out_bytes_counter, n);
+#endif
         }
         n = channel->send_data.size - channel->send_data.pos;
     }
@@ -444,6 +447,9 @@ static void snd_receive(void* data)
             }
         } else {
             channel->receive_data.now += n;
+#ifdef RED_STATISTICS
+            stat_inc_counter(channel->worker->base_channel->in_bytes_counter, n);
+#endif
             for (;;) {
                 uint8_t *msg_start = channel->receive_data.message_start;
                 uint8_t *data = msg_start + header->header_size;
@@ -533,6 +539,9 @@ static int snd_begin_send_message(SndChannel *channel)
     spice_marshaller_flush(channel->send_data.marshaller);
     channel->send_data.size = spice_marshaller_get_total_size(channel->send_data.marshaller);
     header->set_msg_size(header, channel->send_data.size - header->header_size);
+#ifdef RED_STATISTICS
+    stat_inc_counter(channel->worker->base_channel->out_messages_counter, 1);
+#endif
     return snd_send_data(channel);
 }
 
@@ -1500,6 +1509,9 @@ void snd_attach_playback(SpicePlaybackInstance *sin)
     red_channel_set_data(channel, playback_worker);
     red_channel_set_cap(channel, SPICE_PLAYBACK_CAP_CELT_0_5_1);
     red_channel_set_cap(channel, SPICE_PLAYBACK_CAP_VOLUME);
+#ifdef RED_STATISTICS
+    red_channel_set_stat_node(channel, stat_add_node(INVALID_STAT_REF, "playback_channel", TRUE));
+#endif
 
     playback_worker->base_channel = channel;
     add_worker(playback_worker);
@@ -1527,6 +1539,9 @@ void snd_attach_record(SpiceRecordInstance *sin)
     red_channel_set_data(channel, record_worker);
     red_channel_set_cap(channel, SPICE_RECORD_CAP_CELT_0_5_1);
     red_channel_set_cap(channel, SPICE_RECORD_CAP_VOLUME);
+#ifdef RED_STATISTICS
+    red_channel_set_stat_node(channel, stat_add_node(INVALID_STAT_REF, "record_channel", TRUE));
+#endif
 
     record_worker->base_channel = channel;
     add_worker(record_worker);
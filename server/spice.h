@@ -509,6 +509,13 @@ int spice_server_set_playback_compression(SpiceServer *s, int enable);
 int spice_server_set_agent_mouse(SpiceServer *s, int enable);
 int spice_server_set_agent_copypaste(SpiceServer *s, int enable);
 int spice_server_set_agent_file_xfer(SpiceServer *s, int enable);
+/* merge the mouse motion events that arrive in short bursts, before delivering them to
+ * the guest. Key and button events are not delayed. Disabled by default */
+int spice_server_set_inputs_coalescing(SpiceServer *s, int enable);
+/* the number of threads that help the display worker rendering on the server side
+ * canvas and encoding big video stream frames. Applies to the qxl instances that are
+ * added later. 0 (the default) disables parallel rendering */
+int spice_server_set_render_threads(SpiceServer *s, int threads);
 
 int spice_server_get_sock_info(SpiceServer *s, struct sockaddr *sa, socklen_t *salen);
 int spice_server_get_peer_info(SpiceServer *s, struct sockaddr *sa, socklen_t *salen);
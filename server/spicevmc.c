@@ -507,6 +507,7 @@ SpiceCharDeviceState *spicevmc_device_connect(SpiceCharDeviceInstance *sin,
     ChannelCbs channel_cbs = { NULL, };
     ClientCbs client_cbs = { NULL, };
     SpiceCharDeviceCallbacks char_dev_cbs = {NULL, };
+    char stat_name[32];
 
     channel_cbs.config_socket = spicevmc_red_channel_client_config_socket;
     channel_cbs.on_disconnect = spicevmc_red_channel_client_on_disconnect;
@@ -542,6 +543,14 @@ SpiceCharDeviceState *spicevmc_device_connect(SpiceCharDeviceInstance *sin,
                                                        &char_dev_cbs,
                                                        state);
     state->chardev_sin = sin;
+    snprintf(stat_name, sizeof(stat_name), "spicevmc_%u_%u",
+             state->channel.type, state->channel.id);
+    spice_char_device_state_stat_register(state->chardev_st, stat_name);
+#ifdef RED_STATISTICS
+    snprintf(stat_name, sizeof(stat_name), "vmc_%u_%u",
+             state->channel.type, state->channel.id);
+    red_channel_set_stat_node(&state->channel, stat_add_node(INVALID_STAT_REF, stat_name, TRUE));
+#endif
 
     reds_register_channel(&state->channel);
     return state->chardev_st;
@@ -23,12 +23,28 @@
 typedef uint32_t StatNodeRef;
 #define INVALID_STAT_REF (~(StatNodeRef)0)
 
+/* Latency histogram with log2 buckets. It is published as a node with the children:
+ * count - number of samples, total_us - sum of the samples,
+ * us_<bound> - number of samples < bound microseconds (and >= the previous bound),
+ * us_inf - the rest of the samples. */
+#define STAT_HISTOGRAM_BASE_USEC 16
+#define STAT_HISTOGRAM_NUM_BUCKETS 14
+
+typedef struct StatHistogram {
+    StatNodeRef node;
+    uint64_t *count;
+    uint64_t *total;
+    uint64_t *buckets[STAT_HISTOGRAM_NUM_BUCKETS];
+} StatHistogram;
+
 #ifdef RED_STATISTICS
 
 StatNodeRef stat_add_node(StatNodeRef parent, const char *name, int visible);
 void stat_remove_node(StatNodeRef node);
 uint64_t *stat_add_counter(StatNodeRef parent, const char *name, int visible);
 void stat_remove_counter(uint64_t *counter);
+void stat_add_histogram(StatHistogram *hist, StatNodeRef parent, const char *name);
+void stat_remove_histogram(StatHistogram *hist);
 
 #define stat_inc_counter(counter, value) {  \
     if (counter) {                          \
@@ -36,12 +52,39 @@ void stat_remove_counter(uint64_t *counter);
     }                                       \
 }
 
+#define stat_set_counter(counter, value) {  \
+    if (counter) {                          \
+        *(counter) = (value);               \
+    }                                       \
+}
+
+static inline void stat_histogram_add(StatHistogram *hist, uint64_t usec)
+{
+    int i;
+
+    if (hist->node == INVALID_STAT_REF) {
+        return;
+    }
+    for (i = 0; i < STAT_HISTOGRAM_NUM_BUCKETS - 1; i++) {
+        if (usec < ((uint64_t)STAT_HISTOGRAM_BASE_USEC << i)) {
+            break;
+        }
+    }
+    stat_inc_counter(hist->buckets[i], 1);
+    stat_inc_counter(hist->count, 1);
+    stat_inc_counter(hist->total, usec);
+}
+
 #else
 #define stat_add_node(p, n, v) INVALID_STAT_REF
 #define stat_remove_node(n)
 #define stat_add_counter(p, n, v) NULL
 #define stat_remove_counter(c)
 #define stat_inc_counter(c, v)
+#define stat_set_counter(c, v)
+#define stat_add_histogram(h, p, n) ((h)->node = INVALID_STAT_REF)
+#define stat_remove_histogram(h)
+#define stat_histogram_add(h, v)
 #endif
 
 #endif
@@ -0,0 +1,134 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark of the dispatcher round trip latency.
+ *
+ * A receiver thread plays the role of the red worker: it polls the dispatcher
+ * recv_fd and handles empty messages. The main thread plays the role of the
+ * QEMU I/O thread and measures:
+ *  sync  - DISPATCHER_ACK messages (e.g. UPDATE, ADD_MEMSLOT), the sender blocks
+ *          until the handler returns.
+ *  async - DISPATCHER_ASYNC messages (e.g. UPDATE_ASYNC), the round trip ends when
+ *          the async done callback signals the sender, like async_complete does.
+ *  none  - DISPATCHER_NONE messages (e.g. WAKEUP), the cost of a send only.
+ *
+ * usage: test_dispatcher_latency [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
+
+#include "dispatcher.h"
+
+enum {
+    TEST_MESSAGE_SYNC,
+    TEST_MESSAGE_ASYNC,
+    TEST_MESSAGE_NONE,
+    TEST_MESSAGE_QUIT,
+
+    TEST_MESSAGE_COUNT,
+};
+
+typedef struct TestPayload {
+    uint64_t data[4]; /* about the size of RedWorkerMessageUpdate */
+} TestPayload;
+
+static Dispatcher dispatcher;
+static int async_done_fd;
+static volatile int quit;
+
+static void handle_message(void *opaque, void *payload)
+{
+}
+
+static void handle_quit(void *opaque, void *payload)
+{
+    quit = 1;
+}
+
+static void handle_async_done(void *opaque, uint32_t message_type, void *payload)
+{
+    uint64_t one = 1;
+
+    if (write(async_done_fd, &one, sizeof(one)) != sizeof(one)) {
+        perror("write");
+        exit(1);
+    }
+}
+
+static void *receiver_thread(void *opaque)
+{
+    struct pollfd pollfd = {.fd = dispatcher_get_recv_fd(&dispatcher), .events = POLLIN};
+
+    while (!quit) {
+        if (poll(&pollfd, 1, -1) > 0) {
+            dispatcher_handle_recv_read(&dispatcher);
+        }
+    }
+    return NULL;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+static void run(const char *name, uint32_t message_type, int iterations)
+{
+    TestPayload payload = { { 0, } };
+    uint64_t start, min = UINT64_MAX, max = 0, total = 0;
+    uint64_t count;
+    int i;
+
+    for (i = 0; i < iterations; i++) {
+        start = now_ns();
+        dispatcher_send_message(&dispatcher, message_type, &payload);
+        if (message_type == TEST_MESSAGE_ASYNC &&
+            read(async_done_fd, &count, sizeof(count)) != sizeof(count)) {
+            perror("read");
+            exit(1);
+        }
+        start = now_ns() - start;
+        total += start;
+        min = start < min ? start : min;
+        max = start > max ? start : max;
+    }
+    printf("%-6s %10d %12.0f %12lu %12lu\n", name, iterations, (double)total / iterations,
+           (unsigned long)min, (unsigned long)max);
+}
+
+int main(int argc, char **argv)
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    TestPayload payload;
+    pthread_t thread;
+
+    async_done_fd = eventfd(0, 0);
+    dispatcher_init(&dispatcher, TEST_MESSAGE_COUNT, NULL);
+    dispatcher_register_async_done_callback(&dispatcher, handle_async_done);
+    dispatcher_register_handler(&dispatcher, TEST_MESSAGE_SYNC, handle_message,
+                                sizeof(TestPayload), DISPATCHER_ACK);
+    dispatcher_register_handler(&dispatcher, TEST_MESSAGE_ASYNC, handle_message,
+                                sizeof(TestPayload), DISPATCHER_ASYNC);
+    dispatcher_register_handler(&dispatcher, TEST_MESSAGE_NONE, handle_message,
+                                sizeof(TestPayload), DISPATCHER_NONE);
+    dispatcher_register_handler(&dispatcher, TEST_MESSAGE_QUIT, handle_quit,
+                                sizeof(TestPayload), DISPATCHER_ACK);
+    pthread_create(&thread, NULL, receiver_thread, NULL);
+
+    printf("%-6s %10s %12s %12s %12s\n", "type", "messages", "avg ns", "min ns", "max ns");
+    run("sync", TEST_MESSAGE_SYNC, iterations);
+    run("async", TEST_MESSAGE_ASYNC, iterations);
+    run("none", TEST_MESSAGE_NONE, iterations);
+
+    dispatcher_send_message(&dispatcher, TEST_MESSAGE_QUIT, &payload);
+    pthread_join(thread, NULL);
+    return 0;
+}
@@ -542,6 +542,11 @@ static void produce_command(Test *test)
                 update = test_spice_create_update_from_bitmap(command->bitmap.surface_id,
                         command->bitmap.bbox, command->bitmap.bitmap,
                         command->bitmap.num_clip_rects, command->bitmap.clip_rects);
+                if (command->bitmap.cache_id) {
+                    QXL_SET_IMAGE_ID(&update->image, QXL_IMAGE_GROUP_DEVICE,
+                                     command->bitmap.cache_id);
+                    update->image.descriptor.flags = QXL_IMAGE_CACHE;
+                }
                 break;
             case SIMPLE_DRAW_SOLID:
                 update = test_spice_create_update_solid(command->solid.surface_id,
@@ -46,6 +46,7 @@ typedef struct CommandDrawBitmap {
     uint32_t surface_id;
     uint32_t num_clip_rects;
     QXLRect *clip_rects;
+    uint32_t cache_id; /* if not 0, the image has this id and QXL_IMAGE_CACHE */
 } CommandDrawBitmap;
 
 typedef struct CommandDrawSolid {
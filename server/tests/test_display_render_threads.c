@@ -0,0 +1,144 @@
+/* Draw cached bitmaps with render threads (see spice_server_set_render_threads).
+ *
+ * The bitmaps are drawn on a grid of tiles that don't overlap, so the worker would
+ * batch them to the render threads, and they reuse a few image ids with
+ * QXL_IMAGE_CACHE, so that the worker sees both images to cache and images that are
+ * already in its image cache. The image cache is not thread safe, so these must be
+ * drawn by the worker. After each round the primary surface is updated and checked.
+ *
+ * Run it under valgrind --tool=helgrind to check that the render threads don't touch
+ * the image cache.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test_display_base.h"
+
+#define WIDTH 1024
+#define HEIGHT 768
+#define TILE_WIDTH 128
+#define TILE_HEIGHT 96
+#define TILES_X (WIDTH / TILE_WIDTH)
+#define TILES_Y (HEIGHT / TILE_HEIGHT)
+#define NUM_TILES (TILES_X * TILES_Y)
+#define NUM_IMAGES 5
+#define NUM_ROUNDS 20
+#define RENDER_THREADS 4
+
+static int round_num;
+
+static uint32_t tile_image(int round, int tile)
+{
+    return (round + tile) % NUM_IMAGES;
+}
+
+static uint32_t image_pixel(uint32_t image, int x, int y)
+{
+    return ((image + 1) * 0x3f1d29 + x * 0x010300 + y * 0x000107) & 0xffffff;
+}
+
+static void create_tile(Test *test, Command *command)
+{
+    static int tile;
+    CommandDrawBitmap *cmd = &command->bitmap;
+    uint32_t image = tile_image(round_num, tile);
+    uint32_t *dst;
+    int x, y;
+
+    cmd->surface_id = 0;
+    cmd->bbox.left = (tile % TILES_X) * TILE_WIDTH;
+    cmd->bbox.top = (tile / TILES_X) * TILE_HEIGHT;
+    cmd->bbox.right = cmd->bbox.left + TILE_WIDTH;
+    cmd->bbox.bottom = cmd->bbox.top + TILE_HEIGHT;
+    cmd->num_clip_rects = 0;
+    cmd->cache_id = 0x10000 + image;
+    cmd->bitmap = malloc(TILE_WIDTH * TILE_HEIGHT * 4);
+    dst = (uint32_t *)cmd->bitmap;
+    for (y = 0; y < TILE_HEIGHT; y++) {
+        for (x = 0; x < TILE_WIDTH; x++) {
+            *dst++ = image_pixel(image, x, y);
+        }
+    }
+    tile = (tile + 1) % NUM_TILES;
+}
+
+/* the primary surface has a negative stride, so its first line is the last one in
+ * memory */
+static uint32_t surface_pixel(Test *test, int x, int y)
+{
+    uint32_t *line = (uint32_t *)test->primary_surface + (HEIGHT - 1 - y) * WIDTH;
+
+    return line[x] & 0xffffff;
+}
+
+static void check_surface(Test *test, Command *command)
+{
+    int tile, x, y;
+
+    for (tile = 0; tile < NUM_TILES; tile++) {
+        uint32_t image = tile_image(round_num, tile);
+        int left = (tile % TILES_X) * TILE_WIDTH;
+        int top = (tile / TILES_X) * TILE_HEIGHT;
+
+        for (y = 0; y < TILE_HEIGHT; y++) {
+            for (x = 0; x < TILE_WIDTH; x++) {
+                if (surface_pixel(test, left + x, top + y) != image_pixel(image, x, y)) {
+                    fprintf(stderr, "round %d: tile %d differs at %d,%d\n", round_num, tile,
+                            x, y);
+                    exit(1);
+                }
+            }
+        }
+    }
+    printf("round %d ok\n", round_num);
+    if (++round_num == NUM_ROUNDS) {
+        exit(0);
+    }
+}
+
+static void get_commands(Command **commands, int *num_commands)
+{
+    Command *command;
+    int i;
+
+    /* primary, a round of tiles, update, check */
+    *num_commands = 2 + NUM_TILES + 2;
+    *commands = calloc(sizeof(Command), *num_commands);
+    command = *commands;
+
+    command->command = DESTROY_PRIMARY;
+    command++;
+    command->command = CREATE_PRIMARY;
+    command->create_primary.width = WIDTH;
+    command->create_primary.height = HEIGHT;
+    command++;
+    for (i = 0; i < NUM_TILES; i++, command++) {
+        command->command = SIMPLE_DRAW_BITMAP;
+        command->cb = create_tile;
+    }
+    command->command = SIMPLE_UPDATE;
+    command++;
+    command->command = PATH_PROGRESS;
+    command->cb = check_surface;
+}
+
+int main(int argc, char **argv)
+{
+    SpiceCoreInterface *core;
+    Command *commands;
+    int num_commands;
+    Test *test;
+
+    spice_test_config_parse_args(argc, argv);
+    core = basic_event_loop_init();
+    test = test_new(core);
+    spice_server_set_render_threads(test->server, RENDER_THREADS);
+    test_add_display_interface(test);
+    get_commands(&commands, &num_commands);
+    test_set_command_list(test, commands, num_commands);
+    basic_event_loop_mainloop();
+    free(commands);
+    return 0;
+}
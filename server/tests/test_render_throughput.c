@@ -0,0 +1,335 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Throughput benchmark of the server side software canvas, drawing a trace of
+ * operations on a 32 bit surface:
+ *  serial   - all the operations are drawn by a single canvas, like the red worker
+ *             does without render threads.
+ *  parallel - the operations are drawn by a RedRenderPool, like the red worker does with
+ *             spice_server_set_render_threads, with the same helpers: large solid fills
+ *             are split to bands (red_render_pool_split_bands), and other operations are
+ *             batched as long as they don't touch the batch (red_render_pool_add_area).
+ * The surfaces that the two modes produce are compared at the end.
+ *
+ * The trace is a text file with one operation per line:
+ *   fill <left> <top> <right> <bottom> <color>
+ *   copy <left> <top> <right> <bottom>        (from a bitmap of the same size)
+ * Without a trace, a synthetic one with a mix of full screen fills, window sized copies
+ * and small fills (text like) is generated.
+ *
+ * usage: test_render_throughput [-t threads] [-n repeat] [trace]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "common/quic.h"
+#include "reds_sw_canvas.h"
+#include "red_render_pool.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define MAX_OPS 100000
+#define SYNTHETIC_OPS 2000
+
+enum {
+    OP_FILL,
+    OP_COPY,
+};
+
+typedef struct Op {
+    int type;
+    SpiceRect bbox;
+    uint32_t color;
+    SpiceImage *image;
+} Op;
+
+typedef struct Job {
+    RedRenderJob job;
+    Op *op;
+    SpiceClip clip;
+} Job;
+
+static Op ops[MAX_OPS];
+static int num_ops;
+static SpiceCanvas *canvases[RED_RENDER_MAX_THREADS + 1];
+static SpiceClip no_clip = { SPICE_CLIP_TYPE_NONE, NULL };
+
+static uint64_t now_ns(void)
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return ((uint64_t) time.tv_sec) * 1000000000 + time.tv_nsec;
+}
+
+static SpiceImage *create_bitmap(int width, int height)
+{
+    SpiceImage *image = spice_new0(SpiceImage, 1);
+    uint32_t *data = spice_new(uint32_t, width * height);
+    int i;
+
+    for (i = 0; i < width * height; i++) {
+        data[i] = rand();
+    }
+    image->descriptor.type = SPICE_IMAGE_TYPE_BITMAP;
+    image->descriptor.width = width;
+    image->descriptor.height = height;
+    image->u.bitmap.format = SPICE_BITMAP_FMT_32BIT;
+    image->u.bitmap.flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    image->u.bitmap.x = width;
+    image->u.bitmap.y = height;
+    image->u.bitmap.stride = width * 4;
+    image->u.bitmap.data = spice_chunks_new_linear((uint8_t *)data, width * height * 4);
+    return image;
+}
+
+static void add_op(int type, int left, int top, int right, int bottom, uint32_t color)
+{
+    Op *op;
+
+    if (num_ops == MAX_OPS) {
+        return;
+    }
+    left = MAX(left, 0);
+    top = MAX(top, 0);
+    right = MIN(right, WIDTH);
+    bottom = MIN(bottom, HEIGHT);
+    if (left >= right || top >= bottom) {
+        return;
+    }
+    op = &ops[num_ops++];
+    op->type = type;
+    op->bbox.left = left;
+    op->bbox.top = top;
+    op->bbox.right = right;
+    op->bbox.bottom = bottom;
+    op->color = color;
+    if (type == OP_COPY) {
+        op->image = create_bitmap(right - left, bottom - top);
+    }
+}
+
+static void load_trace(const char *path)
+{
+    char line[256], name[16];
+    int left, top, right, bottom;
+    unsigned int color;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        color = 0;
+        if (sscanf(line, "%15s %d %d %d %d %x", name, &left, &top, &right, &bottom,
+                   &color) < 5) {
+            continue;
+        }
+        if (!strcmp(name, "fill")) {
+            add_op(OP_FILL, left, top, right, bottom, color);
+        } else if (!strcmp(name, "copy")) {
+            add_op(OP_COPY, left, top, right, bottom, 0);
+        }
+    }
+    fclose(f);
+}
+
+static void generate_trace(void)
+{
+    int i, x, y;
+
+    for (i = 0; i < SYNTHETIC_OPS; i++) {
+        x = rand() % WIDTH;
+        y = rand() % HEIGHT;
+        switch (i % 20) {
+        case 0:
+            add_op(OP_FILL, 0, 0, WIDTH, HEIGHT, rand());
+            break;
+        case 1:
+        case 2:
+            add_op(OP_COPY, x, y, x + 200 + rand() % 600, y + 150 + rand() % 450, 0);
+            break;
+        default:
+            add_op(OP_FILL, x, y, x + 8 + rand() % 120, y + 16, rand());
+            break;
+        }
+    }
+}
+
+static void draw_op(SpiceCanvas *canvas, Op *op, SpiceClip *clip)
+{
+    if (op->type == OP_FILL) {
+        SpiceFill fill;
+
+        memset(&fill, 0, sizeof(fill));
+        fill.brush.type = SPICE_BRUSH_TYPE_SOLID;
+        fill.brush.u.color = op->color;
+        fill.rop_descriptor = SPICE_ROPD_OP_PUT;
+        canvas->ops->draw_fill(canvas, &op->bbox, clip, &fill);
+    } else {
+        SpiceCopy copy;
+
+        memset(&copy, 0, sizeof(copy));
+        copy.src_bitmap = op->image;
+        copy.src_area.right = op->bbox.right - op->bbox.left;
+        copy.src_area.bottom = op->bbox.bottom - op->bbox.top;
+        copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+        copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+        canvas->ops->draw_copy(canvas, &op->bbox, clip, &copy);
+    }
+}
+
+static void run_job(RedRenderJob *red_job, int thread_index)
+{
+    Job *job = SPICE_CONTAINEROF(red_job, Job, job);
+
+    draw_op(canvases[thread_index], job->op, &job->clip);
+}
+
+/* see red_draw_drawable_async and red_draw_tiled in red_worker.c */
+static void draw_parallel(RedRenderPool *pool, Job *jobs)
+{
+    int i, j;
+
+    for (i = 0; i < num_ops; i++) {
+        Op *op = &ops[i];
+
+        if (op->type == OP_FILL && red_render_rect_can_tile(&op->bbox)) {
+            SpiceRect bands[RED_RENDER_MAX_THREADS + 1];
+            Job tiles[RED_RENDER_MAX_THREADS + 1];
+            struct {
+                uint32_t num_rects;
+                SpiceRect rect;
+            } rects[RED_RENDER_MAX_THREADS + 1];
+            int num_tiles;
+
+            red_render_pool_wait(pool);
+            num_tiles = red_render_pool_split_bands(pool, &op->bbox, bands);
+            for (j = 0; j < num_tiles; j++) {
+                rects[j].num_rects = 1;
+                rects[j].rect = bands[j];
+                red_render_job_init(&tiles[j].job, run_job);
+                tiles[j].op = op;
+                tiles[j].clip.type = SPICE_CLIP_TYPE_RECTS;
+                tiles[j].clip.rects = (SpiceClipRects *)&rects[j];
+                red_render_pool_add(pool, &tiles[j].job);
+            }
+            red_render_pool_wait(pool);
+            continue;
+        }
+
+        if (red_render_pool_batch_touches(pool, &op->bbox)) {
+            red_render_pool_wait(pool);
+        }
+        red_render_job_init(&jobs[i].job, run_job);
+        jobs[i].op = op;
+        jobs[i].clip = no_clip;
+        red_render_pool_add_area(pool, &jobs[i].job, &op->bbox);
+    }
+    red_render_pool_wait(pool);
+}
+
+static void report(const char *name, uint64_t time, uint64_t pixels, int repeat)
+{
+    printf("%-10s %10.1f %12.1f %12.1f\n", name, (double)time / repeat / 1000000,
+           (double)num_ops * repeat * 1000000000 / time,
+           (double)pixels * repeat * 1000 / time);
+}
+
+int main(int argc, char **argv)
+{
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    int repeat = 10;
+    uint32_t *serial_data, *parallel_data;
+    SpiceCanvas *serial_canvas;
+    RedRenderPool *pool;
+    Job *jobs;
+    uint64_t pixels = 0, start, serial_time, parallel_time;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            num_threads = atoi(optarg);
+            break;
+        case 'n':
+            repeat = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-n repeat] [trace]\n", argv[0]);
+            return 1;
+        }
+    }
+    num_threads = MAX(1, MIN(num_threads, RED_RENDER_MAX_THREADS));
+    repeat = MAX(repeat, 1);
+
+    srand(1);
+    if (optind < argc) {
+        load_trace(argv[optind]);
+    } else {
+        generate_trace();
+    }
+    for (i = 0; i < num_ops; i++) {
+        pixels += (ops[i].bbox.right - ops[i].bbox.left) * (ops[i].bbox.bottom - ops[i].bbox.top);
+    }
+
+    quic_init();
+    sw_canvas_init();
+    serial_data = spice_new0(uint32_t, WIDTH * HEIGHT);
+    parallel_data = spice_new0(uint32_t, WIDTH * HEIGHT);
+    serial_canvas = canvas_create_for_data(WIDTH, HEIGHT, SPICE_SURFACE_FMT_32_xRGB,
+                                           (uint8_t *)serial_data, WIDTH * 4,
+                                           NULL, NULL, NULL, NULL, NULL);
+    pool = red_render_pool_new(num_threads);
+    if (!pool) {
+        fprintf(stderr, "failed to create the render pool\n");
+        return 1;
+    }
+    for (i = 0; i <= red_render_pool_get_num_threads(pool); i++) {
+        canvases[i] = canvas_create_for_data(WIDTH, HEIGHT, SPICE_SURFACE_FMT_32_xRGB,
+                                             (uint8_t *)parallel_data, WIDTH * 4,
+                                             NULL, NULL, NULL, NULL, NULL);
+    }
+    jobs = spice_new0(Job, num_ops);
+
+    printf("%d operations, %.1f Mpixels, %d render threads\n", num_ops,
+           (double)pixels / 1000000, red_render_pool_get_num_threads(pool));
+    printf("%-10s %10s %12s %12s\n", "mode", "ms/trace", "ops/s", "Mpixels/s");
+
+    start = now_ns();
+    for (i = 0; i < repeat; i++) {
+        int j;
+
+        for (j = 0; j < num_ops; j++) {
+            draw_op(serial_canvas, &ops[j], &no_clip);
+        }
+    }
+    serial_time = now_ns() - start;
+    report("serial", serial_time, pixels, repeat);
+
+    start = now_ns();
+    for (i = 0; i < repeat; i++) {
+        draw_parallel(pool, jobs);
+    }
+    parallel_time = now_ns() - start;
+    report("parallel", parallel_time, pixels, repeat);
+
+    if (memcmp(serial_data, parallel_data, WIDTH * HEIGHT * 4)) {
+        fprintf(stderr, "the parallel rendering differs from the serial one\n");
+        return 1;
+    }
+    printf("speedup %.2f\n", (double)serial_time / parallel_time);
+
+    red_render_pool_destroy(pool);
+    for (i = 0; i <= RED_RENDER_MAX_THREADS; i++) {
+        if (canvases[i]) {
+            canvases[i]->ops->destroy(canvases[i]);
+        }
+    }
+    serial_canvas->ops->destroy(serial_canvas);
+    return 0;
+}
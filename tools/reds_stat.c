@@ -19,7 +19,9 @@
 #include <config.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -29,9 +31,21 @@
 #define TAB_LEN 4
 #define VALUE_TABS 7
 #define INVALID_STAT_REF (~(uint32_t)0)
+#define TOP_DEFAULT_ROWS 20
+#define TOP_PATH_LEN 256
 
 static SpiceStat *reds_stat = NULL;
 static uint64_t *values = NULL;
+static uint32_t max_nodes = 0;
+
+typedef struct TopEntry {
+    char path[TOP_PATH_LEN];
+    uint64_t value;
+    uint64_t delta;
+} TopEntry;
+
+static TopEntry *top_entries = NULL;
+static int top_num_entries = 0;
 
 void print_stat_tree(int32_t node_index, int depth)
 {
@@ -56,23 +70,141 @@ void print_stat_tree(int32_t node_index, int depth)
     }
 }
 
+static void print_json_string(const char *str)
+{
+    putchar('"');
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            putchar('\\');
+        }
+        putchar(*str);
+    }
+    putchar('"');
+}
+
+/* prints the visible siblings starting at node_index as members of a json object */
+static void print_json_tree(uint32_t node_index, int depth)
+{
+    int first = 1;
+
+    while (node_index != INVALID_STAT_REF && node_index < max_nodes) {
+        SpiceStatNode *node = &reds_stat->nodes[node_index];
+
+        if ((node->flags & SPICE_STAT_NODE_MASK_SHOW) == SPICE_STAT_NODE_MASK_SHOW) {
+            printf("%s\n%*s", first ? "" : ",", (depth + 1) * TAB_LEN, "");
+            print_json_string(node->name);
+            if (node->flags & SPICE_STAT_NODE_FLAG_VALUE) {
+                printf(": %llu", (unsigned long long)node->value);
+            } else {
+                printf(": {");
+                print_json_tree(node->first_child_index, depth + 1);
+                printf("\n%*s}", (depth + 1) * TAB_LEN, "");
+            }
+            first = 0;
+        }
+        node_index = node->next_sibling_index;
+    }
+}
+
+static void collect_top_entries(uint32_t node_index, const char *prefix)
+{
+    while (node_index != INVALID_STAT_REF && node_index < max_nodes) {
+        SpiceStatNode *node = &reds_stat->nodes[node_index];
+        char path[TOP_PATH_LEN];
+
+        if ((node->flags & SPICE_STAT_NODE_MASK_SHOW) == SPICE_STAT_NODE_MASK_SHOW) {
+            snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix ? "/" : "", node->name);
+            if (node->flags & SPICE_STAT_NODE_FLAG_VALUE) {
+                TopEntry *entry = &top_entries[top_num_entries++];
+
+                strcpy(entry->path, path);
+                entry->value = node->value;
+                entry->delta = node->value - values[node_index];
+                values[node_index] = node->value;
+            } else {
+                collect_top_entries(node->first_child_index, path);
+            }
+        }
+        node_index = node->next_sibling_index;
+    }
+}
+
+static int top_entry_cmp(const void *a, const void *b)
+{
+    const TopEntry *entry_a = a;
+    const TopEntry *entry_b = b;
+
+    if (entry_a->delta != entry_b->delta) {
+        return entry_a->delta < entry_b->delta ? 1 : -1;
+    }
+    return strcmp(entry_a->path, entry_b->path);
+}
+
+/* prints the counters that changed the most during the last interval */
+static void print_top(int rows)
+{
+    int i;
+
+    top_num_entries = 0;
+    collect_top_entries(reds_stat->root_index, "");
+    qsort(top_entries, top_num_entries, sizeof(TopEntry), top_entry_cmp);
+    printf("%-60s %20s %20s\n", "counter", "per second", "total");
+    for (i = 0; i < top_num_entries && i < rows; i++) {
+        printf("%-60s %20llu %20llu\n", top_entries[i].path,
+               (unsigned long long)top_entries[i].delta,
+               (unsigned long long)top_entries[i].value);
+    }
+}
+
+static void usage(void)
+{
+    printf("usage: reds_stat [-j | -t [rows]] [qemu_pid] (e.g. `pgrep qemu`)\n");
+    printf("    -j          dump the statistics once, in json format\n");
+    printf("    -t [rows]   show the counters with the highest rate, sorted (default %d rows)\n",
+           TOP_DEFAULT_ROWS);
+}
+
 int main(int argc, char **argv)
 {
     char *shm_name;
     pid_t kvm_pid;
-    uint64_t *val;
-    uint32_t num_of_nodes = 0;
+    struct stat shm_stat;
     size_t shm_size;
-    size_t shm_old_size;
     int shm_name_len;
+    int json = 0;
+    int top_rows = 0;
     int ret = -1;
     int fd;
+    int opt;
 
-    if (argc != 2 || !(kvm_pid = atoi(argv[1]))) {
-        printf("usage: reds_stat [qemu_pid] (e.g. `pgrep qemu`)\n");
+    while ((opt = getopt(argc, argv, "jt::h")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 't':
+            top_rows = TOP_DEFAULT_ROWS;
+            if (optarg) {
+                top_rows = atoi(optarg);
+            } else if (optind < argc - 1) {
+                /* allow "-t 10 pid" in addition to "-t10 pid" */
+                top_rows = atoi(argv[optind++]);
+            }
+            if (top_rows <= 0) {
+                usage();
+                return -1;
+            }
+            break;
+        default:
+            usage();
+            return -1;
+        }
+    }
+    if (optind != argc - 1 || !(kvm_pid = atoi(argv[optind]))) {
+        usage();
         return -1;
     }
-    shm_name_len = strlen(SPICE_STAT_SHM_NAME) + strlen(argv[1]);
+    shm_name_len = strlen(SPICE_STAT_SHM_NAME) + strlen(argv[optind]);
     if (!(shm_name = (char *)malloc(shm_name_len))) {
         perror("malloc");
         return -1;
@@ -83,7 +215,18 @@ int main(int argc, char **argv)
         free(shm_name);
         return -1;
     }
-    shm_size = sizeof(SpiceStat);
+    /* the server allocates all the nodes upfront, and removed nodes are reused,
+     * so node indices may exceed num_of_nodes: always map the whole segment */
+    if (fstat(fd, &shm_stat) == -1) {
+        perror("fstat");
+        goto error1;
+    }
+    shm_size = shm_stat.st_size;
+    if (shm_size < sizeof(SpiceStat)) {
+        printf("bad shared memory size %zu\n", shm_size);
+        goto error1;
+    }
+    max_nodes = (shm_size - sizeof(SpiceStat)) / sizeof(SpiceStatNode);
     reds_stat = (SpiceStat *)mmap(NULL, shm_size, PROT_READ, MAP_SHARED, fd, 0);
     if (reds_stat == (SpiceStat *)MAP_FAILED) {
         perror("mmap");
@@ -97,31 +240,35 @@ int main(int argc, char **argv)
         printf("bad version %u\n", reds_stat->version);
         goto error2;
     }
+    if (json) {
+        printf("{");
+        print_json_tree(reds_stat->root_index, 0);
+        printf("\n}\n");
+        munmap(reds_stat, shm_size);
+        close(fd);
+        free(shm_name);
+        return 0;
+    }
+    values = (uint64_t *)calloc(max_nodes, sizeof(uint64_t));
+    top_entries = (TopEntry *)calloc(max_nodes, sizeof(TopEntry));
+    if (values == NULL || top_entries == NULL) {
+        perror("calloc");
+        goto error3;
+    }
     while (1) {
         system("clear");
         printf("spice statistics\n\n");
-        if (num_of_nodes != reds_stat->num_of_nodes) {
-            num_of_nodes = reds_stat->num_of_nodes;
-            shm_old_size = shm_size;
-            shm_size = sizeof(SpiceStat) + num_of_nodes * sizeof(SpiceStatNode);
-            reds_stat = mremap(reds_stat, shm_old_size, shm_size, MREMAP_MAYMOVE);
-            if (reds_stat == (SpiceStat *)MAP_FAILED) {
-                perror("mremap");
-                goto error3;
-            }
-            values = (uint64_t *)realloc(values, num_of_nodes * sizeof(uint64_t));
-            if (values == NULL) {
-                perror("realloc");
-                goto error3;
-            }
-            memset(values, 0, num_of_nodes * sizeof(uint64_t));
+        if (top_rows) {
+            print_top(top_rows);
+        } else if (reds_stat->root_index < max_nodes) {
+            print_stat_tree(reds_stat->root_index, 0);
         }
-        print_stat_tree(reds_stat->root_index, 0);
         sleep(1);
     }
     ret = 0;
 
 error3:
+    free(top_entries);
     free(values);
 error2:
     munmap(reds_stat, shm_size);
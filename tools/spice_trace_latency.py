@@ -0,0 +1,189 @@
+#!/usr/bin/env python
+"""
+Per command latency breakdown from a trace of the spice server USDT probes
+(see server/red_trace.h, enabled with --enable-usdt).
+
+Recording a trace with perf:
+
+    perf buildid-cache --add /usr/lib64/libspice-server.so.1
+    perf probe -x /usr/lib64/libspice-server.so.1 'sdt_spice_server:*'
+    perf record -e 'sdt_spice_server:*' -p `pgrep qemu` -- sleep 10
+    perf script > trace.txt
+    spice_trace_latency.py trace.txt
+
+Each drawable command is followed through the stages:
+
+    process   cmd_fetch -> drawable_insert      parsing and adding to the tree
+    tree      drawable_insert -> drawable_pipe_add
+    pipe      drawable_pipe_add -> marshall_start waiting in the channel client pipe
+    marshall  marshall_start -> marshall_end      without the compression time
+    compress  compress_start -> compress_end      sum over the images of the drawable
+    send      marshall_end -> msg_sent            writing to the socket
+"""
+
+import re
+import sys
+from optparse import OptionParser
+
+STAGES = ['process', 'tree', 'pipe', 'marshall', 'compress', 'send', 'total']
+CODECS = ['quic', 'lz', 'glz', 'zlib_glz', 'jpeg', 'jpeg_alpha']
+
+# e.g. "qemu-kvm  4321 [001]  1234.567890: sdt_spice_server:cmd_fetch: (7f00a0b1c2d3) arg1=0 ..."
+LINE_RE = re.compile(r'^\s*\S.*?\s+(\d+)\s+(?:\[\d+\]\s+)?(\d+\.\d+):\s+'
+                     r'(?:sdt_)?spice_server:(\w+):.*?((?:\s+arg\d+=\S+)*)\s*$')
+ARG_RE = re.compile(r'arg(\d+)=(\S+)')
+
+
+class Command(object):
+    def __init__(self, cmd_type, data, time):
+        self.cmd_type = cmd_type
+        self.data = data
+        self.fetch = time
+        self.insert = None
+        self.pipe_add = None
+        self.marshall_start = None
+        self.marshall_end = None
+        self.sent = None
+        self.compress = 0.0
+        self.codecs = []
+        self.size = 0
+
+    def copy(self):
+        cmd = Command(self.cmd_type, self.data, self.fetch)
+        cmd.insert = self.insert
+        return cmd
+
+    def stages(self):
+        marshall = self.marshall_end - self.marshall_start - self.compress
+        return {
+            'process': self.insert - self.fetch,
+            'tree': self.pipe_add - self.insert,
+            'pipe': self.marshall_start - self.pipe_add,
+            'marshall': max(marshall, 0.0),
+            'compress': self.compress,
+            'send': self.sent - self.marshall_end,
+            'total': self.sent - self.fetch,
+        }
+
+
+class Tracer(object):
+    def __init__(self):
+        self.fetched = {}       # tid -> last fetched Command
+        self.drawables = {}     # drawable -> Command
+        self.items = {}         # pipe item -> Command
+        self.marshalling = {}   # tid -> Command being marshalled
+        self.compressing = {}   # tid -> compress start time
+        self.sending = {}       # rcc -> Command being sent
+        self.done = []
+
+    def event(self, tid, time, name, args):
+        handler = getattr(self, 'on_' + name, None)
+        if handler:
+            handler(tid, time, args)
+
+    def on_cmd_fetch(self, tid, time, args):
+        self.fetched[tid] = Command(args[1], args[2], time)
+
+    def on_drawable_insert(self, tid, time, args):
+        cmd = self.fetched.pop(tid, None)
+        if cmd:
+            cmd.insert = time
+            self.drawables[args[0]] = cmd
+
+    def on_drawable_pipe_add(self, tid, time, args):
+        cmd = self.drawables.get(args[0])
+        if cmd:
+            # a drawable is sent to each of the clients, and sometimes more than once
+            cmd = cmd.copy()
+            cmd.pipe_add = time
+            self.items[args[1]] = cmd
+
+    def on_marshall_start(self, tid, time, args):
+        cmd = self.items.pop(args[1], None)
+        if cmd:
+            cmd.marshall_start = time
+            self.marshalling[tid] = cmd
+        else:
+            self.marshalling.pop(tid, None)
+
+    def on_compress_start(self, tid, time, args):
+        self.compressing[tid] = time
+
+    def on_compress_end(self, tid, time, args):
+        start = self.compressing.pop(tid, None)
+        cmd = self.marshalling.get(tid)
+        if cmd and start is not None:
+            cmd.compress += time - start
+            cmd.codecs.append(CODECS[args[0]] if args[0] < len(CODECS) else str(args[0]))
+
+    def on_marshall_end(self, tid, time, args):
+        cmd = self.marshalling.pop(tid, None)
+        if cmd:
+            cmd.marshall_end = time
+            cmd.size = args[2]
+            self.sending[args[0]] = cmd
+        else:
+            self.sending.pop(args[0], None)
+
+    def on_msg_sent(self, tid, time, args):
+        cmd = self.sending.pop(args[0], None)
+        if cmd:
+            cmd.sent = time
+            self.done.append(cmd)
+
+
+def percentile(values, p):
+    return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+
+def print_summary(commands):
+    print('%d commands\n' % len(commands))
+    print('%-10s %10s %10s %10s %10s %10s' % ('stage (ms)', 'mean', 'p50', 'p95', 'p99', 'max'))
+    all_stages = [cmd.stages() for cmd in commands]
+    for stage in STAGES:
+        values = sorted(s[stage] * 1000 for s in all_stages)
+        print('%-10s %10.3f %10.3f %10.3f %10.3f %10.3f' %
+              (stage, sum(values) / len(values), percentile(values, 50),
+               percentile(values, 95), percentile(values, 99), values[-1]))
+
+
+def print_slowest(commands, count):
+    print('\nslowest commands (ms):')
+    print('%-14s %4s %8s ' % ('fetch time', 'type', 'bytes') +
+          ' '.join('%8s' % s for s in STAGES) + '  codecs')
+    for cmd in sorted(commands, key=lambda c: c.sent - c.fetch, reverse=True)[:count]:
+        stages = cmd.stages()
+        print('%-14.6f %4d %8d ' % (cmd.fetch, cmd.cmd_type, cmd.size) +
+              ' '.join('%8.3f' % (stages[s] * 1000) for s in STAGES) +
+              '  ' + ','.join(cmd.codecs))
+
+
+def main():
+    parser = OptionParser(usage='%prog [options] [perf script output]')
+    parser.add_option('-n', '--slowest', type='int', default=10,
+                      help='number of slowest commands to list (default 10)')
+    options, args = parser.parse_args()
+    trace = open(args[0]) if args else sys.stdin
+
+    tracer = Tracer()
+    for line in trace:
+        match = LINE_RE.match(line)
+        if not match:
+            continue
+        tid, time, name, args_str = match.groups()
+        args = {}
+        for index, value in ARG_RE.findall(args_str):
+            args[int(index) - 1] = int(value, 0)
+        tracer.event(int(tid), float(time), name, args)
+
+    if not tracer.done:
+        print('no complete commands found in the trace')
+        return 1
+    print_summary(tracer.done)
+    if options.slowest > 0:
+        print_slowest(tracer.done, options.slowest)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())